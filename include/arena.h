@@ -0,0 +1,29 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_DEFAULT_BLOCK (1024 * 1024)
+
+// Bump allocator for memory that lives exactly as long as one operation.
+// Allocations are carved out of large blocks and there is no per-object
+// free; arena_destroy releases everything at once.
+typedef struct arena arena_t;
+
+typedef struct
+{
+    size_t blocks;   // system allocations made
+    size_t reserved; // bytes held in blocks
+    size_t used;     // bytes handed out
+} arena_stats_t;
+
+arena_t *arena_create(size_t block_size);
+void arena_destroy(arena_t *arena);
+
+// Suitably aligned for any type; NULL only when the system is out of memory
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+
+void arena_stats(const arena_t *arena, arena_stats_t *out);
+
+#endif // ARENA_H
@@ -0,0 +1,42 @@
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+
+// Enough for 2^54 chunks, far past any file size we can address
+#define BLAKE3_MAX_DEPTH 54
+
+typedef struct
+{
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+} blake3_chunk_state_t;
+
+// Incremental hasher for streamed content. Whole chunks arriving in large
+// updates are compressed eight at a time when AVX2 is available.
+typedef struct
+{
+    blake3_chunk_state_t chunk;
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+    size_t cv_stack_len;
+} blake3_hasher_t;
+
+void blake3_init(blake3_hasher_t *hasher);
+void blake3_update(blake3_hasher_t *hasher, const void *data, size_t len);
+void blake3_final(const blake3_hasher_t *hasher, unsigned char out[BLAKE3_OUT_LEN]);
+
+// Hashes prefix followed by data, the way object headers precede content.
+// Large messages are split into subtrees that are hashed across threads
+// with parallel_for and joined at the top of the tree.
+void blake3_hash_message(const void *prefix, size_t prefix_len, const void *data, size_t size,
+                         unsigned char out[BLAKE3_OUT_LEN]);
+
+#endif // BLAKE3_H
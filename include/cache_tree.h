@@ -0,0 +1,56 @@
+#ifndef CACHE_TREE_H
+#define CACHE_TREE_H
+
+#include "oid.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The cache tree remembers, for each directory in the index, the id of the
+// tree last written for it and how many index entries lie below it.
+// Staging a file invalidates only the directories on its path, so a commit
+// hashes and writes just those trees and takes every other one as is.
+//
+// The index carries it as an extension: CACHE_TREE_SIGNATURE, a 32-bit
+// length, then every directory in preorder, root first, as its
+// NUL-terminated name ("" for the root), its entry count
+// (CACHE_TREE_INVALID once it has changed), its number of subdirectories
+// and, when valid, its tree id. Integers are big-endian.
+#define CACHE_TREE_SIGNATURE 0x54524545 // "TREE"
+#define CACHE_TREE_INVALID 0xffffffff
+
+typedef struct cache_tree cache_tree_t;
+struct cache_tree
+{
+    uint32_t entry_count; // CACHE_TREE_INVALID until the tree is written again
+    object_id_t oid;
+    cache_tree_t **subtrees; // sorted by name
+    size_t subtree_count;
+    size_t subtree_capacity;
+    int listed; // seen while its parent was listed, see cache_tree_prune
+    char name[];
+};
+
+// An invalid directory with no subdirectories yet
+cache_tree_t *cache_tree_new(const char *name, size_t len);
+void cache_tree_free(cache_tree_t *tree);
+
+// The subdirectory of that name; with create, a missing one is added as
+// invalid. NULL when missing or out of memory.
+cache_tree_t *cache_tree_sub(cache_tree_t *tree, const char *name, size_t len, int create);
+
+// Drops the subdirectories not marked listed, and clears the marks; for a
+// directory whose contents were just listed again
+void cache_tree_prune(cache_tree_t *tree);
+
+// Invalidates the root and every directory leading to path. If path was a
+// directory itself, it is dropped along with everything below it.
+void cache_tree_invalidate(cache_tree_t *root, const char *path);
+
+// Size of the extension's payload, and the payload itself
+size_t cache_tree_size(const cache_tree_t *root);
+void cache_tree_write(const cache_tree_t *root, unsigned char *out);
+// NULL when the payload is malformed or memory runs out
+cache_tree_t *cache_tree_read(const unsigned char *data, size_t size);
+
+#endif // CACHE_TREE_H
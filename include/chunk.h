@@ -0,0 +1,49 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include "oid.h"
+
+#include <stddef.h>
+
+// Content-defined chunking for large files (FastCDC). A file at or above
+// the threshold is cut where a rolling gear hash of its content hits a
+// mask, so an edit only moves the cuts next to it. Each chunk is stored
+// once as an ordinary blob, and the file itself becomes a chunk list: an
+// OBJ_CHUNKS object holding one record per chunk, in file order, of the
+// chunk's id followed by its size as 8 big-endian bytes. Trees point at
+// the chunk list where they would point at the blob.
+#define CHUNK_MIN_SIZE (16 * 1024)
+#define CHUNK_AVG_SIZE (64 * 1024)
+#define CHUNK_MAX_SIZE (256 * 1024)
+#define CHUNK_RECORD_SIZE (SHA256_SIZE + 8)
+
+// Files of at least this many bytes are chunked (core.chunkThreshold, in
+// MiB); 0, the default, stores every file as one blob
+void chunk_set_threshold(size_t bytes);
+int chunk_applies(size_t file_size);
+
+// Length of the chunk starting at data, at most size
+size_t chunk_next(const unsigned char *data, size_t size);
+
+// Id the file behind fd would be stored under as a chunk list, without
+// writing anything
+int chunk_hash_fd(int fd, size_t size, object_id_t *out_oid);
+
+// Stores the chunks that are new and the chunk list. Totals for
+// chunk_report are kept across calls.
+int chunk_write_fd(int fd, size_t size, object_id_t *out_oid);
+
+// Prints how much chunked content was stored and how much of it was
+// already there, if anything was chunked
+void chunk_report(void);
+
+// Splits one record of a chunk list
+void chunk_record(const unsigned char *record, object_id_t *oid, size_t *size);
+
+// Size of the file a chunk list describes, from its records
+int chunk_content_size(const object_id_t *list_oid, size_t *out_size);
+
+// Writes the file a chunk list describes to fd, one chunk at a time
+int chunk_stream(const object_id_t *list_oid, int fd);
+
+#endif // CHUNK_H
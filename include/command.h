@@ -8,6 +8,10 @@ command_t *command_add();
 command_t *command_commit();
 command_t *command_status();
 command_t *command_log();
+command_t *command_repack();
+command_t *command_commit_graph();
+command_t *command_fsck();
+command_t *command_cat_file();
 
 // Advanced commands (maybe implement later)
 
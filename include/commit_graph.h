@@ -0,0 +1,49 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include "oid.h"
+
+#include <stdint.h>
+#include <time.h>
+
+// The commit graph caches what history walks need from each commit, so
+// they can step from commit to commit without parsing commit objects.
+// .vcs/commit-graph holds a 256-entry fanout table over the sorted commit
+// ids, like a pack index, then one fixed-size record per commit: its tree
+// id, the position of its parent in the table, its generation number and
+// its commit time, all big-endian. A SHA-256 of everything before it ends
+// the file. The table is closed under parents, so a walk that starts in it
+// stays in it.
+#define COMMIT_GRAPH_FILE ".vcs/commit-graph"
+#define COMMIT_GRAPH_SIGNATURE 0x43475048 // "CGPH"
+#define COMMIT_GRAPH_VERSION 1
+#define COMMIT_GRAPH_NONE 0xffffffff // parent position of a root commit
+
+typedef struct
+{
+    object_id_t tree;
+    uint32_t parent;     // position, COMMIT_GRAPH_NONE for a root commit
+    uint32_t generation; // 1 for a root commit, one more than its parent's otherwise
+    time_t time;         // committer time
+} commit_graph_entry_t;
+
+// Returns 0 and sets out_pos when the commit is in the graph, 1 when it is
+// not or there is no graph. Callers fall back to parsing the commit then.
+int commit_graph_find(const object_id_t *oid, uint32_t *out_pos);
+// Positions come from commit_graph_find or an entry's parent
+void commit_graph_id(uint32_t pos, object_id_t *out_oid);
+void commit_graph_entry(uint32_t pos, commit_graph_entry_t *out_entry);
+
+// Tree and parent of a commit, from the graph when the commit is in it and
+// by parsing the commit object otherwise. Either output may be NULL.
+int commit_graph_read_commit(const object_id_t *oid, object_id_t *out_tree, object_id_t *out_parent);
+
+// Rebuilds the graph from every branch, parsing each reachable commit once
+int commit_graph_write(void);
+
+// Adds a new commit whose parent is already in the graph, or which is a
+// root, without reading any other commit. A graph that lacks the parent is
+// rebuilt; without a graph only a root commit starts one.
+int commit_graph_add(const object_id_t *oid, const object_id_t *tree, const object_id_t *parent, time_t time);
+
+#endif // COMMIT_GRAPH_H
@@ -3,13 +3,13 @@
 
 #define PATH_MAX 4096
 #define INDEX_SIGNATURE 0x44495243 // "DIRC"
-#define INDEX_VERSION 2
+#define INDEX_VERSION 4
+#define INDEX_SPLIT_VERSION 5 // an index file over a shared base
 #define HEX_SIZE (SHA256_SIZE * 2 + 1)
 #define SHA256_SIZE 32
-#define FILE_MAX 4096
+#define OBJECT_CHUNK_SIZE (128 * 1024) // streaming I/O granularity for blobs
 #define COMMIT_MSG_MAX 512
 #define OBJECT_HEADER_MAX 27 // type(6) + space(1) + size(20) + null(1)
-#define OBJECT_PATH_MAX 78 // ".vcs/objects/"(12) + "xx/"(3) + hash(62) + null(1)
-#define MAX_CHILDREN 100
+#define OBJECT_PATH_MAX 79 // ".vcs/objects/"(13) + "xx/"(3) + hash(62) + null(1)
 
 #endif // CONFIG_H
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+
+// Copy/insert deltas in the git format: the base and result sizes as
+// varints, then a sequence of ops. An op byte with the high bit set copies a
+// range of the base (the low bits say which offset/size bytes follow); any
+// other non-zero op inserts that many literal bytes from the delta itself.
+
+// Encodes target against base. Fails (returns -1) when the delta would be
+// larger than max_size, so callers can bail out of poor matches early.
+int delta_create(const unsigned char *base, size_t base_size,
+                 const unsigned char *target, size_t target_size,
+                 size_t max_size, unsigned char **out_delta, size_t *out_size);
+
+// Reads the base and result sizes from a delta's header. Returns the header
+// length, or -1 if the delta is malformed.
+int delta_sizes(const unsigned char *delta, size_t delta_size, size_t *base_size, size_t *result_size);
+
+// Rebuilds the target into a caller-provided buffer of exactly result_size
+// bytes, as reported by delta_sizes.
+int delta_apply(const unsigned char *base, size_t base_size,
+                const unsigned char *delta, size_t delta_size,
+                unsigned char *result, size_t result_size);
+
+#endif // DELTA_H
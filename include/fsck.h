@@ -0,0 +1,16 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include "oid.h"
+
+// Re-reads every stored object, loose and packed, and recomputes its id on
+// all cores. Trees and commits are parsed and every id they refer to must
+// be stored too, as must head when it is not null. Packs are checked
+// against their checksums. Problems are reported as they are found and a
+// summary with throughput follows.
+//
+// Returns 0 when the store is intact, 1 when problems were found and -1
+// if the check could not run.
+int fsck_run(const object_id_t *head);
+
+#endif // FSCK_H
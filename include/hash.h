@@ -0,0 +1,42 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include "blake3.h"
+
+#include <stddef.h>
+#include <openssl/evp.h>
+
+// The function object ids are computed with. It is a property of the
+// repository, chosen at init and recorded as core.objectFormat, and set
+// once per process when the repository is opened. Both formats give
+// SHA256_SIZE-byte ids, so object_id_t and the hex forms fit either.
+typedef enum
+{
+    HASH_SHA256,
+    HASH_BLAKE3
+} hash_algo_t;
+
+void hash_set_algo(hash_algo_t algo);
+hash_algo_t hash_get_algo(void);
+
+const char *hash_algo_name(hash_algo_t algo);
+int hash_algo_from_name(const char *name, hash_algo_t *out);
+
+// Streaming context for the repository's hash
+typedef struct
+{
+    hash_algo_t algo;
+    EVP_MD_CTX *evp;
+    blake3_hasher_t blake3;
+} hash_ctx_t;
+
+int hash_init(hash_ctx_t *ctx);
+int hash_update(hash_ctx_t *ctx, const void *data, size_t len);
+int hash_final(hash_ctx_t *ctx, unsigned char *out);
+void hash_release(hash_ctx_t *ctx);
+
+// One-shot hash of prefix followed by data. BLAKE3 hashes large messages
+// across threads; SHA-256 is inherently serial.
+int hash_message(const void *prefix, size_t prefix_len, const void *data, size_t size, unsigned char *out);
+
+#endif // HASH_H
@@ -2,6 +2,7 @@
 #define OBJECT_H
 
 #include "staging.h"
+#include "oid.h"
 
 #include <time.h>
 
@@ -10,7 +11,8 @@ typedef enum
      OBJ_BLOB,
      OBJ_TREE,
      OBJ_COMMIT,
-     OBJ_TAG
+     OBJ_TAG,
+     OBJ_CHUNKS // a large file split into blobs, see chunk.h
 } object_type_t;
 
 typedef union
@@ -25,8 +27,8 @@ typedef union
      } tree;
      struct
      {
-          const char *tree_hash;
-          const char *parent_hash;
+          const object_id_t *tree;
+          const object_id_t *parent;
           const char *message;
           const char *author_name;
           const char *author_email;
@@ -38,13 +40,24 @@ typedef union
 } object_update_t;
 
 typedef struct object object_t;
+typedef struct commit_data commit_data_t;
 
 object_t *object_init(object_type_t type);
 void object_free(object_t *obj);
+const char *object_type_to_string(object_type_t type);
 
 int object_update(object_t *obj, object_update_t data);
-int object_write(object_t *obj, char *out_hash);
-int object_read(object_t *obj, const char *hash);
-int object_get_commit_tree_hash(const char *commit_hash, char *out_tree_hash);
+int object_write(object_t *obj, object_id_t *out_oid);
+int object_read(object_t *obj, const object_id_t *oid);
+// Shared, read-only object from the object cache, parsing it on a miss.
+// Blobs carry only their size; stream their content with odb_stream.
+// Release it with object_free.
+object_t *object_lookup(const object_id_t *oid, object_type_t type);
+// Copies a commit into a caller-provided struct
+int object_read_commit(const object_id_t *oid, commit_data_t *out_commit);
+int object_get_commit_tree(const object_id_t *commit_oid, object_id_t *out_tree_oid);
+// Parses commit content as stored, without the header. content is never
+// written to and need not be NUL-terminated.
+int parse_commit_data(commit_data_t *commit, const char *content, size_t size);
 
 #endif // OBJECT_H
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include "object.h"
+#include "oid.h"
+
+#include <stddef.h>
+
+#define OBJECT_CACHE_DEFAULT_LIMIT (64 * 1024 * 1024)
+
+// Parsed trees and commits, keyed by object id and evicted least recently
+// used first once their footprint passes the limit (core.objectCacheLimit,
+// in MiB; 0 disables the cache). Objects handed out by object_cache_get
+// are shared and read-only; object_free releases the caller's reference.
+// Referenced objects are never evicted, so the limit can be overshot by
+// whatever a walk is holding at once.
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t bytes;
+    size_t peak_bytes;
+    size_t limit;
+} object_cache_stats_t;
+
+void object_cache_set_limit(size_t bytes);
+
+// Returns a referenced object, or NULL on a miss
+object_t *object_cache_get(const object_id_t *oid, object_type_t type);
+
+// Takes over a freshly parsed object. The caller keeps one reference.
+// Returns -1 (and leaves obj private) when the cache is disabled.
+int object_cache_add(object_t *obj);
+
+// Drops a reference taken by object_cache_get or object_cache_add
+void object_cache_release(object_t *obj);
+
+void object_cache_stats(object_cache_stats_t *out);
+
+#endif // OBJECT_CACHE_H
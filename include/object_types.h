@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include "object.h"
+#include "oid.h"
 
 #include <time.h>
 #include <uthash.h>
@@ -11,7 +12,7 @@
 
 typedef struct
 {
-    char hash[HEX_SIZE];
+    object_id_t oid;
     object_type_t type;
     size_t content_size;
 } object_header_t;
@@ -20,11 +21,12 @@ struct object
 {
     object_header_t header;
     void *data;
+    int cached; // shared through the object cache, see object_cache.h
 };
 
 typedef struct
 {
-    unsigned char data[FILE_MAX];
+    char filepath[PATH_MAX];
     size_t size;
 } blob_data_t;
 
@@ -38,7 +40,7 @@ typedef struct tree_entry
 {
     mode_t mode;
     char name[PATH_MAX];
-    char hash[HEX_SIZE];
+    object_id_t oid;
     UT_hash_handle hh;
 } tree_entry_t;
 
@@ -47,6 +49,10 @@ typedef struct tree_data
     tree_entry_t *entries;
     char dirname[PATH_MAX];
     size_t size;
+    // Trees looked up from the store keep their serialized form instead of
+    // entries; walk it with a tree_iter_t
+    unsigned char *raw;
+    size_t raw_size;
 } tree_data_t;
 
 typedef struct
@@ -64,13 +70,13 @@ typedef struct
     off_t offset;
 } signature_t;
 
-typedef struct
+struct commit_data
 {
-    char tree_hash[HEX_SIZE];
-    char parent_hash[HEX_SIZE];
+    object_id_t tree;
+    object_id_t parent; // null for a root commit
     signature_t author;
     signature_t committer;
     char message[COMMIT_MSG_MAX];
-} commit_data_t;
+};
 
 #endif // OBJECT_TYPES_H
\ No newline at end of file
@@ -0,0 +1,152 @@
+#ifndef ODB_H
+#define ODB_H
+
+#include "object.h"
+#include "oid.h"
+
+#include <stddef.h>
+#include <zlib.h>
+
+#define ODB_OBJECTS_DIR ".vcs/objects"
+
+// Loose objects are zlib-compressed unless the level is 0, in which case
+// they are stored raw. Both forms are always readable.
+void odb_set_compression_level(int level);
+int odb_compression_level(void);
+
+// Durability of object writes (core.fsync):
+//   none   - never fsync
+//   batch  - defer to odb_sync_barrier, which flushes everything written
+//            so far in one go; callers invoke it before a ref or the index
+//            starts pointing at new objects
+//   object - fsync every object before it is renamed into place, and its
+//            fanout directory after, so each object is durable on its own
+typedef enum
+{
+    ODB_FSYNC_NONE,
+    ODB_FSYNC_BATCH,
+    ODB_FSYNC_OBJECT
+} odb_fsync_t;
+
+void odb_set_fsync_mode(odb_fsync_t mode);
+odb_fsync_t odb_fsync_mode(void);
+
+// Applies the fsync policy to a freshly written file before it is renamed
+// into the object store
+int odb_sync_written(int fd);
+int odb_sync_barrier(void);
+
+// Streaming writer for loose objects. Content is hashed while it is written
+// to a temporary file, which is renamed into .vcs/objects once the hash is
+// known, so objects of any size are stored in one pass and constant memory.
+typedef struct odb_writer odb_writer_t;
+
+// Whether an object is stored, loose or packed. Loose ids are cached in
+// memory for the life of the process, so repeated checks cost no syscalls.
+int odb_has_object(const object_id_t *oid);
+
+// Computes the id content read from fd would be stored under
+int odb_hash_fd(int fd, object_type_t type, size_t content_size, object_id_t *out_oid);
+
+// Stores an in-memory object. The id is computed first and nothing is
+// written when the object already exists.
+int odb_write(object_type_t type, const void *data, size_t size, object_id_t *out_oid);
+
+// One in-memory object for odb_hash_batch; oid is filled in
+typedef struct
+{
+    object_type_t type;
+    const void *data;
+    size_t size;
+    object_id_t oid;
+} odb_hash_job_t;
+
+// Computes the ids of many small objects in one call, through the
+// multi-buffer SHA-256 engine
+int odb_hash_batch(odb_hash_job_t *jobs, size_t count);
+
+// Like odb_write for content whose id is already known, e.g. from
+// odb_hash_batch; the content is not hashed again
+int odb_write_hashed(object_type_t type, const void *data, size_t size, const object_id_t *oid);
+
+odb_writer_t *odb_writer_open(object_type_t type, size_t content_size);
+int odb_writer_write(odb_writer_t *writer, const void *buf, size_t len);
+int odb_writer_commit(odb_writer_t *writer, object_id_t *out_oid);
+void odb_writer_abort(odb_writer_t *writer);
+
+// A read-only view of an object's content (without header). Large raw
+// loose objects are mapped straight from disk and small ones read in one
+// call; compressed and packed objects are inflated into a recycled
+// scratch buffer. The content is not necessarily
+// NUL-terminated and stays valid until odb_unmap. Objects may be mapped
+// and read from several threads at once, and so can odb_has_object and
+// the writers.
+typedef struct
+{
+    object_type_t type;
+    const unsigned char *data;
+    size_t size;
+    void *map; // file mapping backing data, if any
+    size_t map_size;
+    unsigned char *buffer; // scratch buffer backing data, if any
+    int scratch;
+} odb_object_t;
+
+int odb_map(const object_id_t *oid, odb_object_t *object);
+void odb_unmap(odb_object_t *object);
+
+// odb_map restricted to the loose copy of an object, even when a pack also
+// holds it
+int odb_map_loose(const object_id_t *oid, odb_object_t *object);
+
+// Scratch buffers for object content, shared with the pack reader. slot is
+// -1 when the buffer came from the heap.
+unsigned char *odb_scratch_acquire(size_t size, int *out_slot);
+void odb_scratch_release(unsigned char *buf, int slot);
+
+// A reset inflate stream reused across reads, so zlib's state and window
+// are allocated once per thread.
+z_stream *odb_inflater(void);
+
+// Inflates from zs->next_in into zs->next_out with in_left and out_left
+// bytes available, handing zlib windows of at most UINT_MAX bytes of
+// each. Both counts are reduced by what was used. Returns the last
+// inflate status: Z_STREAM_END at the end, Z_OK or Z_BUF_ERROR once out
+// is full or in runs dry, and an error code otherwise.
+int odb_inflate(z_stream *zs, size_t *in_left, size_t *out_left, int flush);
+
+// Type and size of an object from its header alone, without inflating
+// the content
+int odb_object_info(const object_id_t *oid, object_type_t *type, size_t *size);
+
+// Writes an object's content (without header) to fd in bounded memory.
+// Raw loose objects are copied by the kernel with sendfile where it is
+// available; compressed loose objects and packed entries are inflated a
+// window at a time. Packed deltas are the exception and are rebuilt in
+// memory from their base first.
+int odb_stream(const object_id_t *oid, int fd);
+
+// Reads an object's content (without header) into a malloc'd,
+// NUL-terminated buffer owned by the caller.
+int odb_read(const object_id_t *oid, object_type_t *type, void **out_data, size_t *out_size);
+
+// Calls fn for every loose object id; a non-zero return stops the walk.
+int odb_for_each_loose_object(int (*fn)(const object_id_t *oid, void *ctx), void *ctx);
+
+// Abbreviated ids. A prefix is looked up in the one loose fanout directory
+// its first two digits name, read once and kept sorted, and by binary
+// search in every pack index.
+#define ODB_ABBREV_MIN 4     // shortest prefix accepted
+#define ODB_ABBREV_DEFAULT 7 // shortest prefix printed
+#define ODB_ABBREV_LIST 16   // candidates listed for an ambiguous prefix
+
+// Returns 0 and sets out_oid when exactly one stored object starts with
+// hex, 1 when none does, and -1 after reporting a malformed or ambiguous
+// prefix, with the candidates
+int odb_resolve_abbrev(const char *hex, object_id_t *out_oid);
+
+// Hex digits needed to tell oid apart from every other stored object,
+// but no fewer than min_len
+size_t odb_abbrev_len(const object_id_t *oid, size_t min_len);
+
+#endif // ODB_H
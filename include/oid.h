@@ -0,0 +1,75 @@
+#ifndef OID_H
+#define OID_H
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define OID_ALIGN __attribute__((aligned(16)))
+#else
+#define OID_ALIGN
+#endif
+
+// Object ids are kept as raw SHA-256 digests everywhere inside the program.
+// Hex only appears at the edges: refs, commit headers and what is printed.
+typedef struct
+{
+    unsigned char hash[SHA256_SIZE];
+} OID_ALIGN object_id_t;
+
+// Two 16-byte compares; the aligned layout lets these be plain vector loads
+static inline int oid_equal(const object_id_t *a, const object_id_t *b)
+{
+#if defined(__SSE2__)
+    __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a->hash),
+                                _mm_loadu_si128((const __m128i *)b->hash));
+    __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a->hash + 16)),
+                                _mm_loadu_si128((const __m128i *)(b->hash + 16)));
+    return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xffff;
+#else
+    uint64_t x[4], y[4];
+    memcpy(x, a->hash, sizeof(x));
+    memcpy(y, b->hash, sizeof(y));
+    return ((x[0] ^ y[0]) | (x[1] ^ y[1]) | (x[2] ^ y[2]) | (x[3] ^ y[3])) == 0;
+#endif
+}
+
+static inline int oid_cmp(const object_id_t *a, const object_id_t *b)
+{
+    return memcmp(a->hash, b->hash, SHA256_SIZE);
+}
+
+static inline int oid_is_null(const object_id_t *oid)
+{
+    static const object_id_t null_oid;
+    return oid_equal(oid, &null_oid);
+}
+
+static inline void oid_clear(object_id_t *oid)
+{
+    memset(oid->hash, 0, SHA256_SIZE);
+}
+
+// hex must have room for HEX_SIZE bytes; the result is NUL-terminated
+void oid_to_hex(const object_id_t *oid, char *hex);
+
+// Returns -1 unless hex starts with SHA256_SIZE * 2 hex digits
+int oid_from_hex(const char *hex, object_id_t *oid);
+
+// Hex form in one of a few rotating static buffers, for printing
+const char *oid_hex(const object_id_t *oid);
+
+// Parses a hex prefix of up to SHA256_SIZE * 2 digits into oid, padded with
+// zeros, and sets out_len to its digit count. Returns -1 on anything else.
+int oid_from_hex_prefix(const char *hex, object_id_t *oid, size_t *out_len);
+
+// Number of leading hex digits a and b have in common
+size_t oid_common_hex(const object_id_t *a, const object_id_t *b);
+
+#endif // OID_H
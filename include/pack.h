@@ -0,0 +1,67 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include "object.h"
+#include "odb.h"
+
+#include <stddef.h>
+
+// Pack files bundle many objects in one file under .vcs/objects/pack. Each
+// pack-<checksum>.pack has a matching .idx holding a 256-entry fanout table
+// over the sorted object ids, so a lookup is a binary search within the
+// ids sharing the first byte.
+#define PACK_DIR ".vcs/objects/pack"
+#define PACK_SIGNATURE 0x5041434b // "PACK"
+#define PACK_VERSION 1
+#define PACK_IDX_SIGNATURE 0xff744f63
+#define PACK_IDX_VERSION 1
+
+// Returns 0 and fills the handle when the object is packed, 1 when no pack
+// contains it and -1 on error. Release the handle with odb_unmap.
+int pack_map_object(const object_id_t *oid, odb_object_t *object);
+int pack_has_object(const object_id_t *oid);
+
+// Header-only and streaming counterparts of pack_map_object, with the same
+// return convention; see odb_object_info and odb_stream
+int pack_object_info(const object_id_t *oid, object_type_t *type, size_t *size);
+int pack_stream_object(const object_id_t *oid, int fd);
+
+// Calls fn for every object id in every pack; a non-zero return stops the walk.
+int pack_for_each_object(int (*fn)(const object_id_t *oid, void *ctx), void *ctx);
+
+// Like pack_for_each_object, restricted to the ids that start with the
+// first len hex digits of prefix; each pack is searched, not scanned
+int pack_for_each_abbrev(const object_id_t *prefix, size_t len,
+                         int (*fn)(const object_id_t *oid, void *ctx), void *ctx);
+
+// Most leading hex digits oid shares with a different packed id
+size_t pack_common_hex(const object_id_t *oid);
+
+// Checks every pack and index against its trailing checksum, one pack per
+// thread. Returns the number of damaged packs and sets out_bytes to the
+// size of all packs and indexes read.
+size_t pack_verify(size_t *out_bytes);
+
+typedef struct
+{
+    int window;                // candidate bases tried per blob
+    int depth;                 // longest allowed delta chain
+    size_t big_file_threshold; // larger blobs are stored whole
+} pack_options_t;
+
+#define PACK_DEFAULT_WINDOW 10
+#define PACK_DEFAULT_DEPTH 50
+// pack.bigFileThreshold, in MiB. The window holds every member in memory,
+// so blobs above it never enter it.
+#define PACK_DEFAULT_BIG_FILE_THRESHOLD (32 * 1024 * 1024)
+// Longest delta chain a pack may hold; readers refuse anything deeper, so
+// a corrupt pack whose bases loop cannot exhaust the stack
+#define PACK_MAX_DEPTH 4095
+
+// Writes all loose and packed objects into a single new pack, then removes
+// the loose copies and the packs it replaced. Blobs are stored as deltas
+// against similar blobs when that saves space, except big ones and the
+// chunks of chunked files, which content-defined chunking already dedups.
+int pack_repack(const pack_options_t *options);
+
+#endif // PACK_H
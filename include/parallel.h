@@ -0,0 +1,17 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+// Worker count for parallel_for: the online CPUs unless set explicitly;
+// setting 0 goes back to that default
+size_t parallel_threads(void);
+void parallel_set_threads(size_t threads);
+
+// Calls fn(index, ctx) once for every index below count, spread over up to
+// parallel_threads() threads including the caller. Indexes are handed out
+// one at a time, so uneven work balances itself. Returns once all calls
+// have finished; if threads cannot be started the caller does the work.
+void parallel_for(size_t count, void (*fn)(size_t index, void *ctx), void *ctx);
+
+#endif // PARALLEL_H
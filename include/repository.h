@@ -5,12 +5,24 @@
 
 typedef struct repository repository_t;
 
-repository_t *repository_init();
+// object_format names the hash for object ids ("sha256" or "blake3");
+// NULL picks sha256
+repository_t *repository_init(const char *object_format);
 void repository_free(repository_t *repo);
 
 repository_t *repository_open();
 int repository_add(repository_t *repo, int size, char **files);
 int repository_commit(repository_t *repo, const char *message);
 int repository_status(repository_t *repo);
+// oneline prints one line per commit: its abbreviated id and subject
+int repository_log(repository_t *repo, int oneline);
+int repository_repack(repository_t *repo);
+// Rebuilds .vcs/commit-graph from every branch
+int repository_commit_graph(repository_t *repo);
+// Returns 0 when every object checks out, 1 when problems were reported
+int repository_fsck(repository_t *repo);
+// option is -t (type), -s (size), -p (content, trees listed) or the type
+// the object must have for its raw content to be written to stdout
+int repository_cat_file(repository_t *repo, const char *option, const char *object);
 
 #endif // REPOSITORY_H
\ No newline at end of file
@@ -0,0 +1,28 @@
+#ifndef SHA256_MB_H
+#define SHA256_MB_H
+
+#include <stddef.h>
+
+// Batch SHA-256 for many small messages. Each message is prefix followed by
+// data, which is how object headers get hashed without copying content.
+typedef struct
+{
+    const unsigned char *prefix;
+    size_t prefix_len;
+    const unsigned char *data;
+    size_t size;
+    unsigned char *digest; // SHA256_SIZE bytes
+} sha256_job_t;
+
+// Hashes every job. With AVX2 the messages run eight at a time in SIMD
+// lanes, a lane picking up the next job as soon as its message ends; on
+// CPUs with SHA-NI only messages up to about 1 KiB take a lane and longer
+// ones go to OpenSSL. The engine is picked once at runtime, falls back to
+// OpenSSL with a single reused context, and VCS_SHA256_ENGINE=openssl
+// forces the fallback. Returns -1 only if OpenSSL fails.
+int sha256_mb(sha256_job_t *jobs, size_t count);
+
+// Name of the engine sha256_mb dispatches to
+const char *sha256_mb_engine(void);
+
+#endif // SHA256_MB_H
@@ -2,8 +2,11 @@
 #define STAGING_H
 
 #include "config.h"
+#include "oid.h"
+#include "cache_tree.h"
 
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <uthash.h>
 #include <utarray.h>
 
@@ -21,35 +24,105 @@ typedef struct
     uint32_t gid;
     uint32_t size;
     uint16_t flags;
-    char hash[HEX_SIZE];
+    object_id_t oid;
     char path[PATH_MAX];
 } index_entry_t;
 
+// A loaded entry, keyed by entry.path. Only as much of the path as it
+// needs is allocated, so entry must stay last and is never copied whole.
 typedef struct
 {
-    char path[PATH_MAX]; // key
-    index_entry_t entry; // value
     UT_hash_handle hh;   // makes this structure hashable
+    uint8_t in_base;     // the shared base of a split index has this path
+    uint8_t changed;     // differs from the shared base, if there is one
+    index_entry_t entry; // value
 } index_hash_entry_t;
 
 typedef struct
 {
     uint32_t signature; // DIRC
-    uint32_t version;   // 2
+    uint32_t version;   // INDEX_VERSION
     uint32_t entry_count;
 } index_header_t;
 
-// Modified index structure
-typedef struct
+// The index file is mapped on open and its entries are decoded in place
+// as they are iterated. The path table is only built, from the mapping,
+// once something needs to look entries up or change them.
+//
+// A split index file holds only the entries that differ from a shared
+// base index, which is rewritten far less often; see index_set_split.
+typedef struct index_t
 {
-    index_header_t header;
-    index_hash_entry_t *entries; // Hash table of entries
+    index_header_t header;       // entry_count covers the base's entries too
+    uint32_t file_entries;       // entries stored in the index file itself
+    struct index_t *base;        // shared base of a split index, NULL otherwise
+    index_hash_entry_t *entries; // Hash table of entries, once loaded
+    index_hash_entry_t *removed; // base entries since removed, once loaded
+    int entries_loaded;
+    const unsigned char *map; // index file, NULL when there is none
+    size_t map_size;
+    uint32_t mtime_sec; // of the index file, 0 when there is none
+    uint32_t mtime_nsec;
+    size_t entries_end;       // where the mapping's extensions start, once known
+    cache_tree_t *cache_tree; // once read, see index_cache_tree
     char *filepath;
 } index_t;
 
 index_t *index_init(const char *filepath);
 void index_free(index_t *index);
 
+// With split on, index_write stores only the entries changed since the
+// shared base, until they exceed max_percent_change of the base's
+// entries; then the whole index becomes the new base
+void index_set_split(int enabled, unsigned int max_percent_change);
+
+// Builds the path table from the mapping, checking the file's checksum;
+// does nothing once it exists
+int index_load_entries(index_t *index);
+
+// The directories' tree ids from the index's cache tree extension, or an
+// empty, all-invalid cache tree when it has none. Changes to the table
+// keep it up to date and index_write stores it. NULL on a damaged index.
+cache_tree_t *index_cache_tree(index_t *index);
+
+// One index file's entries, decoded in place in path order
+typedef struct
+{
+    const index_t *index;
+    size_t pos;
+    uint32_t remaining;
+    int pending;         // entry is decoded but not yet visited
+    index_entry_t entry; // each path built on the previous one
+} index_stream_t;
+
+// Visits every entry: straight from the mapping, in path order, until the
+// table is loaded, and from the table after that. A split index's file is
+// merged with its base as they are read.
+typedef struct
+{
+    const index_t *index;
+    index_hash_entry_t *next;
+    index_stream_t file;
+    index_stream_t base;
+} index_iter_t;
+
+void index_iter_init(index_iter_t *iter, const index_t *index);
+// Returns 1 and points *out at the next entry, valid until the next call,
+// 0 after the last one and -1 on a malformed entry
+int index_iter_next(index_iter_t *iter, const index_entry_t **out);
+
+// Whether the file st describes still has the entry's content, judging by
+// stat data alone. An entry whose mtime is not older than the index file
+// is racily clean: the file could have changed again within the same
+// timestamp after it was hashed, so it never matches and gets rehashed.
+int index_entry_matches(const index_t *index, const index_entry_t *entry, const struct stat *st);
+
+// Adds an entry for every file in a tree, with the tree's mode and id and
+// no stat data, so each file is hashed the first time it is compared.
+// Stands in for the index of a repository that has a commit but no index
+// file, as older versions left it after every commit.
+int index_read_tree(index_t *index, const object_id_t *tree_oid);
+
 int index_stage_files(index_t *index, UT_array *files);
 int index_write(index_t *index);
 
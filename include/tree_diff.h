@@ -8,9 +8,13 @@ typedef struct diff diff_t;
 diff_t *diff_init();
 void diff_free(diff_t *diff);
 
-int walk_working_dir(const char *path, diff_t *diff);
-int walk_commit_tree(const char *commit_hash, diff_t *diff);
+// Hashes the files under path, except those whose stat data matches their
+// entry in index, which may be NULL
+int walk_working_dir(const char *path, diff_t *diff, const index_t *index);
 void walk_staging(const index_t *index, diff_t *diff);
+// Records which files HEAD has, after walk_staging. Directories whose tree
+// id matches their valid node in cache, which may be NULL, are not read.
+int walk_commit_tree(const object_id_t *commit_oid, diff_t *diff, cache_tree_t *cache);
 void diff_print(const diff_t *diff);
 
 #endif // TREE_DIFF_H
\ No newline at end of file
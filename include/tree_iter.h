@@ -0,0 +1,55 @@
+#ifndef TREE_ITER_H
+#define TREE_ITER_H
+
+#include "oid.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Read-only views of the entries of a raw tree object, taken straight out of
+// its buffer: "<octal mode> <name>\0<32-byte digest>" repeated. Nothing is
+// allocated per entry; name points into the buffer and stays valid for as
+// long as the buffer does.
+typedef struct
+{
+    mode_t mode;
+    const char *name; // NUL-terminated in the buffer
+    size_t name_len;
+    object_id_t oid;
+} tree_entry_view_t;
+
+typedef struct
+{
+    const unsigned char *ptr;
+    const unsigned char *end;
+} tree_iter_t;
+
+void tree_iter_init(tree_iter_t *iter, const void *data, size_t size);
+
+// Returns 1 and fills out for the next entry, 0 at the end, or -1 if the
+// buffer is malformed
+int tree_iter_next(tree_iter_t *iter, tree_entry_view_t *out);
+
+// Offsets of every entry, for binary search by name. Trees are written in
+// name order; one that is not (written before sorting was introduced)
+// falls back to a linear scan.
+typedef struct
+{
+    const unsigned char *data;
+    size_t size;
+    uint32_t *offsets;
+    size_t count;
+    int sorted;
+} tree_index_t;
+
+int tree_index_init(tree_index_t *index, const void *data, size_t size);
+void tree_index_free(tree_index_t *index);
+
+// Returns 0 and fills out when name is in the tree, -1 otherwise
+int tree_index_find(const tree_index_t *index, const char *name, tree_entry_view_t *out);
+
+// Name order used when writing trees: plain byte order
+int tree_name_cmp(const char *a, size_t a_len, const char *b, size_t b_len);
+
+#endif // TREE_ITER_H
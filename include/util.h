@@ -1,13 +1,39 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include "oid.h"
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 int create_directory(const char *dir);
 size_t get_filesize_by_filepath(const char *filepath);
 size_t get_filesize_by_fp(FILE *fp);
-int filepath_from_hash(const char *hash, char *filepath);
-int hash_to_hex(const unsigned char *hash, char *hex);
-int compute_file_hash(char *filepath, char *hash);
+// The loose object path for oid, into OBJECT_PATH_MAX bytes
+int filepath_from_hash(const object_id_t *oid, char *filepath);
+int compute_file_hash(char *filepath, object_id_t *oid);
+
+// Reads exactly size bytes of a file into buf; fails when the file is
+// shorter or longer, e.g. because it changed after it was stat'ed
+int read_file_exact(const char *filepath, void *buf, size_t size);
+
+// Replaces path through a temporary file and rename, so readers see either
+// the old or the new content. With sync, the data and the rename are
+// fsynced before returning.
+int write_file_atomic(const char *path, const void *data, size_t len, int sync);
+
+// fsyncs a directory, making the entries created or renamed in it durable
+int sync_directory(const char *path);
+
+// Big-endian integers, as every on-disk format here stores them
+uint32_t get_be32(const unsigned char *p);
+uint64_t get_be64(const unsigned char *p);
+void put_be32(unsigned char *p, uint32_t v);
+void put_be64(unsigned char *p, uint64_t v);
+
+// VCS_TRACE_PERF set to anything but "" or "0" asks for timing and memory
+// reports on stderr
+int perf_trace_enabled(void);
+size_t peak_rss_kib(void);
 #endif // UTIL_H
\ No newline at end of file
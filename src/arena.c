@@ -0,0 +1,116 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+// Four words keep data 16-byte aligned behind a malloc'd header
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    size_t reserved;
+    unsigned char data[];
+} arena_block_t;
+
+struct arena
+{
+    arena_block_t *head; // the block being carved; older blocks follow
+    size_t block_size;
+    arena_stats_t stats;
+};
+
+static arena_block_t *block_new(arena_t *arena, size_t size)
+{
+    arena_block_t *block = malloc(sizeof(arena_block_t) + size);
+    if (!block)
+        return NULL;
+
+    block->used = 0;
+    block->size = size;
+    arena->stats.blocks++;
+    arena->stats.reserved += size;
+    return block;
+}
+
+arena_t *arena_create(size_t block_size)
+{
+    arena_t *arena = calloc(1, sizeof(arena_t));
+    if (!arena)
+        return NULL;
+
+    arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK;
+    return arena;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    if (!arena)
+        return;
+
+    arena_block_t *block = arena->head;
+    while (block)
+    {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (size == 0)
+        size = ARENA_ALIGN;
+
+    arena_block_t *head = arena->head;
+    if (head && head->size - head->used >= size)
+    {
+        void *ptr = head->data + head->used;
+        head->used += size;
+        arena->stats.used += size;
+        return ptr;
+    }
+
+    // Oversized requests get a block of their own behind the current one,
+    // so the space left in it is not wasted
+    if (head && size > arena->block_size / 4)
+    {
+        arena_block_t *block = block_new(arena, size);
+        if (!block)
+            return NULL;
+        block->used = size;
+        block->next = head->next;
+        head->next = block;
+        arena->stats.used += size;
+        return block->data;
+    }
+
+    arena_block_t *block = block_new(arena, size > arena->block_size ? size : arena->block_size);
+    if (!block)
+        return NULL;
+    block->next = head;
+    arena->head = block;
+    block->used = size;
+    arena->stats.used += size;
+    return block->data;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+    if (!copy)
+        return NULL;
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_stats(const arena_t *arena, arena_stats_t *out)
+{
+    *out = arena->stats;
+}
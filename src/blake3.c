@@ -0,0 +1,551 @@
+#include "blake3.h"
+#include "parallel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BLAKE3_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define PARENT (1 << 2)
+#define ROOT (1 << 3)
+
+#define LANES 8
+
+// Subtree handed to one parallel_for call, in chunks; a power of two so
+// every subtree is a node of the message's tree
+#define SUBTREE_CHUNKS 1024
+// Messages shorter than this are hashed by the incremental hasher
+#define PARALLEL_MIN (4 * SUBTREE_CHUNKS * BLAKE3_CHUNK_LEN)
+
+static const uint32_t IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}};
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t rotr32(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+#define G(s, a, b, c, d, x, y)             \
+    do                                     \
+    {                                      \
+        s[a] = s[a] + s[b] + (x);          \
+        s[d] = rotr32(s[d] ^ s[a], 16);    \
+        s[c] = s[c] + s[d];                \
+        s[b] = rotr32(s[b] ^ s[c], 12);    \
+        s[a] = s[a] + s[b] + (y);          \
+        s[d] = rotr32(s[d] ^ s[a], 8);     \
+        s[c] = s[c] + s[d];                \
+        s[b] = rotr32(s[b] ^ s[c], 7);     \
+    } while (0)
+
+// Updates cv in place with one compressed block
+static void compress(uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+                     uint64_t counter, uint8_t flags)
+{
+    uint32_t m[16], s[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = load32(block + 4 * i);
+
+    memcpy(s, cv, 8 * sizeof(uint32_t));
+    s[8] = IV[0];
+    s[9] = IV[1];
+    s[10] = IV[2];
+    s[11] = IV[3];
+    s[12] = (uint32_t)counter;
+    s[13] = (uint32_t)(counter >> 32);
+    s[14] = block_len;
+    s[15] = flags;
+
+    for (int r = 0; r < 7; r++)
+    {
+        const uint8_t *k = MSG_SCHEDULE[r];
+        G(s, 0, 4, 8, 12, m[k[0]], m[k[1]]);
+        G(s, 1, 5, 9, 13, m[k[2]], m[k[3]]);
+        G(s, 2, 6, 10, 14, m[k[4]], m[k[5]]);
+        G(s, 3, 7, 11, 15, m[k[6]], m[k[7]]);
+        G(s, 0, 5, 10, 15, m[k[8]], m[k[9]]);
+        G(s, 1, 6, 11, 12, m[k[10]], m[k[11]]);
+        G(s, 2, 7, 8, 13, m[k[12]], m[k[13]]);
+        G(s, 3, 4, 9, 14, m[k[14]], m[k[15]]);
+    }
+
+    for (int i = 0; i < 8; i++)
+        cv[i] = s[i] ^ s[i + 8];
+}
+
+// A node's inputs, kept until we know whether it is the root
+typedef struct
+{
+    uint32_t cv[8];
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint64_t counter;
+    uint8_t flags;
+} output_t;
+
+static void output_cv(const output_t *out, uint32_t cv[8])
+{
+    memcpy(cv, out->cv, sizeof(out->cv));
+    compress(cv, out->block, out->block_len, out->counter, out->flags);
+}
+
+static void output_root(const output_t *out, unsigned char digest[BLAKE3_OUT_LEN])
+{
+    uint32_t cv[8];
+    memcpy(cv, out->cv, sizeof(cv));
+    compress(cv, out->block, out->block_len, 0, out->flags | ROOT);
+    for (int i = 0; i < 8; i++)
+    {
+        digest[4 * i] = (unsigned char)cv[i];
+        digest[4 * i + 1] = (unsigned char)(cv[i] >> 8);
+        digest[4 * i + 2] = (unsigned char)(cv[i] >> 16);
+        digest[4 * i + 3] = (unsigned char)(cv[i] >> 24);
+    }
+}
+
+static void parent_output(const uint32_t left[8], const uint32_t right[8], output_t *out)
+{
+    memcpy(out->cv, IV, sizeof(IV));
+    for (int i = 0; i < 8; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            out->block[4 * i + j] = (uint8_t)(left[i] >> (8 * j));
+            out->block[32 + 4 * i + j] = (uint8_t)(right[i] >> (8 * j));
+        }
+    }
+    out->block_len = BLAKE3_BLOCK_LEN;
+    out->counter = 0;
+    out->flags = PARENT;
+}
+
+static void chunk_init(blake3_chunk_state_t *chunk, uint64_t counter)
+{
+    memcpy(chunk->cv, IV, sizeof(IV));
+    chunk->chunk_counter = counter;
+    chunk->block_len = 0;
+    chunk->blocks_compressed = 0;
+}
+
+static size_t chunk_len(const blake3_chunk_state_t *chunk)
+{
+    return (size_t)chunk->blocks_compressed * BLAKE3_BLOCK_LEN + chunk->block_len;
+}
+
+static uint8_t chunk_start_flag(const blake3_chunk_state_t *chunk)
+{
+    return chunk->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void chunk_update(blake3_chunk_state_t *chunk, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        // The last block is held back until the chunk is known to end
+        if (chunk->block_len == BLAKE3_BLOCK_LEN)
+        {
+            compress(chunk->cv, chunk->block, BLAKE3_BLOCK_LEN, chunk->chunk_counter, chunk_start_flag(chunk));
+            chunk->blocks_compressed++;
+            chunk->block_len = 0;
+        }
+
+        size_t take = BLAKE3_BLOCK_LEN - chunk->block_len;
+        if (take > len)
+            take = len;
+        memcpy(chunk->block + chunk->block_len, data, take);
+        chunk->block_len += (uint8_t)take;
+        data += take;
+        len -= take;
+    }
+}
+
+static void chunk_output(const blake3_chunk_state_t *chunk, output_t *out)
+{
+    memcpy(out->cv, chunk->cv, sizeof(chunk->cv));
+    memcpy(out->block, chunk->block, BLAKE3_BLOCK_LEN);
+    memset(out->block + chunk->block_len, 0, BLAKE3_BLOCK_LEN - chunk->block_len);
+    out->block_len = chunk->block_len;
+    out->counter = chunk->chunk_counter;
+    out->flags = chunk_start_flag(chunk) | CHUNK_END;
+}
+
+static void hash_chunks_portable(const uint8_t *const inputs[LANES], uint64_t counter, uint32_t cvs[LANES][8])
+{
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        memcpy(cvs[lane], IV, sizeof(IV));
+        for (int b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++)
+        {
+            uint8_t flags = (b == 0 ? CHUNK_START : 0) | (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? CHUNK_END : 0);
+            compress(cvs[lane], inputs[lane] + b * BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN, counter + lane, flags);
+        }
+    }
+}
+
+#ifdef BLAKE3_AVX2
+
+#define V_ADD(a, b) _mm256_add_epi32((a), (b))
+#define V_XOR(a, b) _mm256_xor_si256((a), (b))
+#define V_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+#define V_G(v, a, b, c, d, x, y)                          \
+    do                                                    \
+    {                                                     \
+        v[a] = V_ADD(V_ADD(v[a], v[b]), (x));             \
+        v[d] = _mm256_shuffle_epi8(V_XOR(v[d], v[a]), rot16); \
+        v[c] = V_ADD(v[c], v[d]);                         \
+        v[b] = V_ROTR(V_XOR(v[b], v[c]), 12);             \
+        v[a] = V_ADD(V_ADD(v[a], v[b]), (y));             \
+        v[d] = _mm256_shuffle_epi8(V_XOR(v[d], v[a]), rot8); \
+        v[c] = V_ADD(v[c], v[d]);                         \
+        v[b] = V_ROTR(V_XOR(v[b], v[c]), 7);              \
+    } while (0)
+
+// Words off..off+7 of every lane's block, transposed so that each vector
+// holds one word position for all eight lanes
+__attribute__((target("avx2"))) static void load_words(__m256i out[8], const uint8_t *const blocks[LANES], size_t off)
+{
+    __m256i r[8], t[8], u[8];
+    for (int i = 0; i < 8; i++)
+        r[i] = _mm256_loadu_si256((const __m256i *)(blocks[i] + off));
+    for (int i = 0; i < 8; i += 2)
+    {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4)
+    {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        out[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+// Eight whole chunks at once, one per lane, with consecutive counters
+__attribute__((target("avx2"))) static void hash_chunks_avx2(const uint8_t *const inputs[LANES], uint64_t counter,
+                                                             uint32_t cvs[LANES][8])
+{
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+                                          1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    uint32_t lo[LANES], hi[LANES];
+    for (int i = 0; i < LANES; i++)
+    {
+        lo[i] = (uint32_t)(counter + i);
+        hi[i] = (uint32_t)((counter + i) >> 32);
+    }
+    const __m256i counter_lo = _mm256_loadu_si256((const __m256i *)lo);
+    const __m256i counter_hi = _mm256_loadu_si256((const __m256i *)hi);
+
+    __m256i h[8];
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm256_set1_epi32((int)IV[i]);
+
+    for (size_t b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++)
+    {
+        __m256i m[16], v[16];
+        load_words(m, inputs, b * BLAKE3_BLOCK_LEN);
+        load_words(m + 8, inputs, b * BLAKE3_BLOCK_LEN + 32);
+
+        int flags = (b == 0 ? CHUNK_START : 0) | (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? CHUNK_END : 0);
+        for (int i = 0; i < 8; i++)
+            v[i] = h[i];
+        for (int i = 0; i < 4; i++)
+            v[i + 8] = _mm256_set1_epi32((int)IV[i]);
+        v[12] = counter_lo;
+        v[13] = counter_hi;
+        v[14] = _mm256_set1_epi32(BLAKE3_BLOCK_LEN);
+        v[15] = _mm256_set1_epi32(flags);
+
+        for (int r = 0; r < 7; r++)
+        {
+            const uint8_t *k = MSG_SCHEDULE[r];
+            V_G(v, 0, 4, 8, 12, m[k[0]], m[k[1]]);
+            V_G(v, 1, 5, 9, 13, m[k[2]], m[k[3]]);
+            V_G(v, 2, 6, 10, 14, m[k[4]], m[k[5]]);
+            V_G(v, 3, 7, 11, 15, m[k[6]], m[k[7]]);
+            V_G(v, 0, 5, 10, 15, m[k[8]], m[k[9]]);
+            V_G(v, 1, 6, 11, 12, m[k[10]], m[k[11]]);
+            V_G(v, 2, 7, 8, 13, m[k[12]], m[k[13]]);
+            V_G(v, 3, 4, 9, 14, m[k[14]], m[k[15]]);
+        }
+        for (int i = 0; i < 8; i++)
+            h[i] = V_XOR(v[i], v[i + 8]);
+    }
+
+    // Back from [word][lane] to [lane][word]
+    uint32_t words[8][LANES];
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i *)words[i], h[i]);
+    for (int lane = 0; lane < LANES; lane++)
+        for (int i = 0; i < 8; i++)
+            cvs[lane][i] = words[i][lane];
+}
+
+#endif // BLAKE3_AVX2
+
+static void (*hash_chunks)(const uint8_t *const inputs[LANES], uint64_t counter, uint32_t cvs[LANES][8]);
+
+static void pick_hash_chunks(void)
+{
+    hash_chunks = hash_chunks_portable;
+#ifdef BLAKE3_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        hash_chunks = hash_chunks_avx2;
+#endif
+}
+
+static void push_cv(blake3_hasher_t *hasher, uint32_t cv[8], uint64_t total_chunks)
+{
+    // Every completed pair of subtrees merges into its parent
+    while ((total_chunks & 1) == 0)
+    {
+        output_t parent;
+        parent_output(hasher->cv_stack[--hasher->cv_stack_len], cv, &parent);
+        output_cv(&parent, cv);
+        total_chunks >>= 1;
+    }
+    memcpy(hasher->cv_stack[hasher->cv_stack_len++], cv, 8 * sizeof(uint32_t));
+}
+
+void blake3_init(blake3_hasher_t *hasher)
+{
+    if (!hash_chunks)
+        pick_hash_chunks();
+    chunk_init(&hasher->chunk, 0);
+    hasher->cv_stack_len = 0;
+}
+
+void blake3_update(blake3_hasher_t *hasher, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len > 0)
+    {
+        blake3_chunk_state_t *chunk = &hasher->chunk;
+        if (chunk_len(chunk) == BLAKE3_CHUNK_LEN)
+        {
+            output_t out;
+            uint32_t cv[8];
+            chunk_output(chunk, &out);
+            output_cv(&out, cv);
+            push_cv(hasher, cv, chunk->chunk_counter + 1);
+            chunk_init(chunk, chunk->chunk_counter + 1);
+        }
+
+        // Whole chunks with more input behind them cannot be the root, so
+        // they go straight to the wide path
+        while (chunk_len(chunk) == 0 && len > LANES * BLAKE3_CHUNK_LEN)
+        {
+            const uint8_t *inputs[LANES];
+            uint32_t cvs[LANES][8];
+            for (int i = 0; i < LANES; i++)
+                inputs[i] = p + i * BLAKE3_CHUNK_LEN;
+            hash_chunks(inputs, chunk->chunk_counter, cvs);
+            for (int i = 0; i < LANES; i++)
+                push_cv(hasher, cvs[i], chunk->chunk_counter + i + 1);
+            chunk_init(chunk, chunk->chunk_counter + LANES);
+            p += LANES * BLAKE3_CHUNK_LEN;
+            len -= LANES * BLAKE3_CHUNK_LEN;
+        }
+
+        size_t take = BLAKE3_CHUNK_LEN - chunk_len(chunk);
+        if (take > len)
+            take = len;
+        chunk_update(chunk, p, take);
+        p += take;
+        len -= take;
+    }
+}
+
+void blake3_final(const blake3_hasher_t *hasher, unsigned char out[BLAKE3_OUT_LEN])
+{
+    output_t node;
+    chunk_output(&hasher->chunk, &node);
+    for (size_t i = hasher->cv_stack_len; i > 0; i--)
+    {
+        uint32_t cv[8];
+        output_cv(&node, cv);
+        parent_output(hasher->cv_stack[i - 1], cv, &node);
+    }
+    output_root(&node, out);
+}
+
+// A message of prefix plus data, addressed by chunk. Only the first chunk
+// straddles the prefix, so it is assembled once and every other chunk is
+// read in place.
+typedef struct
+{
+    const uint8_t *data;
+    size_t prefix_len;
+    size_t total;
+    uint64_t chunks;
+    uint8_t first[BLAKE3_CHUNK_LEN];
+    uint32_t (*subtree_cvs)[8];
+} message_t;
+
+static const uint8_t *message_chunk(const message_t *msg, uint64_t index)
+{
+    return index == 0 ? msg->first : msg->data + index * BLAKE3_CHUNK_LEN - msg->prefix_len;
+}
+
+// Chaining value of the subtree over chunks [first, first + count). Leaves
+// go through the wide path a batch at a time and are merged on a stack.
+static void subtree_cv(const message_t *msg, uint64_t first, uint64_t count, uint32_t out[8])
+{
+    blake3_hasher_t stack;
+    stack.cv_stack_len = 0;
+
+    uint64_t done = 0;
+    while (done < count)
+    {
+        uint64_t index = first + done;
+        if (count - done >= LANES && (index + LANES) * BLAKE3_CHUNK_LEN <= msg->total)
+        {
+            const uint8_t *inputs[LANES];
+            uint32_t cvs[LANES][8];
+            for (int i = 0; i < LANES; i++)
+                inputs[i] = message_chunk(msg, index + i);
+            hash_chunks(inputs, index, cvs);
+            for (int i = 0; i < LANES; i++)
+                push_cv(&stack, cvs[i], done + i + 1);
+            done += LANES;
+            continue;
+        }
+
+        // The message's last chunk may be short
+        size_t len = msg->total - index * BLAKE3_CHUNK_LEN;
+        if (len > BLAKE3_CHUNK_LEN)
+            len = BLAKE3_CHUNK_LEN;
+        blake3_chunk_state_t chunk;
+        output_t node;
+        uint32_t cv[8];
+        chunk_init(&chunk, index);
+        chunk_update(&chunk, message_chunk(msg, index), len);
+        chunk_output(&chunk, &node);
+        output_cv(&node, cv);
+        push_cv(&stack, cv, ++done);
+    }
+
+    // count is a power of two unless this is the message's tail, where the
+    // stack holds the right spine
+    memcpy(out, stack.cv_stack[stack.cv_stack_len - 1], 8 * sizeof(uint32_t));
+    for (size_t i = stack.cv_stack_len - 1; i > 0; i--)
+    {
+        output_t parent;
+        parent_output(stack.cv_stack[i - 1], out, &parent);
+        output_cv(&parent, out);
+    }
+}
+
+static void hash_subtree(size_t index, void *ctx)
+{
+    message_t *msg = ctx;
+    uint64_t first = (uint64_t)index * SUBTREE_CHUNKS;
+    uint64_t count = msg->chunks - first < SUBTREE_CHUNKS ? msg->chunks - first : SUBTREE_CHUNKS;
+    subtree_cv(msg, first, count, msg->subtree_cvs[index]);
+}
+
+static uint64_t largest_power_of_two_below(uint64_t n)
+{
+    uint64_t p = 1;
+    while (p * 2 < n)
+        p *= 2;
+    return p;
+}
+
+// Joins precomputed subtrees; first is a multiple of SUBTREE_CHUNKS
+static void tree_cv(const message_t *msg, uint64_t first, uint64_t count, uint32_t out[8])
+{
+    if (count <= SUBTREE_CHUNKS)
+    {
+        memcpy(out, msg->subtree_cvs[first / SUBTREE_CHUNKS], 8 * sizeof(uint32_t));
+        return;
+    }
+
+    uint64_t left = largest_power_of_two_below(count);
+    uint32_t left_cv[8], right_cv[8];
+    output_t parent;
+    tree_cv(msg, first, left, left_cv);
+    tree_cv(msg, first + left, count - left, right_cv);
+    parent_output(left_cv, right_cv, &parent);
+    output_cv(&parent, out);
+}
+
+void blake3_hash_message(const void *prefix, size_t prefix_len, const void *data, size_t size,
+                         unsigned char out[BLAKE3_OUT_LEN])
+{
+    message_t *msg = NULL;
+    if (prefix_len + size >= PARALLEL_MIN && prefix_len < BLAKE3_CHUNK_LEN)
+        msg = malloc(sizeof(message_t));
+
+    if (msg)
+    {
+        msg->data = data;
+        msg->prefix_len = prefix_len;
+        msg->total = prefix_len + size;
+        msg->chunks = (msg->total + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN;
+        memcpy(msg->first, prefix, prefix_len);
+        memcpy(msg->first + prefix_len, data, BLAKE3_CHUNK_LEN - prefix_len);
+
+        size_t subtrees = (msg->chunks + SUBTREE_CHUNKS - 1) / SUBTREE_CHUNKS;
+        msg->subtree_cvs = malloc(subtrees * sizeof(*msg->subtree_cvs));
+        if (!msg->subtree_cvs)
+        {
+            free(msg);
+            msg = NULL;
+        }
+    }
+
+    if (!msg)
+    {
+        blake3_hasher_t hasher;
+        blake3_init(&hasher);
+        blake3_update(&hasher, prefix, prefix_len);
+        blake3_update(&hasher, data, size);
+        blake3_final(&hasher, out);
+        return;
+    }
+
+    if (!hash_chunks)
+        pick_hash_chunks();
+    parallel_for((msg->chunks + SUBTREE_CHUNKS - 1) / SUBTREE_CHUNKS, hash_subtree, msg);
+
+    // More than one subtree, so the root is a parent node
+    uint64_t left = largest_power_of_two_below(msg->chunks);
+    uint32_t left_cv[8], right_cv[8];
+    output_t root;
+    tree_cv(msg, 0, left, left_cv);
+    tree_cv(msg, left, msg->chunks - left, right_cv);
+    parent_output(left_cv, right_cv, &root);
+    output_root(&root, out);
+
+    free(msg->subtree_cvs);
+    free(msg);
+}
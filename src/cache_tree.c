@@ -0,0 +1,242 @@
+#include "cache_tree.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+// Name, entry count and subdirectory count; the id follows when valid
+#define CACHE_TREE_NODE_MIN (1 + 4 + 4)
+// Deeper than any path the index can hold
+#define CACHE_TREE_MAX_DEPTH (PATH_MAX / 2)
+
+cache_tree_t *cache_tree_new(const char *name, size_t len)
+{
+    cache_tree_t *tree = calloc(1, sizeof(cache_tree_t) + len + 1);
+    if (!tree)
+        return NULL;
+    memcpy(tree->name, name, len);
+    tree->entry_count = CACHE_TREE_INVALID;
+    return tree;
+}
+
+void cache_tree_free(cache_tree_t *tree)
+{
+    if (!tree)
+        return;
+    for (size_t i = 0; i < tree->subtree_count; i++)
+        cache_tree_free(tree->subtrees[i]);
+    free(tree->subtrees);
+    free(tree);
+}
+
+// Compares a node's name with one that need not be NUL-terminated
+static int name_cmp(const cache_tree_t *tree, const char *name, size_t len)
+{
+    int cmp = strncmp(tree->name, name, len);
+    if (cmp != 0)
+        return cmp;
+    return tree->name[len] == '\0' ? 0 : 1;
+}
+
+// Position of the subdirectory, or where it would be inserted
+static size_t sub_pos(const cache_tree_t *tree, const char *name, size_t len, int *found)
+{
+    size_t lo = 0, hi = tree->subtree_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = name_cmp(tree->subtrees[mid], name, len);
+        if (cmp == 0)
+        {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *found = 0;
+    return lo;
+}
+
+static int insert_sub(cache_tree_t *tree, size_t pos, cache_tree_t *sub)
+{
+    if (tree->subtree_count == tree->subtree_capacity)
+    {
+        size_t capacity = tree->subtree_capacity ? tree->subtree_capacity * 2 : 4;
+        cache_tree_t **grown = realloc(tree->subtrees, capacity * sizeof(cache_tree_t *));
+        if (!grown)
+            return -1;
+        tree->subtrees = grown;
+        tree->subtree_capacity = capacity;
+    }
+    memmove(tree->subtrees + pos + 1, tree->subtrees + pos, (tree->subtree_count - pos) * sizeof(cache_tree_t *));
+    tree->subtrees[pos] = sub;
+    tree->subtree_count++;
+    return 0;
+}
+
+cache_tree_t *cache_tree_sub(cache_tree_t *tree, const char *name, size_t len, int create)
+{
+    int found;
+    size_t pos = sub_pos(tree, name, len, &found);
+    if (found)
+        return tree->subtrees[pos];
+    if (!create)
+        return NULL;
+
+    cache_tree_t *sub = cache_tree_new(name, len);
+    if (!sub || insert_sub(tree, pos, sub) != 0)
+    {
+        free(sub);
+        return NULL;
+    }
+    return sub;
+}
+
+void cache_tree_prune(cache_tree_t *tree)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < tree->subtree_count; i++)
+    {
+        cache_tree_t *sub = tree->subtrees[i];
+        if (sub->listed)
+        {
+            sub->listed = 0;
+            tree->subtrees[kept++] = sub;
+        }
+        else
+        {
+            cache_tree_free(sub);
+        }
+    }
+    tree->subtree_count = kept;
+}
+
+void cache_tree_invalidate(cache_tree_t *root, const char *path)
+{
+    cache_tree_t *tree = root;
+    const char *component = path;
+    while (tree)
+    {
+        tree->entry_count = CACHE_TREE_INVALID;
+
+        const char *slash = strchr(component, '/');
+        size_t len = slash ? (size_t)(slash - component) : strlen(component);
+        int found;
+        size_t pos = sub_pos(tree, component, len, &found);
+        if (!found)
+            return;
+        if (!slash)
+        {
+            // A directory replaced by a file, or removed
+            cache_tree_free(tree->subtrees[pos]);
+            memmove(tree->subtrees + pos, tree->subtrees + pos + 1,
+                    (tree->subtree_count - pos - 1) * sizeof(cache_tree_t *));
+            tree->subtree_count--;
+            return;
+        }
+        tree = tree->subtrees[pos];
+        component = slash + 1;
+    }
+}
+
+size_t cache_tree_size(const cache_tree_t *root)
+{
+    size_t size = strlen(root->name) + 1 + 8;
+    if (root->entry_count != CACHE_TREE_INVALID)
+        size += SHA256_SIZE;
+    for (size_t i = 0; i < root->subtree_count; i++)
+        size += cache_tree_size(root->subtrees[i]);
+    return size;
+}
+
+static unsigned char *write_node(const cache_tree_t *tree, unsigned char *out)
+{
+    size_t len = strlen(tree->name) + 1;
+    memcpy(out, tree->name, len);
+    out += len;
+    put_be32(out, tree->entry_count);
+    put_be32(out + 4, tree->subtree_count);
+    out += 8;
+    if (tree->entry_count != CACHE_TREE_INVALID)
+    {
+        memcpy(out, tree->oid.hash, SHA256_SIZE);
+        out += SHA256_SIZE;
+    }
+    for (size_t i = 0; i < tree->subtree_count; i++)
+        out = write_node(tree->subtrees[i], out);
+    return out;
+}
+
+void cache_tree_write(const cache_tree_t *root, unsigned char *out)
+{
+    write_node(root, out);
+}
+
+static cache_tree_t *read_node(const unsigned char *data, size_t size, size_t *pos, int depth)
+{
+    if (depth > CACHE_TREE_MAX_DEPTH || size - *pos < CACHE_TREE_NODE_MIN)
+        return NULL;
+    const unsigned char *name = data + *pos;
+    const unsigned char *nul = memchr(name, '\0', size - *pos);
+    if (!nul || (size_t)(data + size - nul) < 1 + 8)
+        return NULL;
+    size_t at = nul + 1 - data;
+
+    uint32_t entry_count = get_be32(data + at);
+    uint32_t subtree_count = get_be32(data + at + 4);
+    at += 8;
+    if (entry_count != CACHE_TREE_INVALID)
+    {
+        if (size - at < SHA256_SIZE)
+            return NULL;
+        at += SHA256_SIZE;
+    }
+    // Every subdirectory takes at least CACHE_TREE_NODE_MIN more bytes
+    if (subtree_count > (size - at) / CACHE_TREE_NODE_MIN)
+        return NULL;
+
+    cache_tree_t *tree = cache_tree_new((const char *)name, nul - name);
+    if (!tree)
+        return NULL;
+    tree->entry_count = entry_count;
+    if (entry_count != CACHE_TREE_INVALID)
+        memcpy(tree->oid.hash, data + at - SHA256_SIZE, SHA256_SIZE);
+    if (subtree_count > 0 && !(tree->subtrees = malloc(subtree_count * sizeof(cache_tree_t *))))
+    {
+        free(tree);
+        return NULL;
+    }
+    tree->subtree_capacity = subtree_count;
+
+    *pos = at;
+    for (uint32_t i = 0; i < subtree_count; i++)
+    {
+        cache_tree_t *sub = read_node(data, size, pos, depth + 1);
+        // Names must be unique, nonempty and in order for lookups to work
+        if (!sub || sub->name[0] == '\0' ||
+            (i > 0 && strcmp(tree->subtrees[i - 1]->name, sub->name) >= 0))
+        {
+            cache_tree_free(sub);
+            cache_tree_free(tree);
+            return NULL;
+        }
+        tree->subtrees[tree->subtree_count++] = sub;
+    }
+    return tree;
+}
+
+cache_tree_t *cache_tree_read(const unsigned char *data, size_t size)
+{
+    size_t pos = 0;
+    cache_tree_t *root = read_node(data, size, &pos, 0);
+    if (root && pos != size)
+    {
+        cache_tree_free(root);
+        return NULL;
+    }
+    return root;
+}
@@ -0,0 +1,261 @@
+#include "chunk.h"
+#include "odb.h"
+#include "object.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// Chunks hashed and stored together, so the multi-buffer engine gets
+// several at once while the file is still in cache
+#define CHUNK_BATCH 256
+
+// Normalized chunking: before the average size a mask with two more bits
+// makes a cut less likely, after it one with two fewer bits makes it more
+// likely, which keeps chunk sizes close to CHUNK_AVG_SIZE. The gear hash
+// shifts left, so its top bits cover the most recent bytes.
+#define CHUNK_MASK_SMALL (~0ULL << (64 - 18))
+#define CHUNK_MASK_LARGE (~0ULL << (64 - 14))
+
+typedef struct
+{
+    size_t files;
+    size_t chunks;
+    size_t bytes;
+    size_t new_chunks;
+    size_t new_bytes;
+} chunk_stats_t;
+
+static size_t threshold = 0;
+static chunk_stats_t stats;
+
+// The gear table decides every cut, and with it the ids of chunked
+// files, so its seed must never change
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void)
+{
+    // splitmix64
+    uint64_t state = 0x6765617263646331ULL;
+    for (int i = 0; i < 256; i++)
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+void chunk_set_threshold(size_t bytes)
+{
+    threshold = bytes;
+}
+
+int chunk_applies(size_t file_size)
+{
+    return threshold > 0 && file_size >= threshold;
+}
+
+size_t chunk_next(const unsigned char *data, size_t size)
+{
+    if (size <= CHUNK_MIN_SIZE)
+        return size;
+    pthread_once(&gear_once, gear_init);
+
+    size_t limit = size < CHUNK_MAX_SIZE ? size : CHUNK_MAX_SIZE;
+    size_t normal = limit < CHUNK_AVG_SIZE ? limit : CHUNK_AVG_SIZE;
+    uint64_t fp = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i < normal; i++)
+    {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & CHUNK_MASK_SMALL))
+            return i + 1;
+    }
+    for (; i < limit; i++)
+    {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & CHUNK_MASK_LARGE))
+            return i + 1;
+    }
+    return limit;
+}
+
+void chunk_record(const unsigned char *record, object_id_t *oid, size_t *size)
+{
+    memcpy(oid->hash, record, SHA256_SIZE);
+    *size = get_be64(record + SHA256_SIZE);
+}
+
+// Writes each chunk in the batch unless it is already stored
+static int store_chunks(const odb_hash_job_t *jobs, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!odb_has_object(&jobs[i].oid))
+        {
+            if (odb_write_hashed(OBJ_BLOB, jobs[i].data, jobs[i].size, &jobs[i].oid) != 0)
+                return -1;
+            stats.new_chunks++;
+            stats.new_bytes += jobs[i].size;
+        }
+        stats.chunks++;
+        stats.bytes += jobs[i].size;
+    }
+    return 0;
+}
+
+// Cuts the file behind fd, hashes every chunk and, with store, writes the
+// new ones; then hashes or writes the chunk list itself
+static int chunk_fd(int fd, size_t size, int store, object_id_t *out_oid)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != size)
+    {
+        fprintf(stderr, "Error: File changed size while being chunked\n");
+        return -1;
+    }
+
+    unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Failed to map file for chunking\n");
+        return -1;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(data, size, MADV_SEQUENTIAL);
+#endif
+
+    // Every chunk but the last is at least CHUNK_MIN_SIZE
+    size_t capacity = size / CHUNK_MIN_SIZE + 1;
+    unsigned char *list = malloc(capacity * CHUNK_RECORD_SIZE);
+    odb_hash_job_t *jobs = malloc(CHUNK_BATCH * sizeof(odb_hash_job_t));
+    int result = -1;
+    if (!list || !jobs)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        goto done;
+    }
+
+    size_t pos = 0, count = 0;
+    while (pos < size)
+    {
+        size_t batch = 0;
+        while (batch < CHUNK_BATCH && pos < size)
+        {
+            size_t len = chunk_next(data + pos, size - pos);
+            jobs[batch].type = OBJ_BLOB;
+            jobs[batch].data = data + pos;
+            jobs[batch].size = len;
+            batch++;
+            pos += len;
+        }
+
+        if (odb_hash_batch(jobs, batch) != 0 || (store && store_chunks(jobs, batch) != 0))
+            goto done;
+        for (size_t i = 0; i < batch; i++, count++)
+        {
+            memcpy(list + count * CHUNK_RECORD_SIZE, jobs[i].oid.hash, SHA256_SIZE);
+            put_be64(list + count * CHUNK_RECORD_SIZE + SHA256_SIZE, jobs[i].size);
+        }
+    }
+
+    jobs[0].type = OBJ_CHUNKS;
+    jobs[0].data = list;
+    jobs[0].size = count * CHUNK_RECORD_SIZE;
+    if (odb_hash_batch(jobs, 1) != 0 ||
+        (store && odb_write_hashed(OBJ_CHUNKS, list, jobs[0].size, &jobs[0].oid) != 0))
+        goto done;
+
+    if (store)
+        stats.files++;
+    *out_oid = jobs[0].oid;
+    result = 0;
+
+done:
+    free(jobs);
+    free(list);
+    munmap(data, size);
+    return result;
+}
+
+int chunk_hash_fd(int fd, size_t size, object_id_t *out_oid)
+{
+    return chunk_fd(fd, size, 0, out_oid);
+}
+
+int chunk_write_fd(int fd, size_t size, object_id_t *out_oid)
+{
+    return chunk_fd(fd, size, 1, out_oid);
+}
+
+void chunk_report(void)
+{
+    if (stats.files == 0)
+        return;
+
+    printf("Chunked %zu file%s (%.1f MiB) into %zu chunks, %zu new (%.1f MiB written)",
+           stats.files, stats.files == 1 ? "" : "s", stats.bytes / 1048576.0,
+           stats.chunks, stats.new_chunks, stats.new_bytes / 1048576.0);
+    if (stats.new_bytes > 0)
+        printf(", dedup ratio %.2f\n", (double)stats.bytes / stats.new_bytes);
+    else
+        printf(", all already stored\n");
+}
+
+// Maps a chunk list, refusing anything that is not a whole number of records
+static int map_chunk_list(const object_id_t *list_oid, odb_object_t *list)
+{
+    if (odb_map(list_oid, list) != 0)
+        return -1;
+    if (list->type != OBJ_CHUNKS || list->size % CHUNK_RECORD_SIZE != 0)
+    {
+        fprintf(stderr, "Error: %s is not a chunk list\n", oid_hex(list_oid));
+        odb_unmap(list);
+        return -1;
+    }
+    return 0;
+}
+
+int chunk_content_size(const object_id_t *list_oid, size_t *out_size)
+{
+    odb_object_t list;
+    if (map_chunk_list(list_oid, &list) != 0)
+        return -1;
+
+    size_t total = 0;
+    for (size_t pos = 0; pos < list.size; pos += CHUNK_RECORD_SIZE)
+    {
+        object_id_t chunk;
+        size_t size;
+        chunk_record(list.data + pos, &chunk, &size);
+        total += size;
+    }
+    odb_unmap(&list);
+    *out_size = total;
+    return 0;
+}
+
+int chunk_stream(const object_id_t *list_oid, int fd)
+{
+    odb_object_t list;
+    if (map_chunk_list(list_oid, &list) != 0)
+        return -1;
+
+    int result = 0;
+    for (size_t pos = 0; pos < list.size && result == 0; pos += CHUNK_RECORD_SIZE)
+    {
+        object_id_t chunk;
+        size_t size;
+        chunk_record(list.data + pos, &chunk, &size);
+        result = odb_stream(&chunk, fd);
+    }
+    odb_unmap(&list);
+    return result;
+}
@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <getopt.h>
+#include <errno.h>
 
 struct command
 {
@@ -52,8 +53,15 @@ int command_execute(command_t *cmd, int argc, char **argv)
     return 0;
 }
 
+typedef struct
+{
+    const char *object_format;
+} init_ctx_t;
+
 int command_init_validate(command_t *self, int argc, char **argv)
 {
+    init_ctx_t *ctx = (init_ctx_t *)self->ctx;
+
     if (argc < 2)
     {
         fprintf(stderr, "Error: Invalid number of arguments\n");
@@ -61,12 +69,28 @@ int command_init_validate(command_t *self, int argc, char **argv)
         return CMD_ERROR_INVALID_ARGUMENTS;
     }
 
+    for (int i = 2; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--object-format=", 16) == 0)
+        {
+            ctx->object_format = argv[i] + 16;
+        }
+        else
+        {
+            fprintf(stderr, "Error: Invalid option '%s'\n", argv[i]);
+            fprintf(stderr, "Usage: %s\n", self->usage);
+            return CMD_ERROR_INVALID_ARGUMENTS;
+        }
+    }
+
     return 0;
 }
 
 int command_init_run(command_t *self, int argc, char **argv)
 {
-    repository_t *repo = repository_init();
+    init_ctx_t *ctx = (init_ctx_t *)self->ctx;
+
+    repository_t *repo = repository_init(ctx->object_format);
     if (!repo)
     {
         fprintf(stderr, "Error: Failed to initialize repository\n");
@@ -77,11 +101,13 @@ int command_init_run(command_t *self, int argc, char **argv)
     return 0;
 }
 
+init_ctx_t init_ctx = {NULL};
+
 command_t command_init_impl = {
     .name = "init",
     .description = "Create an empty repository or reinitialize an existing one",
-    .usage = "vcs init",
-    .ctx = NULL,
+    .usage = "vcs init [--object-format=sha256|blake3]",
+    .ctx = &init_ctx,
     .validate = command_init_validate,
     .run = command_init_run,
     .cleanup = NULL};
@@ -95,10 +121,12 @@ int command_add_validate(command_t *self, int argc, char **argv)
         return CMD_ERROR_INVALID_ARGUMENTS;
     }
 
+    // A path that no longer exists is let through: adding it removes it
+    // from the index, or fails there if it was never tracked
     for (int i = 2; i < argc; i++)
     {
         struct stat st;
-        if (stat(argv[i], &st) != 0)
+        if (stat(argv[i], &st) != 0 && errno != ENOENT)
         {
             fprintf(stderr, "Error: '%s' is not a valid file or directory\n", argv[i]);
             return CMD_ERROR_INVALID_ARGUMENTS;
@@ -242,13 +270,225 @@ command_t command_status_impl = {
     .run = command_status_run,
     .cleanup = NULL};
 
-command_t command_log = {
+static int command_log_validate(command_t *self, int argc, char **argv)
+{
+    if (argc > 3 || (argc == 3 && strcmp(argv[2], "--oneline") != 0))
+    {
+        fprintf(stderr, "Error: Invalid number of arguments\n");
+        fprintf(stderr, "Usage: %s\n", self->usage);
+        return CMD_ERROR_INVALID_ARGUMENTS;
+    }
+
+    return 0;
+}
+
+static int command_log_run(command_t *self, int argc, char **argv)
+{
+    repository_t *repo = repository_open();
+    if (!repo)
+    {
+        fprintf(stderr, "Error: Failed to open repository\n");
+        return CMD_ERROR_EXEC_FAILED;
+    }
+
+    int result = repository_log(repo, argc == 3);
+    repository_free(repo);
+    return result == 0 ? 0 : CMD_ERROR_EXEC_FAILED;
+}
+
+command_t command_log_impl = {
     .name = "log",
     .description = "Show commit logs",
-    .usage = "vcs log",
+    .usage = "vcs log [--oneline]",
+    .ctx = NULL,
+    .validate = command_log_validate,
+    .run = command_log_run,
+    .cleanup = NULL};
+
+static int command_repack_validate(command_t *self, int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Error: Invalid number of arguments\n");
+        fprintf(stderr, "Usage: %s\n", self->usage);
+        return CMD_ERROR_INVALID_ARGUMENTS;
+    }
+
+    return 0;
+}
+
+static int command_repack_run(command_t *self, int argc, char **argv)
+{
+    repository_t *repo = repository_open();
+    if (!repo)
+    {
+        fprintf(stderr, "Error: Failed to open repository\n");
+        return CMD_ERROR_EXEC_FAILED;
+    }
+
+    int result = repository_repack(repo);
+    if (result != 0)
+    {
+        fprintf(stderr, "Error: Failed to repack objects\n");
+    }
+
+    repository_free(repo);
+    return result == 0 ? 0 : CMD_ERROR_EXEC_FAILED;
+}
+
+command_t command_repack_impl = {
+    .name = "repack",
+    .description = "Pack loose objects into a single indexed pack file",
+    .usage = "vcs repack",
+    .ctx = NULL,
+    .validate = command_repack_validate,
+    .run = command_repack_run,
+    .cleanup = NULL};
+
+static int command_commit_graph_validate(command_t *self, int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Error: Invalid number of arguments\n");
+        fprintf(stderr, "Usage: %s\n", self->usage);
+        return CMD_ERROR_INVALID_ARGUMENTS;
+    }
+
+    return 0;
+}
+
+static int command_commit_graph_run(command_t *self, int argc, char **argv)
+{
+    repository_t *repo = repository_open();
+    if (!repo)
+    {
+        fprintf(stderr, "Error: Failed to open repository\n");
+        return CMD_ERROR_EXEC_FAILED;
+    }
+
+    int result = repository_commit_graph(repo);
+    if (result != 0)
+    {
+        fprintf(stderr, "Error: Failed to write commit graph\n");
+    }
+
+    repository_free(repo);
+    return result == 0 ? 0 : CMD_ERROR_EXEC_FAILED;
+}
+
+command_t command_commit_graph_impl = {
+    .name = "commit-graph",
+    .description = "Rebuild the commit graph used for history walks",
+    .usage = "vcs commit-graph",
+    .ctx = NULL,
+    .validate = command_commit_graph_validate,
+    .run = command_commit_graph_run,
+    .cleanup = NULL};
+
+static int command_fsck_validate(command_t *self, int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Error: Invalid number of arguments\n");
+        fprintf(stderr, "Usage: %s\n", self->usage);
+        return CMD_ERROR_INVALID_ARGUMENTS;
+    }
+
+    return 0;
+}
+
+static int command_fsck_run(command_t *self, int argc, char **argv)
+{
+    repository_t *repo = repository_open();
+    if (!repo)
+    {
+        fprintf(stderr, "Error: Failed to open repository\n");
+        return CMD_ERROR_EXEC_FAILED;
+    }
+
+    // 1 means the check ran and found problems, which it has reported
+    int result = repository_fsck(repo);
+    if (result < 0)
+    {
+        fprintf(stderr, "Error: Failed to check objects\n");
+    }
+
+    repository_free(repo);
+    return result == 0 ? 0 : CMD_ERROR_EXEC_FAILED;
+}
+
+command_t command_fsck_impl = {
+    .name = "fsck",
+    .description = "Verify the hash and structure of every stored object",
+    .usage = "vcs fsck",
     .ctx = NULL,
-    .validate = NULL,
-    .run = NULL,
+    .validate = command_fsck_validate,
+    .run = command_fsck_run,
+    .cleanup = NULL};
+
+typedef struct
+{
+    const char *option;
+    const char *object;
+} cat_file_ctx_t;
+
+static int command_cat_file_validate(command_t *self, int argc, char **argv)
+{
+    cat_file_ctx_t *ctx = (cat_file_ctx_t *)self->ctx;
+
+    if (argc != 4)
+    {
+        fprintf(stderr, "Error: Invalid number of arguments\n");
+        fprintf(stderr, "Usage: %s\n", self->usage);
+        return CMD_ERROR_INVALID_ARGUMENTS;
+    }
+
+    const char *options[] = {"-t", "-s", "-p", "blob", "tree", "commit", NULL};
+    for (const char **option = options; *option; option++)
+    {
+        if (strcmp(argv[2], *option) == 0)
+        {
+            ctx->option = argv[2];
+            ctx->object = argv[3];
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Error: Invalid option '%s'\n", argv[2]);
+    fprintf(stderr, "Usage: %s\n", self->usage);
+    return CMD_ERROR_INVALID_ARGUMENTS;
+}
+
+static int command_cat_file_run(command_t *self, int argc, char **argv)
+{
+    cat_file_ctx_t *ctx = (cat_file_ctx_t *)self->ctx;
+
+    repository_t *repo = repository_open();
+    if (!repo)
+    {
+        fprintf(stderr, "Error: Failed to open repository\n");
+        return CMD_ERROR_EXEC_FAILED;
+    }
+
+    int result = repository_cat_file(repo, ctx->option, ctx->object);
+    if (result != 0)
+    {
+        fprintf(stderr, "Error: Failed to read object '%s'\n", ctx->object);
+    }
+
+    repository_free(repo);
+    return result == 0 ? 0 : CMD_ERROR_EXEC_FAILED;
+}
+
+cat_file_ctx_t cat_file_ctx = {NULL, NULL};
+
+command_t command_cat_file_impl = {
+    .name = "cat-file",
+    .description = "Show the type, size or content of a stored object",
+    .usage = "vcs cat-file (-t | -s | -p | <type>) <object>",
+    .ctx = &cat_file_ctx,
+    .validate = command_cat_file_validate,
+    .run = command_cat_file_run,
     .cleanup = NULL};
 
 command_t *command_init()
@@ -269,4 +509,29 @@ command_t *command_commit()
 command_t *command_status()
 {
     return &command_status_impl;
-}
\ No newline at end of file
+}
+
+command_t *command_log()
+{
+    return &command_log_impl;
+}
+
+command_t *command_repack()
+{
+    return &command_repack_impl;
+}
+
+command_t *command_commit_graph()
+{
+    return &command_commit_graph_impl;
+}
+
+command_t *command_fsck()
+{
+    return &command_fsck_impl;
+}
+
+command_t *command_cat_file()
+{
+    return &command_cat_file_impl;
+}
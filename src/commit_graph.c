@@ -0,0 +1,525 @@
+#include "commit_graph.h"
+#include "object.h"
+#include "object_types.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <uthash.h>
+
+#define GRAPH_HEADER_SIZE 8
+#define GRAPH_FANOUT_SIZE (256 * 4)
+#define GRAPH_RECORD_SIZE (SHA256_SIZE + 4 + 4 + 8)
+#define GRAPH_REFS_DIR ".vcs/refs/heads"
+
+typedef struct
+{
+    unsigned char *map;
+    size_t map_size;
+    uint32_t count;
+    const unsigned char *fanout;
+    const unsigned char *ids;
+    const unsigned char *records;
+} commit_graph_t;
+
+static commit_graph_t graph;
+static int graph_loaded = 0;
+static pthread_mutex_t graph_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A commit on its way into a new graph
+typedef struct
+{
+    object_id_t oid;
+    object_id_t tree;
+    object_id_t parent; // null for a root commit
+    time_t time;
+    uint32_t parent_pos;
+    uint32_t generation;
+} graph_commit_t;
+
+// Commits already collected by a rebuild, so shared history is parsed once
+typedef struct
+{
+    object_id_t oid;
+    UT_hash_handle hh;
+} seen_commit_t;
+
+static void graph_unload(void)
+{
+    if (graph.map)
+        munmap(graph.map, graph.map_size);
+    memset(&graph, 0, sizeof(graph));
+    graph_loaded = 0;
+}
+
+// Every parent must be in the table and one generation older, which also
+// guarantees that walks end
+static int graph_check(const commit_graph_t *g)
+{
+    for (uint32_t i = 0; i < g->count; i++)
+    {
+        const unsigned char *record = g->records + (size_t)i * GRAPH_RECORD_SIZE;
+        uint32_t parent = get_be32(record + SHA256_SIZE);
+        uint32_t generation = get_be32(record + SHA256_SIZE + 4);
+        if (parent == COMMIT_GRAPH_NONE)
+        {
+            if (generation != 1)
+                return -1;
+        }
+        else if (parent >= g->count ||
+                 get_be32(g->records + (size_t)parent * GRAPH_RECORD_SIZE + SHA256_SIZE + 4) + 1 != generation)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int graph_open(commit_graph_t *g)
+{
+    int fd = open(COMMIT_GRAPH_FILE, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    g->map = map;
+    g->map_size = st.st_size;
+
+    size_t min_size = GRAPH_HEADER_SIZE + GRAPH_FANOUT_SIZE + SHA256_SIZE;
+    if (g->map_size < min_size ||
+        get_be32(g->map) != COMMIT_GRAPH_SIGNATURE || get_be32(g->map + 4) != COMMIT_GRAPH_VERSION)
+    {
+        fprintf(stderr, "Error: Invalid commit graph '%s'\n", COMMIT_GRAPH_FILE);
+        goto invalid;
+    }
+
+    g->fanout = g->map + GRAPH_HEADER_SIZE;
+    g->count = get_be32(g->fanout + 255 * 4);
+    g->ids = g->fanout + GRAPH_FANOUT_SIZE;
+    g->records = g->ids + (size_t)g->count * SHA256_SIZE;
+
+    if (min_size + (size_t)g->count * (SHA256_SIZE + GRAPH_RECORD_SIZE) != g->map_size || graph_check(g) != 0)
+    {
+        fprintf(stderr, "Error: Damaged commit graph '%s'\n", COMMIT_GRAPH_FILE);
+        goto invalid;
+    }
+    return 0;
+
+invalid:
+    munmap(g->map, g->map_size);
+    memset(g, 0, sizeof(*g));
+    return -1;
+}
+
+// Loaded on first use; a missing or damaged graph leaves it empty
+static void graph_load(void)
+{
+    pthread_mutex_lock(&graph_lock);
+    if (!graph_loaded)
+    {
+        graph_loaded = 1;
+        graph_open(&graph);
+    }
+    pthread_mutex_unlock(&graph_lock);
+}
+
+// Position of the first id in the loaded graph that is not below id
+static uint32_t graph_lower_bound(const unsigned char *id)
+{
+    uint32_t lo = id[0] == 0 ? 0 : get_be32(graph.fanout + (id[0] - 1) * 4);
+    uint32_t hi = get_be32(graph.fanout + id[0] * 4);
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (memcmp(graph.ids + (size_t)mid * SHA256_SIZE, id, SHA256_SIZE) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int commit_graph_find(const object_id_t *oid, uint32_t *out_pos)
+{
+    graph_load();
+    if (!graph.map)
+        return 1;
+
+    uint32_t pos = graph_lower_bound(oid->hash);
+    if (pos >= graph.count || memcmp(graph.ids + (size_t)pos * SHA256_SIZE, oid->hash, SHA256_SIZE) != 0)
+        return 1;
+    *out_pos = pos;
+    return 0;
+}
+
+void commit_graph_id(uint32_t pos, object_id_t *out_oid)
+{
+    memcpy(out_oid->hash, graph.ids + (size_t)pos * SHA256_SIZE, SHA256_SIZE);
+}
+
+void commit_graph_entry(uint32_t pos, commit_graph_entry_t *out_entry)
+{
+    const unsigned char *record = graph.records + (size_t)pos * GRAPH_RECORD_SIZE;
+    memcpy(out_entry->tree.hash, record, SHA256_SIZE);
+    out_entry->parent = get_be32(record + SHA256_SIZE);
+    out_entry->generation = get_be32(record + SHA256_SIZE + 4);
+    out_entry->time = (time_t)(int64_t)get_be64(record + SHA256_SIZE + 8);
+}
+
+int commit_graph_read_commit(const object_id_t *oid, object_id_t *out_tree, object_id_t *out_parent)
+{
+    uint32_t pos;
+    if (commit_graph_find(oid, &pos) == 0)
+    {
+        commit_graph_entry_t entry;
+        commit_graph_entry(pos, &entry);
+        if (out_tree)
+            *out_tree = entry.tree;
+        if (out_parent)
+        {
+            if (entry.parent == COMMIT_GRAPH_NONE)
+                oid_clear(out_parent);
+            else
+                commit_graph_id(entry.parent, out_parent);
+        }
+        return 0;
+    }
+
+    commit_data_t commit;
+    if (object_read_commit(oid, &commit) != 0)
+        return -1;
+    if (out_tree)
+        *out_tree = commit.tree;
+    if (out_parent)
+        *out_parent = commit.parent;
+    return 0;
+}
+
+static int compare_commits(const void *a, const void *b)
+{
+    return oid_cmp(&((const graph_commit_t *)a)->oid, &((const graph_commit_t *)b)->oid);
+}
+
+// Sorts the commits and turns parent ids into positions and generations.
+// Fails when a parent is not among them.
+static int resolve_commits(graph_commit_t *commits, size_t count)
+{
+    qsort(commits, count, sizeof(graph_commit_t), compare_commits);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        commits[i].generation = 0;
+        commits[i].parent_pos = COMMIT_GRAPH_NONE;
+        if (oid_is_null(&commits[i].parent))
+            continue;
+
+        graph_commit_t key;
+        key.oid = commits[i].parent;
+        graph_commit_t *parent = bsearch(&key, commits, count, sizeof(graph_commit_t), compare_commits);
+        if (!parent)
+        {
+            fprintf(stderr, "Error: Parent of commit %s is missing\n", oid_hex(&commits[i].oid));
+            return -1;
+        }
+        commits[i].parent_pos = parent - commits;
+    }
+
+    // Climb to the nearest commit with a known generation, then number
+    // the commits passed on the way back down
+    uint32_t *chain = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!chain)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t depth = 0;
+        uint32_t pos = i;
+        while (pos != COMMIT_GRAPH_NONE && commits[pos].generation == 0)
+        {
+            chain[depth++] = pos;
+            pos = commits[pos].parent_pos;
+        }
+        uint32_t generation = pos == COMMIT_GRAPH_NONE ? 0 : commits[pos].generation;
+        while (depth > 0)
+            commits[chain[--depth]].generation = ++generation;
+    }
+    free(chain);
+    return 0;
+}
+
+static int finish_graph(unsigned char *buf, size_t size);
+
+static int store_graph(const graph_commit_t *commits, size_t count)
+{
+    size_t size = GRAPH_HEADER_SIZE + GRAPH_FANOUT_SIZE + count * (SHA256_SIZE + GRAPH_RECORD_SIZE) + SHA256_SIZE;
+    unsigned char *buf = calloc(1, size);
+    if (!buf)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    unsigned char *p = buf;
+    put_be32(p, COMMIT_GRAPH_SIGNATURE);
+    put_be32(p + 4, COMMIT_GRAPH_VERSION);
+    p += GRAPH_HEADER_SIZE;
+
+    size_t j = 0;
+    for (int bucket = 0; bucket < 256; bucket++)
+    {
+        while (j < count && commits[j].oid.hash[0] == bucket)
+            j++;
+        put_be32(p + bucket * 4, j);
+    }
+    p += GRAPH_FANOUT_SIZE;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy(p, commits[i].oid.hash, SHA256_SIZE);
+        p += SHA256_SIZE;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy(p, commits[i].tree.hash, SHA256_SIZE);
+        put_be32(p + SHA256_SIZE, commits[i].parent_pos);
+        put_be32(p + SHA256_SIZE + 4, commits[i].generation);
+        put_be64(p + SHA256_SIZE + 8, (uint64_t)(int64_t)commits[i].time);
+        p += GRAPH_RECORD_SIZE;
+    }
+    return finish_graph(buf, size);
+}
+
+// Appends the checksum to a graph laid out in buf, which it takes over,
+// and replaces the graph file with it
+static int finish_graph(unsigned char *buf, size_t size)
+{
+    unsigned char *p = buf + size - SHA256_SIZE;
+    unsigned int hash_len;
+    int result = -1;
+    if (EVP_Digest(buf, p - buf, p, &hash_len, EVP_sha256(), NULL))
+    {
+        // Derived data: a graph lost in a crash is rebuilt, so no fsync
+        result = write_file_atomic(COMMIT_GRAPH_FILE, buf, size, 0);
+    }
+    if (result != 0)
+        fprintf(stderr, "Error: Failed to write commit graph '%s'\n", COMMIT_GRAPH_FILE);
+    free(buf);
+
+    pthread_mutex_lock(&graph_lock);
+    graph_unload();
+    pthread_mutex_unlock(&graph_lock);
+    return result;
+}
+
+static int append_commit(graph_commit_t **commits, size_t *count, size_t *capacity)
+{
+    if (*count == *capacity)
+    {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 256;
+        graph_commit_t *grown = realloc(*commits, grown_capacity * sizeof(graph_commit_t));
+        if (!grown)
+        {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        *commits = grown;
+        *capacity = grown_capacity;
+    }
+    (*count)++;
+    return 0;
+}
+
+// Parses every commit reachable from the branch tip at ref_path that has
+// not been seen yet
+static int collect_branch(const char *ref_path, seen_commit_t **seen,
+                          graph_commit_t **commits, size_t *count, size_t *capacity)
+{
+    FILE *fp = fopen(ref_path, "r");
+    if (!fp)
+        return 0;
+
+    char hex[HEX_SIZE] = {0};
+    object_id_t oid;
+    if (!fgets(hex, sizeof(hex), fp) || oid_from_hex(hex, &oid) != 0)
+        oid_clear(&oid);
+    fclose(fp);
+
+    commit_data_t commit;
+    while (!oid_is_null(&oid))
+    {
+        seen_commit_t *found;
+        HASH_FIND(hh, *seen, &oid, sizeof(object_id_t), found);
+        if (found)
+            break;
+
+        found = malloc(sizeof(seen_commit_t));
+        if (!found || append_commit(commits, count, capacity) != 0)
+        {
+            free(found);
+            return -1;
+        }
+        found->oid = oid;
+        HASH_ADD(hh, *seen, oid, sizeof(object_id_t), found);
+
+        if (object_read_commit(&oid, &commit) != 0)
+        {
+            fprintf(stderr, "Error: Failed to read commit %s\n", oid_hex(&oid));
+            return -1;
+        }
+
+        graph_commit_t *entry = &(*commits)[*count - 1];
+        entry->oid = oid;
+        entry->tree = commit.tree;
+        entry->parent = commit.parent;
+        entry->time = commit.committer.time;
+        oid = commit.parent;
+    }
+    return 0;
+}
+
+int commit_graph_write(void)
+{
+    graph_commit_t *commits = NULL;
+    size_t count = 0, capacity = 0;
+    seen_commit_t *seen = NULL;
+    int result = 0;
+
+    DIR *dir = opendir(GRAPH_REFS_DIR);
+    if (dir)
+    {
+        struct dirent *entry;
+        while (result == 0 && (entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_name[0] == '.')
+                continue;
+            char ref_path[PATH_MAX];
+            snprintf(ref_path, sizeof(ref_path), "%s/%s", GRAPH_REFS_DIR, entry->d_name);
+            result = collect_branch(ref_path, &seen, &commits, &count, &capacity);
+        }
+        closedir(dir);
+    }
+
+    seen_commit_t *node, *tmp;
+    HASH_ITER(hh, seen, node, tmp)
+    {
+        HASH_DEL(seen, node);
+        free(node);
+    }
+
+    if (result == 0)
+        result = resolve_commits(commits, count);
+    if (result == 0)
+        result = store_graph(commits, count);
+    if (result == 0)
+        printf("Wrote commit graph with %zu commits\n", count);
+    free(commits);
+    return result;
+}
+
+int commit_graph_add(const object_id_t *oid, const object_id_t *tree, const object_id_t *parent, time_t time)
+{
+    uint32_t pos;
+    if (commit_graph_find(oid, &pos) == 0)
+        return 0;
+
+    if (!graph.map)
+    {
+        // A graph that is there but could not be loaded is rebuilt
+        if (access(COMMIT_GRAPH_FILE, F_OK) == 0)
+            return commit_graph_write();
+        if (parent && !oid_is_null(parent))
+            return 0;
+    }
+    else if (parent && !oid_is_null(parent) && commit_graph_find(parent, &pos) != 0)
+    {
+        return commit_graph_write();
+    }
+
+    // The new record goes in at its sorted position in one pass over the
+    // old file: records after it move up one, and so do parent positions
+    // that point at them. Nothing is sorted or searched again.
+    uint32_t count = graph.map ? graph.count : 0;
+    uint32_t at = graph.map ? graph_lower_bound(oid->hash) : 0;
+    uint32_t parent_pos = COMMIT_GRAPH_NONE;
+    uint32_t generation = 1;
+    if (parent && !oid_is_null(parent) && commit_graph_find(parent, &parent_pos) == 0)
+    {
+        commit_graph_entry_t entry;
+        commit_graph_entry(parent_pos, &entry);
+        generation = entry.generation + 1;
+        if (parent_pos >= at)
+            parent_pos++;
+    }
+
+    size_t size = GRAPH_HEADER_SIZE + GRAPH_FANOUT_SIZE +
+                  (size_t)(count + 1) * (SHA256_SIZE + GRAPH_RECORD_SIZE) + SHA256_SIZE;
+    unsigned char *buf = malloc(size);
+    if (!buf)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    unsigned char *p = buf;
+    put_be32(p, COMMIT_GRAPH_SIGNATURE);
+    put_be32(p + 4, COMMIT_GRAPH_VERSION);
+    p += GRAPH_HEADER_SIZE;
+
+    for (int bucket = 0; bucket < 256; bucket++)
+    {
+        uint32_t before = count ? get_be32(graph.fanout + bucket * 4) : 0;
+        put_be32(p + bucket * 4, before + (bucket >= oid->hash[0]));
+    }
+    p += GRAPH_FANOUT_SIZE;
+
+    if (at > 0)
+        memcpy(p, graph.ids, (size_t)at * SHA256_SIZE);
+    p += (size_t)at * SHA256_SIZE;
+    memcpy(p, oid->hash, SHA256_SIZE);
+    p += SHA256_SIZE;
+    if (count > at)
+        memcpy(p, graph.ids + (size_t)at * SHA256_SIZE, (size_t)(count - at) * SHA256_SIZE);
+    p += (size_t)(count - at) * SHA256_SIZE;
+
+    for (uint32_t i = 0; i <= count; i++, p += GRAPH_RECORD_SIZE)
+    {
+        if (i == at)
+        {
+            memcpy(p, tree->hash, SHA256_SIZE);
+            put_be32(p + SHA256_SIZE, parent_pos);
+            put_be32(p + SHA256_SIZE + 4, generation);
+            put_be64(p + SHA256_SIZE + 8, (uint64_t)(int64_t)time);
+            continue;
+        }
+
+        uint32_t from = i < at ? i : i - 1;
+        memcpy(p, graph.records + (size_t)from * GRAPH_RECORD_SIZE, GRAPH_RECORD_SIZE);
+        uint32_t old_parent = get_be32(p + SHA256_SIZE);
+        if (old_parent != COMMIT_GRAPH_NONE && old_parent >= at)
+            put_be32(p + SHA256_SIZE, old_parent + 1);
+    }
+    return finish_graph(buf, size);
+}
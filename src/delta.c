@@ -0,0 +1,274 @@
+#include "delta.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DELTA_BLOCK 16
+#define DELTA_MAX_INSERT 127
+#define DELTA_MAX_COPY 0xffffff
+#define DELTA_EMPTY_SLOT UINT32_MAX
+
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    size_t limit;
+} delta_buf_t;
+
+static int buf_reserve(delta_buf_t *buf, size_t extra)
+{
+    if (buf->size + extra > buf->limit)
+        return -1;
+
+    if (buf->size + extra > buf->capacity)
+    {
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 256;
+        while (capacity < buf->size + extra)
+            capacity *= 2;
+        unsigned char *grown = realloc(buf->data, capacity);
+        if (!grown)
+            return -1;
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    return 0;
+}
+
+static int emit_varint(delta_buf_t *buf, size_t value)
+{
+    if (buf_reserve(buf, 10) != 0)
+        return -1;
+
+    do
+    {
+        unsigned char byte = value & 0x7f;
+        value >>= 7;
+        buf->data[buf->size++] = byte | (value ? 0x80 : 0);
+    } while (value);
+    return 0;
+}
+
+static int emit_insert(delta_buf_t *buf, const unsigned char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = len > DELTA_MAX_INSERT ? DELTA_MAX_INSERT : len;
+        if (buf_reserve(buf, n + 1) != 0)
+            return -1;
+        buf->data[buf->size++] = (unsigned char)n;
+        memcpy(buf->data + buf->size, data, n);
+        buf->size += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int emit_copy(delta_buf_t *buf, size_t offset, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = len > DELTA_MAX_COPY ? DELTA_MAX_COPY : len;
+        if (buf_reserve(buf, 8) != 0)
+            return -1;
+
+        unsigned char *op = &buf->data[buf->size++];
+        *op = 0x80;
+        for (int i = 0; i < 4; i++)
+        {
+            unsigned char byte = (offset >> (i * 8)) & 0xff;
+            if (byte)
+            {
+                *op |= 1 << i;
+                buf->data[buf->size++] = byte;
+            }
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            unsigned char byte = (n >> (i * 8)) & 0xff;
+            if (byte)
+            {
+                *op |= 0x10 << i;
+                buf->data[buf->size++] = byte;
+            }
+        }
+
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint32_t block_hash(const unsigned char *p, unsigned bits)
+{
+    uint64_t a, b;
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, 8);
+    return (uint32_t)(((a * 0x9e3779b97f4a7c15ULL) ^ b) * 0xff51afd7ed558ccdULL >> (64 - bits));
+}
+
+int delta_create(const unsigned char *base, size_t base_size,
+                 const unsigned char *target, size_t target_size,
+                 size_t max_size, unsigned char **out_delta, size_t *out_size)
+{
+    // Copy offsets are 32-bit
+    if (base_size < DELTA_BLOCK || base_size > UINT32_MAX)
+        return -1;
+
+    // One slot per base block, later blocks win on collision
+    unsigned bits = 4;
+    while (((size_t)1 << bits) < base_size / DELTA_BLOCK && bits < 24)
+        bits++;
+    uint32_t *table = malloc(((size_t)1 << bits) * sizeof(uint32_t));
+    if (!table)
+        return -1;
+    memset(table, 0xff, ((size_t)1 << bits) * sizeof(uint32_t));
+
+    for (size_t off = 0; off + DELTA_BLOCK <= base_size; off += DELTA_BLOCK)
+    {
+        table[block_hash(base + off, bits)] = (uint32_t)off;
+    }
+
+    delta_buf_t buf = {.limit = max_size};
+    int result = -1;
+    if (emit_varint(&buf, base_size) != 0 || emit_varint(&buf, target_size) != 0)
+        goto done;
+
+    size_t pos = 0;
+    size_t literal_start = 0;
+    while (pos + DELTA_BLOCK <= target_size)
+    {
+        uint32_t slot = table[block_hash(target + pos, bits)];
+        if (slot == DELTA_EMPTY_SLOT || memcmp(base + slot, target + pos, DELTA_BLOCK) != 0)
+        {
+            pos++;
+            continue;
+        }
+
+        size_t match_base = slot;
+        size_t match_len = DELTA_BLOCK;
+        while (match_base + match_len < base_size && pos + match_len < target_size &&
+               base[match_base + match_len] == target[pos + match_len])
+        {
+            match_len++;
+        }
+
+        // Grow the match backwards over bytes that would otherwise be inserted
+        while (pos > literal_start && match_base > 0 && base[match_base - 1] == target[pos - 1])
+        {
+            pos--;
+            match_base--;
+            match_len++;
+        }
+
+        if (emit_insert(&buf, target + literal_start, pos - literal_start) != 0 ||
+            emit_copy(&buf, match_base, match_len) != 0)
+            goto done;
+
+        pos += match_len;
+        literal_start = pos;
+    }
+
+    if (emit_insert(&buf, target + literal_start, target_size - literal_start) != 0)
+        goto done;
+
+    *out_delta = buf.data;
+    *out_size = buf.size;
+    buf.data = NULL;
+    result = 0;
+
+done:
+    free(buf.data);
+    free(table);
+    return result;
+}
+
+static int read_varint(const unsigned char **p, const unsigned char *end, size_t *out)
+{
+    size_t value = 0;
+    int shift = 0;
+    unsigned char byte;
+    do
+    {
+        if (*p >= end || shift > 63)
+            return -1;
+        byte = *(*p)++;
+        value |= (size_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    *out = value;
+    return 0;
+}
+
+int delta_sizes(const unsigned char *delta, size_t delta_size, size_t *base_size, size_t *result_size)
+{
+    const unsigned char *p = delta;
+    const unsigned char *end = delta + delta_size;
+    if (read_varint(&p, end, base_size) != 0 || read_varint(&p, end, result_size) != 0)
+        return -1;
+    return (int)(p - delta);
+}
+
+int delta_apply(const unsigned char *base, size_t base_size,
+                const unsigned char *delta, size_t delta_size,
+                unsigned char *result, size_t result_size)
+{
+    size_t expected_base, expected_result;
+    int header_len = delta_sizes(delta, delta_size, &expected_base, &expected_result);
+    if (header_len < 0 || expected_base != base_size || expected_result != result_size)
+        return -1;
+
+    const unsigned char *p = delta + header_len;
+    const unsigned char *end = delta + delta_size;
+    size_t out = 0;
+    while (p < end)
+    {
+        unsigned char op = *p++;
+        if (op & 0x80)
+        {
+            size_t offset = 0, len = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                if (op & (1 << i))
+                {
+                    if (p >= end)
+                        return -1;
+                    offset |= (size_t)*p++ << (i * 8);
+                }
+            }
+            for (int i = 0; i < 3; i++)
+            {
+                if (op & (0x10 << i))
+                {
+                    if (p >= end)
+                        return -1;
+                    len |= (size_t)*p++ << (i * 8);
+                }
+            }
+            if (len == 0)
+                len = 0x10000;
+
+            if (offset + len > base_size || out + len > result_size)
+                return -1;
+            memcpy(result + out, base + offset, len);
+            out += len;
+        }
+        else if (op)
+        {
+            if ((size_t)(end - p) < op || out + op > result_size)
+                return -1;
+            memcpy(result + out, p, op);
+            p += op;
+            out += op;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    return out == result_size ? 0 : -1;
+}
@@ -0,0 +1,258 @@
+#include "fsck.h"
+#include "odb.h"
+#include "pack.h"
+#include "object.h"
+#include "object_types.h"
+#include "tree_iter.h"
+#include "hash.h"
+#include "parallel.h"
+#include "chunk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// One stored copy of an object. An id that is both loose and packed is
+// checked twice, once per copy.
+typedef struct
+{
+    object_id_t oid;
+    int packed;
+} fsck_object_t;
+
+typedef struct
+{
+    fsck_object_t *objects;
+    size_t count;
+    size_t capacity;
+    int packed; // where the copies being collected live
+    object_id_t *ids; // sorted and unique, for reference checks
+    size_t id_count;
+    size_t loose;
+    size_t bytes;    // content hashed, added to by the workers
+    size_t problems; // likewise
+} fsck_t;
+
+static int collect_object(const object_id_t *oid, void *ctx)
+{
+    fsck_t *fsck = ctx;
+    if (fsck->count == fsck->capacity)
+    {
+        size_t capacity = fsck->capacity ? fsck->capacity * 2 : 1024;
+        void *grown = realloc(fsck->objects, capacity * sizeof(fsck_object_t));
+        if (!grown)
+            return -1;
+        fsck->objects = grown;
+        fsck->capacity = capacity;
+    }
+    fsck->objects[fsck->count].oid = *oid;
+    fsck->objects[fsck->count].packed = fsck->packed;
+    fsck->count++;
+    return 0;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    return oid_cmp(a, b);
+}
+
+// Sorted unique ids of everything collected
+static int build_id_set(fsck_t *fsck)
+{
+    fsck->ids = malloc((fsck->count ? fsck->count : 1) * sizeof(object_id_t));
+    if (!fsck->ids)
+        return -1;
+
+    for (size_t i = 0; i < fsck->count; i++)
+        fsck->ids[i] = fsck->objects[i].oid;
+    qsort(fsck->ids, fsck->count, sizeof(object_id_t), compare_ids);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < fsck->count; i++)
+    {
+        if (unique == 0 || !oid_equal(&fsck->ids[unique - 1], &fsck->ids[i]))
+            fsck->ids[unique++] = fsck->ids[i];
+    }
+    fsck->id_count = unique;
+    return 0;
+}
+
+static int is_stored(const fsck_t *fsck, const object_id_t *oid)
+{
+    return bsearch(oid, fsck->ids, fsck->id_count, sizeof(object_id_t), compare_ids) != NULL;
+}
+
+// Printed from the worker threads; each line goes out in one call
+static void report_problem(fsck_t *fsck, const char *format, ...)
+{
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    printf("%s\n", line);
+    __sync_fetch_and_add(&fsck->problems, 1);
+}
+
+static void check_reference(fsck_t *fsck, const char *from, const object_id_t *oid, const char *type)
+{
+    if (!is_stored(fsck, oid))
+    {
+        char hex[HEX_SIZE];
+        oid_to_hex(oid, hex);
+        report_problem(fsck, "error: missing %s %s (referenced by %s)", type, hex, from);
+    }
+}
+
+static void check_tree(fsck_t *fsck, const char *hex, const odb_object_t *object)
+{
+    tree_iter_t iter;
+    tree_entry_view_t entry;
+    int result;
+    tree_iter_init(&iter, object->data, object->size);
+    while ((result = tree_iter_next(&iter, &entry)) > 0)
+    {
+        // Files carry their full path as the name, so '/' is allowed
+        if (entry.name_len == 0 || !(S_ISDIR(entry.mode) || S_ISREG(entry.mode) || S_ISLNK(entry.mode)))
+        {
+            report_problem(fsck, "error: tree %s has a bad entry '%.*s' (mode %o)", hex,
+                           (int)entry.name_len, entry.name, (unsigned int)entry.mode);
+        }
+        check_reference(fsck, hex, &entry.oid, S_ISDIR(entry.mode) ? "tree" : "blob");
+    }
+    if (result < 0)
+        report_problem(fsck, "error: tree %s is malformed", hex);
+}
+
+static void check_commit(fsck_t *fsck, const char *hex, const odb_object_t *object)
+{
+    commit_data_t commit;
+    if (parse_commit_data(&commit, (const char *)object->data, object->size) != 0)
+    {
+        report_problem(fsck, "error: commit %s is malformed", hex);
+        return;
+    }
+
+    check_reference(fsck, hex, &commit.tree, "tree");
+    if (!oid_is_null(&commit.parent))
+        check_reference(fsck, hex, &commit.parent, "commit");
+}
+
+static void check_chunks(fsck_t *fsck, const char *hex, const odb_object_t *object)
+{
+    if (object->size == 0 || object->size % CHUNK_RECORD_SIZE != 0)
+    {
+        report_problem(fsck, "error: chunk list %s is malformed", hex);
+        return;
+    }
+
+    for (size_t pos = 0; pos < object->size; pos += CHUNK_RECORD_SIZE)
+    {
+        object_id_t chunk;
+        size_t size;
+        chunk_record(object->data + pos, &chunk, &size);
+        if (size == 0 || size > CHUNK_MAX_SIZE)
+            report_problem(fsck, "error: chunk list %s has a chunk of %zu bytes", hex, size);
+        check_reference(fsck, hex, &chunk, "blob");
+    }
+}
+
+static void check_object(size_t index, void *ctx)
+{
+    fsck_t *fsck = ctx;
+    const fsck_object_t *entry = &fsck->objects[index];
+    char hex[HEX_SIZE];
+    oid_to_hex(&entry->oid, hex);
+
+    odb_object_t object;
+    int mapped = entry->packed ? pack_map_object(&entry->oid, &object) : odb_map_loose(&entry->oid, &object);
+    if (mapped != 0)
+    {
+        report_problem(fsck, "error: %s object %s cannot be read", entry->packed ? "packed" : "loose", hex);
+        return;
+    }
+
+    char header[OBJECT_HEADER_MAX];
+    int header_len = snprintf(header, sizeof(header), "%s %zu", object_type_to_string(object.type), object.size) + 1;
+    object_id_t actual;
+    if (hash_message(header, header_len, object.data, object.size, actual.hash) != 0)
+    {
+        report_problem(fsck, "error: %s could not be hashed", hex);
+    }
+    else if (!oid_equal(&actual, &entry->oid))
+    {
+        char actual_hex[HEX_SIZE];
+        oid_to_hex(&actual, actual_hex);
+        report_problem(fsck, "error: %s %s hashes to %s", object_type_to_string(object.type), hex, actual_hex);
+    }
+    else if (object.type == OBJ_TREE)
+    {
+        check_tree(fsck, hex, &object);
+    }
+    else if (object.type == OBJ_COMMIT)
+    {
+        check_commit(fsck, hex, &object);
+    }
+    else if (object.type == OBJ_CHUNKS)
+    {
+        check_chunks(fsck, hex, &object);
+    }
+
+    __sync_fetch_and_add(&fsck->bytes, object.size);
+    odb_unmap(&object);
+}
+
+int fsck_run(const object_id_t *head)
+{
+    fsck_t fsck;
+    memset(&fsck, 0, sizeof(fsck));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (odb_for_each_loose_object(collect_object, &fsck) != 0)
+        goto oom;
+    fsck.loose = fsck.count;
+    fsck.packed = 1;
+    if (pack_for_each_object(collect_object, &fsck) != 0 || build_id_set(&fsck) != 0)
+        goto oom;
+
+    size_t pack_bytes;
+    size_t damaged_packs = pack_verify(&pack_bytes);
+    fsck.problems += damaged_packs;
+
+    parallel_for(fsck.count, check_object, &fsck);
+
+    if (head && !oid_is_null(head))
+        check_reference(&fsck, "HEAD", head, "commit");
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    printf("Checked %zu objects (%zu loose, %zu packed) in %.3f s on %zu threads\n",
+           fsck.count, fsck.loose, fsck.count - fsck.loose, seconds, parallel_threads());
+    printf("Hashed %.1f MiB of content and %.1f MiB of packs: %.1f MiB/s, %.0f objects/s\n",
+           fsck.bytes / 1048576.0, pack_bytes / 1048576.0,
+           (fsck.bytes + pack_bytes) / 1048576.0 / seconds, fsck.count / seconds);
+    if (fsck.problems)
+        printf("%zu problems found\n", fsck.problems);
+    else
+        printf("No problems found\n");
+
+    int result = fsck.problems ? 1 : 0;
+    free(fsck.objects);
+    free(fsck.ids);
+    return result;
+
+oom:
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    free(fsck.objects);
+    free(fsck.ids);
+    return -1;
+}
@@ -0,0 +1,95 @@
+#include "hash.h"
+
+#include <string.h>
+
+static hash_algo_t repo_algo = HASH_SHA256;
+
+void hash_set_algo(hash_algo_t algo)
+{
+    repo_algo = algo;
+}
+
+hash_algo_t hash_get_algo(void)
+{
+    return repo_algo;
+}
+
+const char *hash_algo_name(hash_algo_t algo)
+{
+    return algo == HASH_BLAKE3 ? "blake3" : "sha256";
+}
+
+int hash_algo_from_name(const char *name, hash_algo_t *out)
+{
+    if (strcmp(name, "sha256") == 0)
+        *out = HASH_SHA256;
+    else if (strcmp(name, "blake3") == 0)
+        *out = HASH_BLAKE3;
+    else
+        return -1;
+    return 0;
+}
+
+int hash_init(hash_ctx_t *ctx)
+{
+    ctx->algo = repo_algo;
+    ctx->evp = NULL;
+    if (ctx->algo == HASH_BLAKE3)
+    {
+        blake3_init(&ctx->blake3);
+        return 0;
+    }
+
+    ctx->evp = EVP_MD_CTX_new();
+    if (!ctx->evp || !EVP_DigestInit_ex(ctx->evp, EVP_sha256(), NULL))
+    {
+        hash_release(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+int hash_update(hash_ctx_t *ctx, const void *data, size_t len)
+{
+    if (ctx->algo == HASH_BLAKE3)
+    {
+        blake3_update(&ctx->blake3, data, len);
+        return 0;
+    }
+    return EVP_DigestUpdate(ctx->evp, data, len) ? 0 : -1;
+}
+
+int hash_final(hash_ctx_t *ctx, unsigned char *out)
+{
+    if (ctx->algo == HASH_BLAKE3)
+    {
+        blake3_final(&ctx->blake3, out);
+        return 0;
+    }
+
+    unsigned int len;
+    return EVP_DigestFinal_ex(ctx->evp, out, &len) ? 0 : -1;
+}
+
+void hash_release(hash_ctx_t *ctx)
+{
+    EVP_MD_CTX_free(ctx->evp);
+    ctx->evp = NULL;
+}
+
+int hash_message(const void *prefix, size_t prefix_len, const void *data, size_t size, unsigned char *out)
+{
+    if (repo_algo == HASH_BLAKE3)
+    {
+        blake3_hash_message(prefix, prefix_len, data, size, out);
+        return 0;
+    }
+
+    hash_ctx_t ctx;
+    int result = -1;
+    if (hash_init(&ctx) == 0 && hash_update(&ctx, prefix, prefix_len) == 0 &&
+        hash_update(&ctx, data, size) == 0 && hash_final(&ctx, out) == 0)
+        result = 0;
+    hash_release(&ctx);
+    return result;
+}
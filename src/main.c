@@ -1,4 +1,5 @@
 #include "command.h"
+#include "cmd_errors.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -12,21 +13,42 @@ int main(int argc, char **argv)
     }
 
     const char *command = argv[1];
+    int result;
     if (strcmp(command, "init") == 0)
     {
-        command_execute(command_init(), argc, argv);
+        result = command_execute(command_init(), argc, argv);
     }
     else if (strcmp(command, "add") == 0)
     {
-        command_execute(command_add(), argc, argv);
+        result = command_execute(command_add(), argc, argv);
     }
     else if (strcmp(command, "commit") == 0)
     {
-        command_execute(command_commit(), argc, argv);
+        result = command_execute(command_commit(), argc, argv);
     }
     else if (strcmp(command, "status") == 0)
     {
-        command_execute(command_status(), argc, argv);
+        result = command_execute(command_status(), argc, argv);
+    }
+    else if (strcmp(command, "log") == 0)
+    {
+        result = command_execute(command_log(), argc, argv);
+    }
+    else if (strcmp(command, "repack") == 0)
+    {
+        result = command_execute(command_repack(), argc, argv);
+    }
+    else if (strcmp(command, "commit-graph") == 0)
+    {
+        result = command_execute(command_commit_graph(), argc, argv);
+    }
+    else if (strcmp(command, "fsck") == 0)
+    {
+        result = command_execute(command_fsck(), argc, argv);
+    }
+    else if (strcmp(command, "cat-file") == 0)
+    {
+        result = command_execute(command_cat_file(), argc, argv);
     }
     else
     {
@@ -34,5 +56,6 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    return 1;
+    // Scripts tell success from failure by the exit status alone
+    return result == CMD_SUCCESS ? 0 : 1;
 }
\ No newline at end of file
@@ -1,14 +1,19 @@
 #include "object.h"
-#include "tree.h"
+#include "odb.h"
+#include "chunk.h"
+#include "object_cache.h"
+#include "arena.h"
+#include "tree_iter.h"
 #include "util.h"
 #include "object_types.h"
 #include "parser.h"
 #include "config.h"
 #include <stdlib.h>
 #include <stdio.h>
-#include <openssl/evp.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <libgen.h>
@@ -19,11 +24,11 @@ static void *object_data_allocate(object_type_t type)
     switch (type)
     {
     case OBJ_BLOB:
-        return malloc(sizeof(blob_data_t));
+        return calloc(1, sizeof(blob_data_t));
     case OBJ_TREE:
-        return malloc(sizeof(tree_entry_t));
+        return calloc(1, sizeof(tree_data_t));
     case OBJ_COMMIT:
-        return malloc(sizeof(commit_data_t));
+        return calloc(1, sizeof(commit_data_t));
     default:
         return NULL;
     }
@@ -38,12 +43,18 @@ object_t *object_init(object_type_t type)
     obj->header.type = type;
     obj->header.content_size = 0;
     obj->data = object_data_allocate(type);
+    obj->cached = 0;
 
     return obj;
 }
 
 void object_free(object_t *obj)
 {
+    if (obj->cached)
+    {
+        object_cache_release(obj);
+        return;
+    }
 
     if (obj->header.type == OBJ_TREE)
     {
@@ -54,6 +65,7 @@ void object_free(object_t *obj)
             HASH_DEL(data->entries, entry);
             free(entry);
         }
+        free(data->raw);
     }
 
     if (obj->data)
@@ -65,7 +77,7 @@ void object_free(object_t *obj)
     obj = NULL;
 }
 
-static const char *object_type_to_string(object_type_t type)
+const char *object_type_to_string(object_type_t type)
 {
     switch (type)
     {
@@ -77,269 +89,249 @@ static const char *object_type_to_string(object_type_t type)
         return "commit";
     case OBJ_TAG:
         return "tag";
+    case OBJ_CHUNKS:
+        return "chunks";
     default:
         return "unknown";
     }
 }
 
-static int object_update_hash_with_header(EVP_MD_CTX *ctx, object_header_t *header, unsigned char *hash)
+static int update_blob(object_t *obj, object_update_t data)
 {
-    char header_str[256];
-    int header_len = snprintf(header_str, sizeof(header_str), "%s %zu%c",
-                              object_type_to_string(header->type),
-                              header->content_size,
-                              '\0');
+    blob_data_t *blob = (blob_data_t *)obj->data;
 
-    if (header_len < 0)
+    // Content is streamed from disk at write time, only record where it lives
+    struct stat st;
+    if (stat(data.blob.filepath, &st) != 0 || !S_ISREG(st.st_mode))
     {
+        fprintf(stderr, "Error opening file '%s'\n", data.blob.filepath);
         return -1;
     }
 
-    if (!EVP_DigestUpdate(ctx, header_str, header_len + 1))
+    if (strlen(data.blob.filepath) >= sizeof(blob->filepath))
     {
+        fprintf(stderr, "Error: Path '%s' is too long\n", data.blob.filepath);
         return -1;
     }
 
+    strcpy(blob->filepath, data.blob.filepath);
+    blob->size = st.st_size;
+    obj->header.content_size = blob->size;
+
     return 0;
 }
 
-static int object_update_hash_with_tree(EVP_MD_CTX *ctx, tree_entry_t *entries)
+typedef struct
 {
-    tree_entry_t *entry, *tmp;
+    const char *name;
+    mode_t mode;
+    object_id_t oid;
+} build_entry_t;
 
-    HASH_ITER(hh, entries, entry, tmp)
-    {
-        if (!EVP_DigestUpdate(ctx, &entry->mode, sizeof(mode_t)))
-        {
-            return -1;
-        }
-
-        if (!EVP_DigestUpdate(ctx, entry->name, strlen(entry->name)))
-        {
-            return -1;
-        }
-
-        if (!EVP_DigestUpdate(ctx, entry->hash, HEX_SIZE - 1))
-        {
-            return -1;
-        }
-    }
-
-    return 0;
+static int build_entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const build_entry_t *)a)->name, ((const build_entry_t *)b)->name);
 }
 
-static int object_update_hash_with_commit(EVP_MD_CTX *ctx, commit_data_t *data)
+// Index entries in path order, one at a time: straight from the mapping,
+// or through a sorted array when the table is loaded
+typedef struct
 {
-    if (!EVP_DigestUpdate(ctx, data->tree_hash, HEX_SIZE - 1))
-    {
-        return -1;
-    }
-
-    if (!EVP_DigestUpdate(ctx, &data->author, sizeof(signature_t)))
+    index_iter_t iter;
+    const index_entry_t **sorted;
+    size_t count;
+    size_t pos;
+    const index_entry_t *entry; // the current one, NULL after the last
+    int failed;
+} entry_source_t;
+
+static void source_next(entry_source_t *src)
+{
+    if (src->sorted)
     {
-        return -1;
+        src->entry = src->pos < src->count ? src->sorted[src->pos++] : NULL;
+        return;
     }
-
-    if (!EVP_DigestUpdate(ctx, &data->committer, sizeof(signature_t)))
+    int result = index_iter_next(&src->iter, &src->entry);
+    if (result <= 0)
     {
-        return -1;
+        src->entry = NULL;
+        src->failed = result < 0;
     }
+}
 
-    if (!EVP_DigestUpdate(ctx, data->message, strlen(data->message)))
-    {
-        return -1;
-    }
+static int index_entry_ptr_cmp(const void *a, const void *b)
+{
+    return strcmp((*(const index_entry_t *const *)a)->path, (*(const index_entry_t *const *)b)->path);
+}
 
-    return 0;
+typedef struct
+{
+    arena_t *arena;
+    entry_source_t src;
+    size_t written;
+    size_t reused;
+    int stale; // a valid cache tree node disagreed with the index
+} tree_build_t;
+
+static int has_prefix(const index_entry_t *entry, const char *prefix, size_t len)
+{
+    return entry && strncmp(entry->path, prefix, len) == 0;
 }
 
-static int object_update_hash_with_data(EVP_MD_CTX *ctx, object_t *obj)
+// Lists the directory at base (its path with a trailing '/', "" for the
+// root), whose entries start at the source's current one, and serializes
+// its tree. Subdirectories still valid in the cache tree are taken as they
+// are and their entries skipped; the others are built and written first.
+static int build_tree(tree_build_t *build, cache_tree_t *node, const char *base, size_t base_len,
+                      unsigned char **out, size_t *out_size, uint32_t *out_files, size_t *out_count)
 {
-    switch (obj->header.type)
-    {
-    case OBJ_BLOB:
+    entry_source_t *src = &build->src;
+    size_t count = 0, capacity = 16, size = 0;
+    uint32_t files = 0;
+    build_entry_t *entries = malloc(capacity * sizeof(build_entry_t));
+    if (!entries)
+        return -1;
+
+    while (has_prefix(src->entry, base, base_len))
     {
-        blob_data_t *blob = (blob_data_t *)obj->data;
-        if (!EVP_DigestUpdate(ctx, blob->data, blob->size))
+        if (count == capacity)
         {
-
-            return -1;
+            build_entry_t *grown = realloc(entries, capacity * 2 * sizeof(build_entry_t));
+            if (!grown)
+                goto fail;
+            entries = grown;
+            capacity *= 2;
         }
-        break;
-    }
-    case OBJ_TREE:
-    {
-        tree_data_t *tree = (tree_data_t *)obj->data;
-        if (object_update_hash_with_tree(ctx, tree->entries) != 0)
+        build_entry_t *entry = &entries[count];
+        const char *rest = src->entry->path + base_len;
+        const char *slash = strchr(rest, '/');
+        if (!slash)
         {
-
-            return -1;
+            // Files are named by their full index path
+            if (!(entry->name = arena_strndup(build->arena, src->entry->path, base_len + strlen(rest))))
+                goto fail;
+            entry->mode = src->entry->mode;
+            entry->oid = src->entry->oid;
+            files++;
+            source_next(src);
         }
-        break;
-    }
-    case OBJ_COMMIT:
-    {
-        commit_data_t *commit = (commit_data_t *)obj->data;
-        if (object_update_hash_with_commit(ctx, commit) != 0)
+        else
         {
-
-            return -1;
+            size_t name_len = slash - rest;
+            size_t sub_len = base_len + name_len + 1;
+            char *sub_base = arena_strndup(build->arena, src->entry->path, sub_len);
+            cache_tree_t *sub = cache_tree_sub(node, rest, name_len, 1);
+            if (!sub_base || !sub || !(entry->name = arena_strndup(build->arena, rest, name_len)))
+                goto fail;
+            entry->mode = S_IFDIR;
+            sub->listed = 1;
+
+            if (sub->entry_count != CACHE_TREE_INVALID)
+            {
+                uint32_t skipped = 0;
+                while (skipped < sub->entry_count && has_prefix(src->entry, sub_base, sub_len))
+                {
+                    source_next(src);
+                    skipped++;
+                }
+                if (src->failed || skipped != sub->entry_count || has_prefix(src->entry, sub_base, sub_len))
+                {
+                    build->stale = !src->failed;
+                    goto fail;
+                }
+                build->reused++;
+            }
+            else
+            {
+                unsigned char *raw;
+                size_t raw_size, sub_count;
+                uint32_t sub_files;
+                if (build_tree(build, sub, sub_base, sub_len, &raw, &raw_size, &sub_files, &sub_count) != 0 ||
+                    odb_write(OBJ_TREE, raw, raw_size, &sub->oid) != 0)
+                    goto fail;
+                sub->entry_count = sub_files;
+                build->written++;
+            }
+            entry->oid = sub->oid;
+            files += sub->entry_count;
         }
-        break;
-    }
-    default:
-
-        return -1;
+        // Octal mode, space, name, NUL, digest
+        size += 12 + strlen(entry->name) + 1 + SHA256_SIZE;
+        count++;
     }
-    return 0;
-}
+    if (src->failed)
+        goto fail;
+    cache_tree_prune(node);
 
-static int object_compute_hash(object_t *obj, char *hash)
-{
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-    unsigned char hash_bytes[SHA256_SIZE];
-    unsigned int hash_len;
+    // Same name order write_tree_data produces
+    qsort(entries, count, sizeof(build_entry_t), build_entry_cmp);
 
-    if (!ctx)
-    {
-        return -1;
-    }
+    unsigned char *buffer = arena_alloc(build->arena, size ? size : 1);
+    if (!buffer)
+        goto fail;
 
-    if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        EVP_MD_CTX_free(ctx);
-        return -1;
+        // sprintf's terminator doubles as the separator before the digest
+        used += sprintf((char *)buffer + used, "%o %s", (unsigned int)entries[i].mode, entries[i].name) + 1;
+        memcpy(buffer + used, entries[i].oid.hash, SHA256_SIZE);
+        used += SHA256_SIZE;
     }
+    free(entries);
 
-    // Hash header
-    if (object_update_hash_with_header(ctx, &obj->header, hash_bytes) != 0)
-    {
-        EVP_MD_CTX_free(ctx);
-        return -1;
-    }
-
-    // Hash content based on type
-    if (object_update_hash_with_data(ctx, obj) != 0)
-    {
-        EVP_MD_CTX_free(ctx);
-        return -1;
-    }
-
-    if (!EVP_DigestFinal_ex(ctx, hash_bytes, &hash_len))
-    {
-        EVP_MD_CTX_free(ctx);
-        return -1;
-    }
-
-    EVP_MD_CTX_free(ctx);
-    hash_to_hex(hash_bytes, hash);
-   strcpy(obj->header.hash, hash);
+    *out = buffer;
+    *out_size = used;
+    *out_files = files;
+    *out_count = count;
     return 0;
+
+fail:
+    free(entries);
+    return -1;
 }
 
-static int update_blob(object_t *obj, object_update_t data)
+static int build_root(tree_build_t *build, index_t *index, cache_tree_t *root,
+                      unsigned char **out, size_t *out_size, size_t *out_count)
 {
-    blob_data_t *blob = (blob_data_t *)obj->data;
-
-    // Check file size first
-    size_t size = get_filesize_by_filepath(data.blob.filepath);
-    if (size > FILE_MAX)
-    {
-        fprintf(stderr, "Error: File '%s' is too large (%zu bytes, max is %d)\n",
-                data.blob.filepath, size, FILE_MAX);
-        return -1;
+    entry_source_t *src = &build->src;
+    memset(src, 0, sizeof(*src));
+    if (index->entries_loaded)
+    {
+        // The table is in hash order
+        src->count = HASH_COUNT(index->entries);
+        src->sorted = arena_alloc(build->arena, (src->count ? src->count : 1) * sizeof(*src->sorted));
+        if (!src->sorted)
+            return -1;
+        size_t i = 0;
+        for (index_hash_entry_t *e = index->entries; e != NULL; e = e->hh.next)
+            src->sorted[i++] = &e->entry;
+        qsort(src->sorted, src->count, sizeof(*src->sorted), index_entry_ptr_cmp);
     }
-
-    FILE *fp = fopen(data.blob.filepath, "rb");
-    if (!fp)
+    else
     {
-        fprintf(stderr, "Error opening file '%s'\n", data.blob.filepath);
-        return -1;
+        index_iter_init(&src->iter, index);
     }
+    source_next(src);
 
-    blob->size = fread(blob->data, 1, size, fp);
-    if (ferror(fp))
-    {
-        fprintf(stderr, "Error reading file '%s'\n", data.blob.filepath);
-        fclose(fp);
+    uint32_t files;
+    if (build_tree(build, root, "", 0, out, out_size, &files, out_count) != 0)
         return -1;
-    }
 
-    if (blob->size != size)
-    {
-        fprintf(stderr, "Error: File '%s' read size mismatch\n", data.blob.filepath);
-        fclose(fp);
+    // The root is rebuilt every time; its id is needed to keep it valid
+    odb_hash_job_t job = {.type = OBJ_TREE, .data = *out, .size = *out_size};
+    if (odb_hash_batch(&job, 1) != 0)
         return -1;
-    }
-
-    obj->header.content_size = blob->size;
-
-    fclose(fp);
+    root->oid = job.oid;
+    root->entry_count = files;
     return 0;
 }
 
-static tree_entry_t *index_entry_to_tree_entry(index_entry_t *index_entry)
-{
-    tree_entry_t *tree_entry = malloc(sizeof(tree_entry_t));
-
-    tree_entry->mode = index_entry->mode;
-    strcpy(tree_entry->name, index_entry->path);
-    strcpy(tree_entry->hash, index_entry->hash);
-    
-
-    return tree_entry;
-}
-
-static tree_entry_t *object_tree_to_tree_entry(object_t *obj)
-{
-    tree_entry_t *tree_entry = malloc(sizeof(tree_entry_t));
-    tree_data_t *tree_data = (tree_data_t *)obj->data;
-    tree_entry->mode = S_IFDIR;
-    strcpy(tree_entry->name, tree_data->dirname);
-    strcpy(tree_entry->hash, obj->header.hash);
-    return tree_entry;
-}
-
-static void process_tree(node_t *node, object_t *curr_tree)
-{
-    if (!node)
-        return;
-
-    tree_data_t *curr_data = (tree_data_t *)curr_tree->data;
-    tree_entry_t *tree_entry;
-
-    // Process all children first
-    for (int i = 0; i < node->child_count; i++)
-    {
-        if (node->children[i]->is_file)
-        {
-            // Files get added directly to current tree
-            index_entry_t *index_entry = (index_entry_t *)node->children[i]->data;
-            tree_entry = index_entry_to_tree_entry(index_entry);
-            HASH_ADD_STR(curr_data->entries, name, tree_entry);
-            curr_tree->header.content_size += index_entry->size;
-            curr_data->size++;
-        }
-        else
-        {
-            // Create new tree object for subdirectory
-            object_t *child_tree = object_init(OBJ_TREE);
-            tree_data_t *child_data = (tree_data_t *)child_tree->data;
-            strcpy(child_data->dirname, node->children[i]->name);
-            process_tree(node->children[i], child_tree);
-
-            // Write child tree and add it to current tree
-            object_write(child_tree, NULL);
-            tree_entry_t *child_entry = object_tree_to_tree_entry(child_tree);
-            HASH_ADD_STR(curr_data->entries, name, child_entry);
-            curr_tree->header.content_size += sizeof(mode_t) + strlen(child_entry->name) + HEX_SIZE - 1;
-            curr_data->size++;
-
-            object_free(child_tree);
-        }
-    }
-}
-
+// Writes every changed subtree, leaving the root serialized in
+// tree_data->raw for object_write. Directories the index's cache tree
+// still holds valid ids for are neither listed nor hashed again, and the
+// cache tree is brought up to date for index_write to store.
 static int update_tree(object_t *obj, object_update_t data)
 {
     tree_data_t *tree_data = (tree_data_t *)obj->data;
@@ -348,23 +340,59 @@ static int update_tree(object_t *obj, object_update_t data)
     strcpy(tree_data->dirname, ".");
 
     index_t *index = data.tree.index;
-    node_t *root = createNode(".");
+    tree_build_t build = {0};
+    build.arena = arena_create(ARENA_DEFAULT_BLOCK);
+    if (!build.arena)
+    {
+        return -1;
+    }
+
+    cache_tree_t *root = index_cache_tree(index);
+    unsigned char *raw;
+    size_t raw_size, count;
+    int result = root ? build_root(&build, index, root, &raw, &raw_size, &count) : -1;
+    if (result != 0 && build.stale)
+    {
+        // Should never happen, but the index is the authority: start over
+        // from an empty cache tree
+        cache_tree_free(index->cache_tree);
+        index->cache_tree = root = cache_tree_new("", 0);
+        build.stale = 0;
+        result = root ? build_root(&build, index, root, &raw, &raw_size, &count) : -1;
+    }
 
-    index_hash_entry_t *entry;
-    for (entry = index->entries; entry != NULL; entry = entry->hh.next)
+    if (result == 0 && (tree_data->raw = malloc(raw_size ? raw_size : 1)) != NULL)
+    {
+        memcpy(tree_data->raw, raw, raw_size);
+        tree_data->raw_size = raw_size;
+        tree_data->size = count;
+    }
+    else
     {
-        addPath(root, entry->path, &entry->entry);
+        fprintf(stderr, "Error: Failed to build tree\n");
+        result = -1;
     }
 
-    process_tree(root, obj);
+    if (perf_trace_enabled())
+    {
+        arena_stats_t stats;
+        arena_stats(build.arena, &stats);
+        fprintf(stderr, "perf: tree build: %zu trees written, %zu reused, arena %zu KiB used of %zu KiB in %zu blocks, peak RSS %zu KiB\n",
+                build.written, build.reused, stats.used / 1024, stats.reserved / 1024, stats.blocks, peak_rss_kib());
+    }
 
-    return 0;
+    arena_destroy(build.arena);
+    return result;
 }
 
 static int update_commit(object_t *obj, object_update_t data)
 {
     commit_data_t *commit = (commit_data_t *)obj->data;
-    strcpy(commit->tree_hash, data.commit.tree_hash);
+    commit->tree = *data.commit.tree;
+    if (data.commit.parent)
+        commit->parent = *data.commit.parent;
+    else
+        oid_clear(&commit->parent);
     strcpy(commit->message, data.commit.message);
     strcpy(commit->author.name, data.commit.author_name);
     strcpy(commit->author.email, data.commit.author_email);
@@ -373,17 +401,7 @@ static int update_commit(object_t *obj, object_update_t data)
     strcpy(commit->committer.email, data.commit.committer_email);
     commit->committer.time = data.commit.committer_time;
 
-    // Calculate total size
-    obj->header.content_size =
-        7 + strlen(commit->author.name) + 2 +     // "author <name> "
-        strlen(commit->author.email) + 2 +        // "<email> "
-        20 + 1 +                                  // timestamp + \n
-        10 + strlen(commit->committer.name) + 2 + // "committer <name> "
-        strlen(commit->committer.email) + 2 +     // "<email> "
-        20 + 1 +                                  // timestamp + \n
-        1 +                                       // blank line
-        strlen(commit->message);                  // message
-
+    // content_size is filled in when the commit is serialized
     return 0;
 }
 int object_update(object_t *obj, object_update_t data)
@@ -402,8 +420,22 @@ int object_update(object_t *obj, object_update_t data)
     }
 }
 
+static int tree_entry_name_cmp(tree_entry_t *a, tree_entry_t *b)
+{
+    return strcmp(a->name, b->name);
+}
+
 static int write_tree_data(FILE *fp, tree_data_t *data)
 {
+    // Built by update_tree, already sorted and serialized
+    if (data->raw)
+    {
+        return fwrite(data->raw, 1, data->raw_size, fp) == data->raw_size ? 0 : -1;
+    }
+
+    // Entries go out in name order so readers can binary-search them
+    HASH_SORT(data->entries, tree_entry_name_cmp);
+
     tree_entry_t *entry;
     for (entry = data->entries; entry != NULL; entry = entry->hh.next)
     {
@@ -418,8 +450,8 @@ static int write_tree_data(FILE *fp, tree_data_t *data)
             return -1;
         }
 
-        // Write hash bytes directly
-        if (fwrite(entry->hash, 1, HEX_SIZE, fp) != HEX_SIZE) {
+        // Write the raw digest
+        if (fwrite(entry->oid.hash, 1, SHA256_SIZE, fp) != SHA256_SIZE) {
             return -1;
         }
     }
@@ -428,11 +460,12 @@ static int write_tree_data(FILE *fp, tree_data_t *data)
 
 static int write_commit_data(FILE *fp, commit_data_t *data)
 {
-    if (fprintf(fp, "tree %s\n", data->tree_hash) < 0)
+    if (fprintf(fp, "tree %s\n", oid_hex(&data->tree)) < 0)
     {
         return -1;
     }
-    if (fprintf(fp, "parent %s\n", data->parent_hash) < 0)
+    // Root commits have no parent line
+    if (!oid_is_null(&data->parent) && fprintf(fp, "parent %s\n", oid_hex(&data->parent)) < 0)
     {
         return -1;
     }
@@ -454,30 +487,10 @@ static int write_commit_data(FILE *fp, commit_data_t *data)
     return 0;
 }
 
-static int object_write_header(FILE *fp, object_t *obj)
-{
-    int written = fprintf(fp, "%s %zu%c",
-                          object_type_to_string(obj->header.type),
-                          obj->header.content_size,
-                          '\0');
-    return written < 0 ? -1 : 0;
-}
-
 static int object_data_write(FILE *fp, object_t *obj)
 {
     switch (obj->header.type)
     {
-    case OBJ_BLOB:
-    {
-        blob_data_t *blob = (blob_data_t *)obj->data;
-        if (fwrite(blob->data, 1, blob->size, fp) != blob->size)
-        {
-            fprintf(stderr, "Error: Failed to write data\n");
-            fclose(fp);
-            return -1;
-        }
-        break;
-    }
     case OBJ_TREE:
     {
         tree_data_t *tree = (tree_data_t *)obj->data;
@@ -508,274 +521,344 @@ static int object_data_write(FILE *fp, object_t *obj)
     return 0;
 }
 
-int object_write(object_t *obj, char *out_hash)
+static int blob_write_stream(object_t *obj, object_id_t *out_oid)
 {
-    char hash[HEX_SIZE];
-    if (object_compute_hash(obj, hash) != 0)
+    blob_data_t *blob = (blob_data_t *)obj->data;
+
+    int fd = open(blob->filepath, O_RDONLY);
+    if (fd < 0)
     {
-        fprintf(stderr, "Error: Failed to compute hash\n");
+        fprintf(stderr, "Error opening file '%s': %s\n", blob->filepath, strerror(errno));
         return -1;
     }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-    // Create hash prefix directory
-    char prefix_dir[PATH_MAX];
-    snprintf(prefix_dir, sizeof(prefix_dir), ".vcs/objects/%c%c",
-             hash[0], hash[1]);
-    if (create_directory(prefix_dir) < 0)
+    object_id_t oid;
+    if (chunk_applies(blob->size))
     {
+        // Stored as a chunk list; only chunks not seen before are written
+        int result = chunk_write_fd(fd, blob->size, &oid);
+        close(fd);
+        if (result != 0)
+            return -1;
+        goto stored;
+    }
+
+    unsigned char *chunk = malloc(OBJECT_CHUNK_SIZE);
+    if (!chunk)
+    {
+        close(fd);
         return -1;
     }
 
-    // Full path with hash suffix
-    char obj_path[PATH_MAX];
-    snprintf(obj_path, sizeof(obj_path), "%s/%s", prefix_dir, hash + 2);
+    if (blob->size < OBJECT_CHUNK_SIZE)
+    {
+        // Small files are hashed from memory and only written when new
+        size_t have = 0;
+        ssize_t n;
+        while (have <= blob->size && (n = read(fd, chunk + have, OBJECT_CHUNK_SIZE - have)) != 0)
+        {
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            have += n;
+        }
+        close(fd);
 
-    FILE *fp = fopen(obj_path, "wb"); // Binary mode
-    if (!fp)
+        int result = -1;
+        if (have != blob->size)
+            fprintf(stderr, "Error reading file '%s': size changed while reading\n", blob->filepath);
+        else
+            result = odb_write(OBJ_BLOB, chunk, have, &oid);
+        free(chunk);
+        if (result != 0)
+            return -1;
+        goto stored;
+    }
+
+    // Large files get a cheap hashing pass first, so content that is
+    // already stored is never compressed and written again
+    if (odb_hash_fd(fd, OBJ_BLOB, blob->size, &oid) == 0 && odb_has_object(&oid))
     {
-        fprintf(stderr, "Error: Failed to open '%s'\n", obj_path);
-        return -1;
+        free(chunk);
+        close(fd);
+        goto stored;
     }
 
-    if (object_write_header(fp, obj) < 0)
+    odb_writer_t *writer = NULL;
+    if (lseek(fd, 0, SEEK_SET) != 0 || !(writer = odb_writer_open(OBJ_BLOB, blob->size)))
     {
-        fprintf(stderr, "Error: Failed to write header\n");
-        fclose(fp);
+        free(chunk);
+        close(fd);
         return -1;
     }
 
-    if (object_data_write(fp, obj) < 0)
+    // Hash and write in one pass; the writer rejects a file that grew or
+    // shrank since update_blob recorded its size
+    ssize_t n;
+    while ((n = read(fd, chunk, OBJECT_CHUNK_SIZE)) != 0)
     {
-        fprintf(stderr, "Error: Failed to write data\n");
-        fclose(fp);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error reading file '%s': %s\n", blob->filepath, strerror(errno));
+            break;
+        }
+        if (odb_writer_write(writer, chunk, n) != 0)
+        {
+            n = -1;
+            break;
+        }
+    }
+
+    free(chunk);
+    close(fd);
+
+    if (n != 0)
+    {
+        odb_writer_abort(writer);
         return -1;
     }
 
-    fclose(fp);
+    if (odb_writer_commit(writer, &oid) != 0)
+    {
+        return -1;
+    }
 
-    if (out_hash)
+stored:
+    obj->header.oid = oid;
+    if (out_oid)
     {
-        strcpy(out_hash, hash);
+        *out_oid = oid;
     }
     return 0;
 }
 
-static int object_read_headerr(FILE *fp, char *header)
+int object_write(object_t *obj, object_id_t *out_oid)
 {
-    char c;
-    int i = 0;
-    while (fread(&c, 1, 1, fp) == 1)
+    if (obj->header.type == OBJ_BLOB)
     {
-        if (c == '\0')
-        {
-            header[i] = '\0';
-            return 0;
-        }
-        header[i++] = c;
+        return blob_write_stream(obj, out_oid);
     }
-    return -1;
-}
 
-static int object_parse_header(char *header, object_t *obj)
-{
-    char type[16];
-    size_t size;
-    if (sscanf(header, "%s %zu", type, &size) != 2)
+    // Serialize first so the header carries the exact content size
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    FILE *fp = open_memstream(&buffer, &buffer_size);
+    if (!fp)
     {
-        fprintf(stderr, "Error: Failed to parse header\n");
+        fprintf(stderr, "Error: Memory allocation failed\n");
         return -1;
     }
 
-    if (strcmp(type, "blob") == 0)
-    {
-        obj->header.type = OBJ_BLOB;
-    }
-    else if (strcmp(type, "tree") == 0)
-    {
-        obj->header.type = OBJ_TREE;
-    }
-    else if (strcmp(type, "commit") == 0)
+    if (object_data_write(fp, obj) < 0)
     {
-        obj->header.type = OBJ_COMMIT;
+        fprintf(stderr, "Error: Failed to write data\n");
+        free(buffer);
+        return -1;
     }
-    else
+    fclose(fp);
+
+    obj->header.content_size = buffer_size;
+
+    // Unchanged subtrees hash to ids that are already stored and are skipped
+    object_id_t oid;
+    int result = odb_write(obj->header.type, buffer, buffer_size, &oid);
+    free(buffer);
+    if (result != 0)
     {
-        fprintf(stderr, "Error: Unknown object type '%s'\n", type);
         return -1;
     }
 
-    obj->header.content_size = size;
+    obj->header.oid = oid;
+    if (out_oid)
+    {
+        *out_oid = oid;
+    }
     return 0;
 }
 
-static int object_read_content(FILE *fp, char *content)
+// Copies at most cap - 1 bytes and always terminates
+static void copy_field(char *dst, size_t cap, const char *src, size_t len)
 {
-    size_t file_size = get_filesize_by_fp(fp);
+    if (len >= cap)
+        len = cap - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
 
-    if (file_size > FILE_MAX)
+// "<name> <<email>> <time>"
+static int parse_signature(signature_t *sig, const char *line, size_t len)
+{
+    const char *end = line + len;
+    const char *open = memchr(line, '<', len);
+    const char *close = open ? memchr(open, '>', end - open) : NULL;
+    if (!close)
     {
-        fprintf(stderr, "Error: File is too large (%zu bytes, max is %d)\n",
-                file_size, FILE_MAX);
         return -1;
     }
 
-    if (fread(content, 1, file_size, fp) != file_size)
+    const char *name_end = open;
+    while (name_end > line && name_end[-1] == ' ')
+        name_end--;
+    copy_field(sig->name, sizeof(sig->name), line, name_end - line);
+    copy_field(sig->email, sizeof(sig->email), open + 1, close - open - 1);
+
+    time_t time = 0;
+    for (const char *p = close + 1; p < end; p++)
     {
-        fprintf(stderr, "Error: Failed to read content\n");
-        return -1;
+        if (*p >= '0' && *p <= '9')
+            time = time * 10 + (*p - '0');
+        else if (*p != ' ')
+            break;
     }
+    sig->time = time;
     return 0;
 }
 
-int parse_commit_data(commit_data_t *commit, char *content)
+// Never writes to content, so it can point into a read-only mapping
+int parse_commit_data(commit_data_t *commit, const char *content, size_t size)
 {
-    char *line = content;
-    char *next_line;
-    while ((next_line = strchr(line, '\n')) != NULL)
-    {
-        *next_line = '\0';
-
-        if (strncmp(line, "tree ", 5) == 0)
+    const char *line = content;
+    const char *end = content + size;
+    const char *next_line;
+    int have_tree = 0;
+    oid_clear(&commit->parent);
+    while ((next_line = memchr(line, '\n', end - line)) != NULL)
+    {
+        size_t len = next_line - line;
+        if (len == 0)
         {
-            strncpy(commit->tree_hash, line + 5, HEX_SIZE);
+            line = next_line + 1;
+            break;
         }
-        else if (strncmp(line, "parent ", 7) == 0)
+
+        if (len >= 5 && memcmp(line, "tree ", 5) == 0)
         {
-            strncpy(commit->parent_hash, line + 7, HEX_SIZE);
+            if (len - 5 < HEX_SIZE - 1 || oid_from_hex(line + 5, &commit->tree) != 0)
+                return -1;
+            have_tree = 1;
         }
-        else if (strncmp(line, "author ", 7) == 0)
+        else if (len >= 7 && memcmp(line, "parent ", 7) == 0)
         {
-            sscanf(line + 7, "%s %s %ld",
-                   commit->author.name,
-                   commit->author.email,
-                   &commit->author.time);
+            // Older commits carry an empty parent line instead of none
+            if (len > 7 && (len - 7 < HEX_SIZE - 1 || oid_from_hex(line + 7, &commit->parent) != 0))
+                return -1;
         }
-        else if (strncmp(line, "committer ", 10) == 0)
+        else if (len >= 7 && memcmp(line, "author ", 7) == 0)
         {
-            sscanf(line + 10, "%s %s %ld",
-                   commit->committer.name,
-                   commit->committer.email,
-                   &commit->committer.time);
+            if (parse_signature(&commit->author, line + 7, len - 7) != 0)
+                return -1;
         }
-        else if (strlen(line) == 0)
+        else if (len >= 10 && memcmp(line, "committer ", 10) == 0)
         {
-            break;
+            if (parse_signature(&commit->committer, line + 10, len - 10) != 0)
+                return -1;
         }
 
         line = next_line + 1;
     }
 
-    // Copy message
-    strcpy(commit->message, line);
+    if (!next_line || !have_tree)
+    {
+        return -1;
+    }
+
+    // The message is written with a trailing newline
+    size_t len = end - line;
+    if (len > 0 && line[len - 1] == '\n')
+        len--;
+    copy_field(commit->message, COMMIT_MSG_MAX, line, len);
     return 0;
 }
-int parse_tree_data(tree_data_t *tree, char *content) 
-{
-    char *ptr = content;
-    
-    while (*ptr) {
-        // Parse <mode> <filename> up to first \0
-        mode_t mode;
-        char name[NAME_MAX];
-        sscanf(ptr, "%ho %s", &mode, name);
-        ptr += strlen(ptr) + 1;  // Skip first \0
-        
-        // Next 64 chars + null are hash
-        char hash[HEX_SIZE] = {0};  // 64 hex chars + null
-        strncpy(hash, ptr, HEX_SIZE);
-        ptr += HEX_SIZE;  // Skip hash + null
-        
-        // Store entry
+
+int parse_tree_data(tree_data_t *tree, const char *content, size_t size)
+{
+    tree_iter_t iter;
+    tree_entry_view_t view;
+    int result;
+    tree_iter_init(&iter, content, size);
+    while ((result = tree_iter_next(&iter, &view)) > 0)
+    {
         tree_entry_t *entry = malloc(sizeof(tree_entry_t));
-        entry->mode = mode;
-        strcpy(entry->name, name);
-        strcpy(entry->hash, hash);
+        if (!entry)
+        {
+            return -1;
+        }
+        entry->mode = view.mode;
+        copy_field(entry->name, sizeof(entry->name), view.name, view.name_len);
+        entry->oid = view.oid;
         HASH_ADD_STR(tree->entries, name, entry);
         tree->size++;
     }
-    return 0;
+    return result;
 }
-int object_read(object_t *obj, const char *hash)
-{
-    char obj_path[PATH_MAX];
-    snprintf(obj_path, sizeof(obj_path), ".vcs/objects/%c%c/%s",
-             hash[0], hash[1], hash + 2);
 
-    FILE *fp = fopen(obj_path, "rb");
-    if (!fp) {
-        fprintf(stderr, "Error: Failed to open '%s'\n", obj_path);
+// Blobs only get their size; the content can be any size and is read with
+// odb_stream instead of being held in memory
+static int blob_load(object_t *obj, const object_id_t *oid)
+{
+    object_type_t type;
+    size_t size;
+    if (odb_object_info(oid, &type, &size) != 0)
+    {
         return -1;
     }
-
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    long file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    // Allocate buffer
-    char *buffer = malloc(file_size + 1);
-    if (!buffer) {
-        fprintf(stderr, "Error: Memory allocation failed\n");
-        fclose(fp);
+    if (type != OBJ_BLOB)
+    {
+        fprintf(stderr, "Error: Object %s is a %s, expected blob\n", oid_hex(oid), object_type_to_string(type));
         return -1;
     }
 
-    // Read file
-    if (fread(buffer, 1, file_size, fp) != file_size) {
-        fprintf(stderr, "Error: Failed to read file\n");
-        free(buffer);
-        fclose(fp);
-        return -1;
-    }
-    buffer[file_size] = '\0';
-    fclose(fp);
+    blob_data_t *blob = (blob_data_t *)obj->data;
+    blob->size = size;
+    obj->header.content_size = size;
+    obj->header.oid = *oid;
+    return 0;
+}
 
-    // Parse header (format: "<type> <size>")
-    char type_str[32];
-    size_t content_size;
-    if (sscanf(buffer, "%s %zu", type_str, &content_size) != 2) {
-        fprintf(stderr, "Error: Invalid header format\n");
-        free(buffer);
-        fclose(fp);
-        return -1;
+// Maps a tree or commit into obj. Commits are parsed; trees keep a copy of
+// their serialized entries, which is validated once here.
+static int object_load(object_t *obj, const object_id_t *oid)
+{
+    if (obj->header.type == OBJ_BLOB)
+    {
+        return blob_load(obj, oid);
     }
 
-    // Set object type and content size
-    if (strcmp(type_str, "blob") == 0) {
-        obj->header.type = OBJ_BLOB;
-    } else if (strcmp(type_str, "tree") == 0) {
-        obj->header.type = OBJ_TREE;
-    } else if (strcmp(type_str, "commit") == 0) {
-        obj->header.type = OBJ_COMMIT;
-    } else {
-        fprintf(stderr, "Error: Unknown object type '%s'\n", type_str);
-        free(buffer);
-        fclose(fp);
+    odb_object_t mapped;
+    if (odb_map(oid, &mapped) != 0)
+    {
         return -1;
     }
-    obj->header.content_size = content_size;
-    strcpy(obj->header.hash, hash);
 
-    // read the rest of the file
-    char *content = memchr(buffer, '\0', file_size);
-    if (!content)
+    // obj->data was allocated for the type requested in object_init
+    if (mapped.type != obj->header.type)
     {
-        fprintf(stderr, "Error: Invalid object format - no content delimiter\n");
-        free(buffer);
-        fclose(fp);
+        fprintf(stderr, "Error: Object %s is a %s, expected %s\n", oid_hex(oid),
+                object_type_to_string(mapped.type), object_type_to_string(obj->header.type));
+        odb_unmap(&mapped);
         return -1;
     }
-    content++; // Skip past null byte
+    obj->header.content_size = mapped.size;
+    obj->header.oid = *oid;
 
+    const char *content = (const char *)mapped.data;
     switch (obj->header.type)
     {
         case OBJ_COMMIT:
         {
             commit_data_t *commit = (commit_data_t *)obj->data;
-            if (parse_commit_data(commit, content) != 0)
+            if (parse_commit_data(commit, content, mapped.size) != 0)
             {
                 fprintf(stderr, "Error: Failed to parse commit data\n");
-                free(buffer);
+                odb_unmap(&mapped);
                 return -1;
             }
             break;
@@ -783,43 +866,110 @@ int object_read(object_t *obj, const char *hash)
         case OBJ_TREE:
         {
             tree_data_t *tree = (tree_data_t *)obj->data;
-            if (parse_tree_data(tree, content) != 0)
+            tree_iter_t iter;
+            tree_entry_view_t view;
+            int result;
+            tree_iter_init(&iter, content, mapped.size);
+            while ((result = tree_iter_next(&iter, &view)) > 0)
+                tree->size++;
+
+            tree->raw = malloc(mapped.size ? mapped.size : 1);
+            if (result != 0 || !tree->raw)
             {
                 fprintf(stderr, "Error: Failed to parse tree data\n");
-                free(buffer);
+                odb_unmap(&mapped);
                 return -1;
             }
+            memcpy(tree->raw, content, mapped.size);
+            tree->raw_size = mapped.size;
             break;
         }
         default:
             fprintf(stderr, "Error: Unsupported object type\n");
-            free(buffer);
+            odb_unmap(&mapped);
             return -1;
     }
 
-
-    free(buffer);
-    
+    odb_unmap(&mapped);
     return 0;
 }
 
-int object_get_commit_tree_hash(const char *commit_hash, char *out_tree_hash)
+object_t *object_lookup(const object_id_t *oid, object_type_t type)
 {
-    object_t *commit = object_init(OBJ_COMMIT);
-    if (!commit)
+    object_t *obj = object_cache_get(oid, type);
+    if (obj)
+    {
+        return obj;
+    }
+
+    obj = object_init(type);
+    if (!obj)
+    {
+        return NULL;
+    }
+    if (object_load(obj, oid) != 0)
+    {
+        object_free(obj);
+        return NULL;
+    }
+
+    // Stays private, and is freed by object_free, when the cache is off
+    object_cache_add(obj);
+    return obj;
+}
+
+// Fills a caller-owned object from its shared copy in the cache
+int object_read(object_t *obj, const object_id_t *oid)
+{
+    object_t *shared = object_lookup(oid, obj->header.type);
+    if (!shared)
     {
         return -1;
     }
 
-    if (object_read(commit, commit_hash) != 0)
+    int result = 0;
+    obj->header = shared->header;
+    if (obj->header.type == OBJ_COMMIT)
+    {
+        *(commit_data_t *)obj->data = *(const commit_data_t *)shared->data;
+    }
+    else if (obj->header.type == OBJ_BLOB)
+    {
+        *(blob_data_t *)obj->data = *(const blob_data_t *)shared->data;
+    }
+    else
+    {
+        // Materialize entries for callers that edit the tree
+        const tree_data_t *raw = (const tree_data_t *)shared->data;
+        result = parse_tree_data((tree_data_t *)obj->data, (const char *)raw->raw, raw->raw_size);
+    }
+
+    object_free(shared);
+    return result;
+}
+
+int object_read_commit(const object_id_t *oid, commit_data_t *out_commit)
+{
+    object_t *commit = object_lookup(oid, OBJ_COMMIT);
+    if (!commit)
     {
-        object_free(commit);
         return -1;
     }
 
-    commit_data_t *data = (commit_data_t *)commit->data;
-    strncpy(out_tree_hash, data->tree_hash, HEX_SIZE);
+    *out_commit = *(const commit_data_t *)commit->data;
+    object_free(commit);
+    return 0;
+}
+
+int object_get_commit_tree(const object_id_t *commit_oid, object_id_t *out_tree_oid)
+{
+    object_t *commit = object_lookup(commit_oid, OBJ_COMMIT);
+    if (!commit)
+    {
+        return -1;
+    }
 
+    *out_tree_oid = ((const commit_data_t *)commit->data)->tree;
     object_free(commit);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include "object_cache.h"
+#include "object_types.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <uthash.h>
+
+typedef struct cache_entry
+{
+    object_id_t oid; // key
+    object_t *obj;
+    size_t cost;
+    int refs;
+    struct cache_entry *prev; // towards the most recently used end
+    struct cache_entry *next;
+    UT_hash_handle hh;
+} cache_entry_t;
+
+static cache_entry_t *entries = NULL;
+static cache_entry_t *lru_head = NULL; // most recently used
+static cache_entry_t *lru_tail = NULL; // next to evict
+static object_cache_stats_t stats = {.limit = OBJECT_CACHE_DEFAULT_LIMIT};
+
+static void report_stats(void)
+{
+    size_t lookups = stats.hits + stats.misses;
+    fprintf(stderr, "perf: object cache: %zu hits, %zu misses (%.1f%% hit rate), %zu evictions, "
+                    "peak %zu KiB of %zu KiB\n",
+            stats.hits, stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0,
+            stats.evictions, stats.peak_bytes / 1024, stats.limit / 1024);
+}
+
+static void check_trace(void)
+{
+    static int checked = 0;
+    if (checked)
+        return;
+    checked = 1;
+
+    if (perf_trace_enabled())
+        atexit(report_stats);
+}
+
+// Rough heap footprint. Looked-up trees only hold their serialized bytes.
+static size_t object_cost(const object_t *obj)
+{
+    size_t cost = sizeof(object_t) + sizeof(cache_entry_t);
+    if (obj->header.type == OBJ_TREE)
+    {
+        const tree_data_t *tree = (const tree_data_t *)obj->data;
+        cost += sizeof(tree_data_t) + tree->raw_size;
+        if (tree->entries)
+            cost += tree->size * sizeof(tree_entry_t);
+    }
+    else if (obj->header.type == OBJ_COMMIT)
+    {
+        cost += sizeof(commit_data_t);
+    }
+    else if (obj->header.type == OBJ_BLOB)
+    {
+        cost += sizeof(blob_data_t);
+    }
+    return cost;
+}
+
+static void lru_unlink(cache_entry_t *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        lru_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        lru_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push_front(cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head)
+        lru_head->prev = entry;
+    lru_head = entry;
+    if (!lru_tail)
+        lru_tail = entry;
+}
+
+static void entry_free(cache_entry_t *entry)
+{
+    HASH_DEL(entries, entry);
+    lru_unlink(entry);
+    stats.bytes -= entry->cost;
+
+    entry->obj->cached = 0;
+    object_free(entry->obj);
+    free(entry);
+}
+
+// Walks from the cold end, skipping objects a caller still holds
+static void evict_to_limit(void)
+{
+    cache_entry_t *entry = lru_tail;
+    while (entry && stats.bytes > stats.limit)
+    {
+        cache_entry_t *prev = entry->prev;
+        if (entry->refs == 0)
+        {
+            entry_free(entry);
+            stats.evictions++;
+        }
+        entry = prev;
+    }
+}
+
+void object_cache_set_limit(size_t bytes)
+{
+    stats.limit = bytes;
+    evict_to_limit();
+}
+
+object_t *object_cache_get(const object_id_t *oid, object_type_t type)
+{
+    check_trace();
+
+    cache_entry_t *entry;
+    HASH_FIND(hh, entries, oid, sizeof(object_id_t), entry);
+    if (!entry || entry->obj->header.type != type)
+    {
+        stats.misses++;
+        return NULL;
+    }
+
+    stats.hits++;
+    entry->refs++;
+    if (entry != lru_head)
+    {
+        lru_unlink(entry);
+        lru_push_front(entry);
+    }
+    return entry->obj;
+}
+
+int object_cache_add(object_t *obj)
+{
+    if (stats.limit == 0)
+        return -1;
+
+    cache_entry_t *entry;
+    HASH_FIND(hh, entries, &obj->header.oid, sizeof(object_id_t), entry);
+    if (entry)
+        return -1; // another copy is already shared; keep this one private
+
+    entry = calloc(1, sizeof(cache_entry_t));
+    if (!entry)
+        return -1;
+
+    entry->oid = obj->header.oid;
+    entry->obj = obj;
+    entry->cost = object_cost(obj);
+    entry->refs = 1;
+    HASH_ADD(hh, entries, oid, sizeof(object_id_t), entry);
+    lru_push_front(entry);
+    obj->cached = 1;
+
+    stats.bytes += entry->cost;
+    if (stats.bytes > stats.peak_bytes)
+        stats.peak_bytes = stats.bytes;
+    evict_to_limit();
+    return 0;
+}
+
+void object_cache_release(object_t *obj)
+{
+    cache_entry_t *entry;
+    HASH_FIND(hh, entries, &obj->header.oid, sizeof(object_id_t), entry);
+    if (!entry || entry->obj != obj || entry->refs == 0)
+        return;
+
+    if (--entry->refs == 0 && stats.bytes > stats.limit)
+        evict_to_limit();
+}
+
+void object_cache_stats(object_cache_stats_t *out)
+{
+    *out = stats;
+}
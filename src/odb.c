@@ -0,0 +1,1510 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // syncfs
+#endif
+
+#include "odb.h"
+#include "pack.h"
+#include "util.h"
+#include "config.h"
+#include "sha256_mb.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <dirent.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+static int compression_level = Z_DEFAULT_COMPRESSION;
+static odb_fsync_t fsync_mode = ODB_FSYNC_BATCH;
+static int sync_pending = 0;
+
+struct odb_writer
+{
+    int fd;
+    hash_ctx_t hash;
+    int hashing; // 0 when the id was given up front
+    z_stream zs;
+    int deflating;
+    unsigned char *out;
+    size_t expected_size;
+    size_t written;
+    object_id_t oid;
+    char temp_path[PATH_MAX];
+};
+
+typedef struct
+{
+    size_t batches;
+    size_t objects;
+    size_t bytes;
+    double seconds;
+} hash_stats_t;
+
+static hash_stats_t hash_stats;
+static pthread_mutex_t hash_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static odb_writer_t *writer_open(object_type_t type, size_t content_size, const object_id_t *oid);
+
+void odb_set_compression_level(int level)
+{
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+    {
+        fprintf(stderr, "Warning: Ignoring invalid compression level %d\n", level);
+        return;
+    }
+    compression_level = level;
+}
+
+int odb_compression_level(void)
+{
+    return compression_level;
+}
+
+void odb_set_fsync_mode(odb_fsync_t mode)
+{
+    fsync_mode = mode;
+}
+
+odb_fsync_t odb_fsync_mode(void)
+{
+    return fsync_mode;
+}
+
+int odb_sync_written(int fd)
+{
+    if (fsync_mode == ODB_FSYNC_NONE)
+    {
+        return 0;
+    }
+
+    if (fsync_mode == ODB_FSYNC_BATCH)
+    {
+        __sync_lock_test_and_set(&sync_pending, 1);
+#ifdef __linux__
+        // syncfs in the barrier flushes it along with everything else
+        return 0;
+#else
+        // fsync only reaches the drive cache here, which is cheap; the
+        // barrier flushes the cache once
+        return fsync(fd);
+#endif
+    }
+    return fsync(fd);
+}
+
+int odb_sync_barrier(void)
+{
+    if (!sync_pending)
+    {
+        return 0;
+    }
+
+    int fd = open(ODB_OBJECTS_DIR, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Failed to open '%s': %s\n", ODB_OBJECTS_DIR, strerror(errno));
+        return -1;
+    }
+
+#if defined(__linux__)
+    int result = syncfs(fd);
+#elif defined(F_FULLFSYNC)
+    int result = fcntl(fd, F_FULLFSYNC);
+#else
+    int result = fsync(fd);
+#endif
+    close(fd);
+
+    if (result != 0)
+    {
+        fprintf(stderr, "Error: Failed to sync object store: %s\n", strerror(errno));
+        return -1;
+    }
+    sync_pending = 0;
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Pushes bytes to the temporary file, through deflate unless the object
+// store is configured to keep objects uncompressed (level 0)
+static int writer_emit(odb_writer_t *writer, const void *buf, size_t len, int flush)
+{
+    if (!writer->deflating)
+    {
+        return write_all(writer->fd, buf, len);
+    }
+
+    // avail_in is a uInt, so larger buffers are fed in slices and only the
+    // last one carries the caller's flush
+    const unsigned char *in = buf;
+    do
+    {
+        size_t slice = len > OBJECT_CHUNK_SIZE ? OBJECT_CHUNK_SIZE : len;
+        int slice_flush = slice == len ? flush : Z_NO_FLUSH;
+        writer->zs.next_in = (Bytef *)in;
+        writer->zs.avail_in = (uInt)slice;
+        do
+        {
+            writer->zs.next_out = writer->out;
+            writer->zs.avail_out = OBJECT_CHUNK_SIZE;
+            int ret = deflate(&writer->zs, slice_flush);
+            if (ret == Z_STREAM_ERROR)
+            {
+                return -1;
+            }
+            size_t have = OBJECT_CHUNK_SIZE - writer->zs.avail_out;
+            if (have > 0 && write_all(writer->fd, writer->out, have) != 0)
+            {
+                return -1;
+            }
+        } while (writer->zs.avail_out == 0);
+        in += slice;
+        len -= slice;
+    } while (len > 0);
+
+    return 0;
+}
+
+// Ids of loose objects seen by this process, in an open-addressed table
+// keyed by the id itself. A fanout directory is read into the table the
+// first time an id under it is looked up; writes add their ids as they go.
+// Packed objects are answered by the pack indexes instead. known_lock
+// guards the table, since objects are written from several threads.
+typedef struct
+{
+    object_id_t *ids; // the null id marks an empty slot
+    size_t capacity;
+    size_t count;
+    unsigned char loaded[256];
+} known_set_t;
+
+static known_set_t known;
+static pthread_mutex_t known_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t known_slot(const object_id_t *oid, size_t capacity)
+{
+    uint64_t h;
+    memcpy(&h, oid->hash, sizeof(h));
+    size_t slot = h & (capacity - 1);
+    while (!oid_is_null(&known.ids[slot]) && !oid_equal(&known.ids[slot], oid))
+    {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return slot;
+}
+
+static int known_add(const object_id_t *oid)
+{
+    // Keep the load factor under one half
+    if ((known.count + 1) * 2 > known.capacity)
+    {
+        size_t capacity = known.capacity ? known.capacity * 2 : 1024;
+        object_id_t *old = known.ids;
+        size_t old_capacity = known.capacity;
+
+        known.ids = calloc(capacity, sizeof(object_id_t));
+        if (!known.ids)
+        {
+            known.ids = old;
+            return -1;
+        }
+        known.capacity = capacity;
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (!oid_is_null(&old[i]))
+                known.ids[known_slot(&old[i], capacity)] = old[i];
+        }
+        free(old);
+    }
+
+    size_t slot = known_slot(oid, known.capacity);
+    if (oid_is_null(&known.ids[slot]))
+    {
+        known.ids[slot] = *oid;
+        known.count++;
+    }
+    return 0;
+}
+
+static int is_hex_string(const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!isxdigit((unsigned char)s[i]))
+            return 0;
+    }
+    return s[len] == '\0';
+}
+
+// The id of a loose object from its fanout directory and file name, which
+// must be the remaining HEX_SIZE - 3 hex digits
+static int oid_from_loose_name(int prefix, const char *name, object_id_t *oid)
+{
+    if (strlen(name) != HEX_SIZE - 3 || !is_hex_string(name, HEX_SIZE - 3))
+        return -1;
+
+    char hex[HEX_SIZE];
+    snprintf(hex, sizeof(hex), "%02x%.62s", (unsigned int)(prefix & 0xff), name);
+    return oid_from_hex(hex, oid);
+}
+
+static void known_load_prefix(int prefix)
+{
+    known.loaded[prefix] = 1;
+
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s/%02x", ODB_OBJECTS_DIR, prefix);
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        object_id_t oid;
+        if (oid_from_loose_name(prefix, entry->d_name, &oid) == 0)
+            known_add(&oid);
+    }
+    closedir(dir);
+}
+
+int odb_has_object(const object_id_t *oid)
+{
+    pthread_mutex_lock(&known_lock);
+    if (!known.loaded[oid->hash[0]])
+        known_load_prefix(oid->hash[0]);
+    int found = known.count > 0 && oid_equal(&known.ids[known_slot(oid, known.capacity)], oid);
+    pthread_mutex_unlock(&known_lock);
+
+    return found || pack_has_object(oid);
+}
+
+// "<type> <size>\0", returns its length including the NUL
+static int format_header(char *header, object_type_t type, size_t content_size)
+{
+    int len = snprintf(header, OBJECT_HEADER_MAX, "%s %zu",
+                       object_type_to_string(type), content_size);
+    if (len < 0 || len >= OBJECT_HEADER_MAX)
+        return -1;
+    return len + 1;
+}
+
+int odb_hash_fd(int fd, object_type_t type, size_t content_size, object_id_t *out_oid)
+{
+    char header[OBJECT_HEADER_MAX];
+    int header_len = format_header(header, type, content_size);
+    if (header_len < 0)
+        return -1;
+
+    // BLAKE3 splits a mapped file across threads, which reading it in
+    // chunks would serialize
+    if (hash_get_algo() == HASH_BLAKE3 && content_size >= OBJECT_CHUNK_SIZE)
+    {
+        void *map = mmap(NULL, content_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            struct stat st;
+            int result = -1;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size == content_size)
+                result = hash_message(header, header_len, map, content_size, out_oid->hash);
+            munmap(map, content_size);
+            return result;
+        }
+    }
+
+    unsigned char *chunk = malloc(OBJECT_CHUNK_SIZE);
+    hash_ctx_t ctx;
+    int result = -1;
+    if (!chunk || hash_init(&ctx) != 0)
+    {
+        free(chunk);
+        return -1;
+    }
+    if (hash_update(&ctx, header, header_len) != 0)
+        goto done;
+
+    size_t total = 0;
+    ssize_t n;
+    while ((n = read(fd, chunk, OBJECT_CHUNK_SIZE)) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            goto done;
+        }
+        if (hash_update(&ctx, chunk, n) != 0)
+            goto done;
+        total += n;
+    }
+
+    if (total != content_size || hash_final(&ctx, out_oid->hash) != 0)
+        goto done;
+    result = 0;
+
+done:
+    hash_release(&ctx);
+    free(chunk);
+    return result;
+}
+
+static void report_hash_stats(void)
+{
+    double rate = hash_stats.seconds > 0 ? hash_stats.objects / hash_stats.seconds : 0;
+    fprintf(stderr, "perf: batch hash: %zu objects (%zu KiB) in %zu batches, %.1f ms, %.0f objects/s, engine %s\n",
+            hash_stats.objects, hash_stats.bytes / 1024, hash_stats.batches,
+            hash_stats.seconds * 1000, rate,
+            hash_get_algo() == HASH_SHA256 ? sha256_mb_engine() : hash_algo_name(hash_get_algo()));
+}
+
+int odb_hash_batch(odb_hash_job_t *jobs, size_t count)
+{
+    if (count == 0)
+        return 0;
+
+    char (*headers)[OBJECT_HEADER_MAX] = malloc(count * sizeof(*headers));
+    sha256_job_t *hash_jobs = malloc(count * sizeof(sha256_job_t));
+    int result = -1;
+    if (!headers || !hash_jobs)
+        goto done;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        int header_len = format_header(headers[i], jobs[i].type, jobs[i].size);
+        if (header_len < 0)
+            goto done;
+        hash_jobs[i].prefix = (const unsigned char *)headers[i];
+        hash_jobs[i].prefix_len = header_len;
+        hash_jobs[i].data = jobs[i].data;
+        hash_jobs[i].size = jobs[i].size;
+        hash_jobs[i].digest = jobs[i].oid.hash;
+    }
+
+    struct timespec start, end;
+    int trace = perf_trace_enabled();
+    if (trace)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (hash_get_algo() == HASH_SHA256)
+    {
+        result = sha256_mb(hash_jobs, count);
+    }
+    else
+    {
+        result = 0;
+        for (size_t i = 0; i < count && result == 0; i++)
+            result = hash_message(hash_jobs[i].prefix, hash_jobs[i].prefix_len, hash_jobs[i].data,
+                                  hash_jobs[i].size, hash_jobs[i].digest);
+    }
+
+    if (trace)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        pthread_mutex_lock(&hash_stats_lock);
+        if (hash_stats.batches++ == 0)
+            atexit(report_hash_stats);
+        hash_stats.objects += count;
+        for (size_t i = 0; i < count; i++)
+            hash_stats.bytes += jobs[i].size;
+        hash_stats.seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        pthread_mutex_unlock(&hash_stats_lock);
+    }
+
+done:
+    if (result != 0)
+        fprintf(stderr, "Error: Failed to hash objects\n");
+    free(hash_jobs);
+    free(headers);
+    return result;
+}
+
+int odb_write_hashed(object_type_t type, const void *data, size_t size, const object_id_t *oid)
+{
+    if (odb_has_object(oid))
+        return 0;
+
+    odb_writer_t *writer = writer_open(type, size, oid);
+    if (!writer)
+        return -1;
+    if (odb_writer_write(writer, data, size) != 0)
+    {
+        odb_writer_abort(writer);
+        return -1;
+    }
+    return odb_writer_commit(writer, NULL);
+}
+
+int odb_write(object_type_t type, const void *data, size_t size, object_id_t *out_oid)
+{
+    char header[OBJECT_HEADER_MAX];
+    int header_len = format_header(header, type, size);
+    if (header_len < 0)
+        return -1;
+
+    object_id_t oid;
+    if (hash_message(header, header_len, data, size, oid.hash) != 0)
+    {
+        fprintf(stderr, "Error: Failed to hash object\n");
+        return -1;
+    }
+
+    if (odb_write_hashed(type, data, size, &oid) != 0)
+        return -1;
+    *out_oid = oid;
+    return 0;
+}
+
+odb_writer_t *odb_writer_open(object_type_t type, size_t content_size)
+{
+    return writer_open(type, content_size, NULL);
+}
+
+// With a known id the content is not hashed again on the way to disk
+static odb_writer_t *writer_open(object_type_t type, size_t content_size, const object_id_t *oid)
+{
+    odb_writer_t *writer = calloc(1, sizeof(odb_writer_t));
+    if (!writer)
+        return NULL;
+
+    writer->expected_size = content_size;
+    snprintf(writer->temp_path, sizeof(writer->temp_path), "%s/tmp_obj_XXXXXX", ODB_OBJECTS_DIR);
+
+    writer->fd = mkstemp(writer->temp_path);
+    if (writer->fd < 0)
+    {
+        fprintf(stderr, "Error: Failed to create temporary object '%s': %s\n",
+                writer->temp_path, strerror(errno));
+        free(writer);
+        return NULL;
+    }
+
+    if (oid)
+    {
+        writer->oid = *oid;
+    }
+    else
+    {
+        if (hash_init(&writer->hash) != 0)
+        {
+            odb_writer_abort(writer);
+            return NULL;
+        }
+        writer->hashing = 1;
+    }
+
+    if (compression_level != 0)
+    {
+        writer->out = malloc(OBJECT_CHUNK_SIZE);
+        if (!writer->out || deflateInit(&writer->zs, compression_level) != Z_OK)
+        {
+            fprintf(stderr, "Error: Failed to initialize compression\n");
+            odb_writer_abort(writer);
+            return NULL;
+        }
+        writer->deflating = 1;
+    }
+
+    // The header is hashed and stored ahead of the content
+    char header[OBJECT_HEADER_MAX];
+    int header_len = format_header(header, type, content_size);
+    if (header_len < 0)
+    {
+        odb_writer_abort(writer);
+        return NULL;
+    }
+
+    if ((writer->hashing && hash_update(&writer->hash, header, header_len) != 0) ||
+        writer_emit(writer, header, header_len, Z_NO_FLUSH) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write object header\n");
+        odb_writer_abort(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+int odb_writer_write(odb_writer_t *writer, const void *buf, size_t len)
+{
+    if (writer->written + len > writer->expected_size)
+    {
+        fprintf(stderr, "Error: Object content exceeds declared size\n");
+        return -1;
+    }
+
+    if (writer->hashing && hash_update(&writer->hash, buf, len) != 0)
+    {
+        return -1;
+    }
+
+    if (writer_emit(writer, buf, len, Z_NO_FLUSH) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write object data: %s\n", strerror(errno));
+        return -1;
+    }
+
+    writer->written += len;
+    return 0;
+}
+
+int odb_writer_commit(odb_writer_t *writer, object_id_t *out_oid)
+{
+    if (writer->written != writer->expected_size)
+    {
+        fprintf(stderr, "Error: Object size mismatch (declared %zu, wrote %zu)\n",
+                writer->expected_size, writer->written);
+        odb_writer_abort(writer);
+        return -1;
+    }
+
+    if (writer->deflating && writer_emit(writer, NULL, 0, Z_FINISH) != 0)
+    {
+        fprintf(stderr, "Error: Failed to finish compressed object\n");
+        odb_writer_abort(writer);
+        return -1;
+    }
+
+    object_id_t oid = writer->oid;
+    if (writer->hashing && hash_final(&writer->hash, oid.hash) != 0)
+    {
+        odb_writer_abort(writer);
+        return -1;
+    }
+
+    // Content that turned out to be stored already needs no second copy
+    if (odb_has_object(&oid))
+    {
+        if (out_oid)
+        {
+            *out_oid = oid;
+        }
+        odb_writer_abort(writer);
+        return 0;
+    }
+
+    // Objects are immutable once named by their hash
+    fchmod(writer->fd, 0444);
+
+    if (odb_sync_written(writer->fd) != 0)
+    {
+        fprintf(stderr, "Error: Failed to sync object: %s\n", strerror(errno));
+        odb_writer_abort(writer);
+        return -1;
+    }
+
+    if (close(writer->fd) != 0)
+    {
+        writer->fd = -1;
+        fprintf(stderr, "Error: Failed to close temporary object: %s\n", strerror(errno));
+        odb_writer_abort(writer);
+        return -1;
+    }
+    writer->fd = -1;
+
+    char obj_path[OBJECT_PATH_MAX];
+    if (filepath_from_hash(&oid, obj_path) != 0)
+    {
+        fprintf(stderr, "Error: Object path too long for '%s'\n", oid_hex(&oid));
+        odb_writer_abort(writer);
+        return -1;
+    }
+
+    // The fanout directory is the object path up to its last slash
+    char prefix_dir[OBJECT_PATH_MAX];
+    memcpy(prefix_dir, obj_path, sizeof(prefix_dir));
+    *strrchr(prefix_dir, '/') = '\0';
+    int new_dir = access(prefix_dir, F_OK) != 0;
+    if (create_directory(prefix_dir) < 0)
+    {
+        odb_writer_abort(writer);
+        return -1;
+    }
+    if (rename(writer->temp_path, obj_path) != 0)
+    {
+        fprintf(stderr, "Error: Failed to move object into place '%s': %s\n",
+                obj_path, strerror(errno));
+        odb_writer_abort(writer);
+        return -1;
+    }
+    writer->temp_path[0] = '\0';
+
+    // The rename, and a new fanout directory's own entry, are durable only
+    // once their directories are synced; batch leaves that to the barrier
+    if (fsync_mode == ODB_FSYNC_OBJECT &&
+        (sync_directory(prefix_dir) != 0 || (new_dir && sync_directory(ODB_OBJECTS_DIR) != 0)))
+    {
+        odb_writer_abort(writer);
+        return -1;
+    }
+
+    pthread_mutex_lock(&known_lock);
+    known_add(&oid);
+    pthread_mutex_unlock(&known_lock);
+    if (out_oid)
+    {
+        *out_oid = oid;
+    }
+
+    odb_writer_abort(writer);
+    return 0;
+}
+
+void odb_writer_abort(odb_writer_t *writer)
+{
+    if (!writer)
+        return;
+
+    if (writer->fd >= 0)
+        close(writer->fd);
+    if (writer->temp_path[0])
+        unlink(writer->temp_path);
+
+    if (writer->deflating)
+        deflateEnd(&writer->zs);
+    free(writer->out);
+
+    if (writer->hashing)
+        hash_release(&writer->hash);
+    free(writer);
+}
+
+static int parse_object_header(const char *header, size_t len, object_type_t *type, size_t *size)
+{
+    const char *space = memchr(header, ' ', len);
+    if (!space)
+    {
+        return -1;
+    }
+
+    size_t type_len = space - header;
+    if (type_len == 4 && memcmp(header, "blob", 4) == 0)
+        *type = OBJ_BLOB;
+    else if (type_len == 4 && memcmp(header, "tree", 4) == 0)
+        *type = OBJ_TREE;
+    else if (type_len == 6 && memcmp(header, "commit", 6) == 0)
+        *type = OBJ_COMMIT;
+    else if (type_len == 6 && memcmp(header, "chunks", 6) == 0)
+        *type = OBJ_CHUNKS;
+    else
+    {
+        fprintf(stderr, "Error: Unknown object type '%.*s'\n", (int)type_len, header);
+        return -1;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(space + 1, &end, 10);
+    if (errno != 0 || end == space + 1 || *end != '\0')
+    {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+// A zlib stream starts with a CMF byte whose low nibble is 8 (deflate) and
+// a CMF/FLG pair divisible by 31. Uncompressed objects start with the ASCII
+// type name, which never satisfies both.
+static int is_zlib_stream(const unsigned char *buf, size_t len)
+{
+    return len >= 2 && (buf[0] & 0x0f) == Z_DEFLATED &&
+           ((buf[0] << 8) | buf[1]) % 31 == 0;
+}
+
+// Inflated objects land in a small pool of buffers that are handed back on
+// release and reused, so walking history does not allocate per object.
+// Anything bigger than ODB_SCRATCH_MAX, or beyond the pool, is heap memory.
+// The pool is shared by all threads and guarded by scratch_lock.
+#define ODB_SCRATCH_SLOTS 8
+#define ODB_SCRATCH_MAX (4 * 1024 * 1024)
+
+typedef struct
+{
+    unsigned char *buf;
+    size_t capacity;
+    int in_use;
+} scratch_slot_t;
+
+static scratch_slot_t scratch[ODB_SCRATCH_SLOTS];
+static pthread_mutex_t scratch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned char *odb_scratch_acquire(size_t size, int *out_slot)
+{
+    *out_slot = -1;
+    if (size <= ODB_SCRATCH_MAX)
+    {
+        pthread_mutex_lock(&scratch_lock);
+
+        // Prefer a free buffer that is already big enough
+        int pick = -1;
+        for (int i = 0; i < ODB_SCRATCH_SLOTS; i++)
+        {
+            if (scratch[i].in_use)
+                continue;
+            if (scratch[i].capacity >= size)
+            {
+                pick = i;
+                break;
+            }
+            if (pick < 0)
+                pick = i;
+        }
+
+        if (pick >= 0)
+        {
+            scratch_slot_t *slot = &scratch[pick];
+            if (slot->capacity < size)
+            {
+                size_t capacity = slot->capacity ? slot->capacity : 4096;
+                while (capacity < size)
+                    capacity *= 2;
+                unsigned char *grown = realloc(slot->buf, capacity);
+                if (!grown)
+                {
+                    pthread_mutex_unlock(&scratch_lock);
+                    return NULL;
+                }
+                slot->buf = grown;
+                slot->capacity = capacity;
+            }
+            slot->in_use = 1;
+            *out_slot = pick;
+            pthread_mutex_unlock(&scratch_lock);
+            return slot->buf;
+        }
+        pthread_mutex_unlock(&scratch_lock);
+    }
+
+    return malloc(size ? size : 1);
+}
+
+void odb_scratch_release(unsigned char *buf, int slot)
+{
+    if (slot >= 0)
+    {
+        pthread_mutex_lock(&scratch_lock);
+        scratch[slot].in_use = 0;
+        pthread_mutex_unlock(&scratch_lock);
+    }
+    else
+    {
+        free(buf);
+    }
+}
+
+// One inflate stream per thread, ended when the thread exits
+static pthread_key_t inflater_key;
+static pthread_once_t inflater_once = PTHREAD_ONCE_INIT;
+
+static void inflater_free(void *zs)
+{
+    inflateEnd(zs);
+    free(zs);
+}
+
+static void inflater_key_create(void)
+{
+    pthread_key_create(&inflater_key, inflater_free);
+}
+
+z_stream *odb_inflater(void)
+{
+    pthread_once(&inflater_once, inflater_key_create);
+    z_stream *zs = pthread_getspecific(inflater_key);
+    if (!zs)
+    {
+        zs = calloc(1, sizeof(z_stream));
+        if (!zs)
+            return NULL;
+        if (inflateInit(zs) != Z_OK)
+        {
+            free(zs);
+            return NULL;
+        }
+        if (pthread_setspecific(inflater_key, zs) != 0)
+        {
+            inflater_free(zs);
+            return NULL;
+        }
+    }
+    else if (inflateReset(zs) != Z_OK)
+    {
+        return NULL;
+    }
+    return zs;
+}
+
+void odb_unmap(odb_object_t *object)
+{
+    if (object->map)
+        munmap(object->map, object->map_size);
+    if (object->buffer)
+        odb_scratch_release(object->buffer, object->scratch);
+    memset(object, 0, sizeof(*object));
+}
+
+// Loose objects up to this size are read rather than mapped; for small
+// files one read is cheaper than setting up and tearing down a mapping
+#define ODB_READ_MAX (64 * 1024)
+
+static int map_raw_object(odb_object_t *object, const unsigned char *start, size_t len)
+{
+    const unsigned char *nul = memchr(start, '\0', len < OBJECT_HEADER_MAX ? len : OBJECT_HEADER_MAX);
+    if (!nul)
+    {
+        fprintf(stderr, "Error: Invalid object format - no content delimiter\n");
+        return -1;
+    }
+
+    char header[OBJECT_HEADER_MAX];
+    memcpy(header, start, nul - start);
+    header[nul - start] = '\0';
+    if (parse_object_header(header, nul - start, &object->type, &object->size) != 0 ||
+        object->size != len - (nul + 1 - start))
+    {
+        fprintf(stderr, "Error: Invalid header format\n");
+        return -1;
+    }
+
+    object->data = nul + 1;
+    return 0;
+}
+
+int odb_inflate(z_stream *zs, size_t *in_left, size_t *out_left, int flush)
+{
+    for (;;)
+    {
+        uInt in_window = *in_left > UINT_MAX ? UINT_MAX : (uInt)*in_left;
+        uInt out_window = *out_left > UINT_MAX ? UINT_MAX : (uInt)*out_left;
+        zs->avail_in = in_window;
+        zs->avail_out = out_window;
+        int ret = inflate(zs, flush);
+        *in_left -= in_window - zs->avail_in;
+        *out_left -= out_window - zs->avail_out;
+
+        // A window ran out while there is more of that buffer; Z_FINISH
+        // reports that as Z_BUF_ERROR
+        int refill = (zs->avail_in == 0 && *in_left > 0) || (zs->avail_out == 0 && *out_left > 0);
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || !refill)
+            return ret;
+    }
+}
+
+static int map_zlib_object(odb_object_t *object, const unsigned char *in, size_t len)
+{
+    z_stream *zs = odb_inflater();
+    if (!zs)
+    {
+        return -1;
+    }
+    zs->next_in = (Bytef *)in;
+    size_t in_left = len;
+
+    // Inflate a header's worth, then the rest straight into a buffer of the
+    // advertised size
+    char header[OBJECT_HEADER_MAX];
+    size_t out_left = sizeof(header);
+    zs->next_out = (Bytef *)header;
+    int ret = odb_inflate(zs, &in_left, &out_left, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END)
+        goto corrupt;
+
+    size_t have = sizeof(header) - out_left;
+    char *nul = memchr(header, '\0', have);
+    if (!nul || parse_object_header(header, nul - header, &object->type, &object->size) != 0)
+        goto corrupt;
+
+    unsigned char *data = odb_scratch_acquire(object->size + 1, &object->scratch);
+    if (!data)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    object->buffer = data;
+
+    size_t extra = have - (nul + 1 - header);
+    if (extra > object->size)
+        goto corrupt;
+    memcpy(data, nul + 1, extra);
+
+    zs->next_out = data + extra;
+    out_left = object->size - extra;
+    if (ret != Z_STREAM_END)
+        ret = odb_inflate(zs, &in_left, &out_left, Z_FINISH);
+    if (ret != Z_STREAM_END || out_left != 0)
+        goto corrupt;
+
+    data[object->size] = '\0';
+    object->data = data;
+    return 0;
+
+corrupt:
+    fprintf(stderr, "Error: Corrupt compressed object\n");
+    return -1;
+}
+
+int odb_map(const object_id_t *oid, odb_object_t *object)
+{
+    memset(object, 0, sizeof(*object));
+    object->scratch = -1;
+
+    // Packs hold most objects in a repacked repository, try them first
+    int packed = pack_map_object(oid, object);
+    if (packed != 1)
+    {
+        return packed;
+    }
+    return odb_map_loose(oid, object);
+}
+
+int odb_map_loose(const object_id_t *oid, odb_object_t *object)
+{
+    memset(object, 0, sizeof(*object));
+    object->scratch = -1;
+
+    char obj_path[OBJECT_PATH_MAX];
+    if (filepath_from_hash(oid, obj_path) != 0)
+    {
+        fprintf(stderr, "Error: Object path too long for '%s'\n", oid_hex(oid));
+        return -1;
+    }
+
+    int fd = open(obj_path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Failed to open '%s'\n", obj_path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "Error: Failed to read '%s'\n", obj_path);
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size <= ODB_READ_MAX)
+    {
+        int slot;
+        unsigned char *buf = odb_scratch_acquire(st.st_size, &slot);
+        ssize_t n = -1;
+        if (buf)
+        {
+            do
+            {
+                n = read(fd, buf, st.st_size);
+            } while (n < 0 && errno == EINTR);
+        }
+        close(fd);
+        if (n != st.st_size)
+        {
+            fprintf(stderr, "Error: Failed to read '%s'\n", obj_path);
+            if (buf)
+                odb_scratch_release(buf, slot);
+            return -1;
+        }
+
+        int result;
+        if (is_zlib_stream(buf, st.st_size))
+        {
+            result = map_zlib_object(object, buf, st.st_size);
+            odb_scratch_release(buf, slot);
+        }
+        else
+        {
+            // A raw object's content is served out of the read buffer
+            object->buffer = buf;
+            object->scratch = slot;
+            result = map_raw_object(object, buf, st.st_size);
+        }
+        if (result != 0)
+            odb_unmap(object);
+        return result;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Failed to map '%s'\n", obj_path);
+        return -1;
+    }
+    object->map = map;
+    object->map_size = st.st_size;
+
+    int result = is_zlib_stream(map, st.st_size) ? map_zlib_object(object, map, st.st_size)
+                                                 : map_raw_object(object, map, st.st_size);
+    if (result != 0)
+    {
+        odb_unmap(object);
+        return -1;
+    }
+
+    // The compressed bytes are no longer needed once inflated
+    if (object->buffer)
+    {
+        munmap(object->map, object->map_size);
+        object->map = NULL;
+        object->map_size = 0;
+    }
+    return 0;
+}
+
+static int open_loose_object(const object_id_t *oid)
+{
+    char obj_path[OBJECT_PATH_MAX];
+    if (filepath_from_hash(oid, obj_path) != 0)
+    {
+        fprintf(stderr, "Error: Object path too long for '%s'\n", oid_hex(oid));
+        return -1;
+    }
+
+    int fd = open(obj_path, O_RDONLY);
+    if (fd < 0)
+        fprintf(stderr, "Error: Failed to open '%s'\n", obj_path);
+    return fd;
+}
+
+// A loose object opened for streaming, with the buffers that bound the
+// memory used however large the object is
+typedef struct
+{
+    int fd;
+    int compressed;
+    object_type_t type;
+    size_t size;
+    size_t header_len;
+    unsigned char in[OBJECT_CHUNK_SIZE];
+    size_t in_len;
+    unsigned char head[OBJECT_HEADER_MAX + OBJECT_CHUNK_SIZE];
+    const unsigned char *content;
+    size_t content_len;
+    z_stream *zs;
+    int ended; // the whole stream was inflated with the header
+} loose_reader_t;
+
+// Reads the start of a loose object and splits off its header. A raw
+// object's content starts header_len bytes into the file; for a compressed
+// one, content holds what was inflated along with the header and the
+// stream continues from there.
+static int loose_reader_open(loose_reader_t *reader, const object_id_t *oid)
+{
+    reader->fd = open_loose_object(oid);
+    if (reader->fd < 0)
+        return -1;
+
+    ssize_t n;
+    do
+    {
+        n = read(reader->fd, reader->in, sizeof(reader->in));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        goto corrupt;
+    reader->in_len = n;
+    reader->compressed = is_zlib_stream(reader->in, reader->in_len);
+
+    const unsigned char *start = reader->in;
+    size_t avail = reader->in_len;
+    if (reader->compressed)
+    {
+        reader->zs = odb_inflater();
+        if (!reader->zs)
+            goto corrupt;
+        reader->zs->next_in = reader->in;
+        reader->zs->avail_in = reader->in_len;
+        reader->zs->next_out = reader->head;
+        reader->zs->avail_out = sizeof(reader->head);
+        int ret = inflate(reader->zs, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            goto corrupt;
+        reader->ended = ret == Z_STREAM_END;
+        start = reader->head;
+        avail = sizeof(reader->head) - reader->zs->avail_out;
+    }
+
+    const unsigned char *nul = memchr(start, '\0', avail < OBJECT_HEADER_MAX ? avail : OBJECT_HEADER_MAX);
+    char header[OBJECT_HEADER_MAX];
+    if (!nul)
+        goto corrupt;
+    memcpy(header, start, nul - start);
+    header[nul - start] = '\0';
+    if (parse_object_header(header, nul - start, &reader->type, &reader->size) != 0)
+        goto corrupt;
+
+    reader->header_len = nul + 1 - start;
+    reader->content = nul + 1;
+    reader->content_len = avail - reader->header_len;
+    if (reader->content_len > reader->size)
+        goto corrupt;
+    return 0;
+
+corrupt:
+    fprintf(stderr, "Error: Corrupt object %s\n", oid_hex(oid));
+    close(reader->fd);
+    return -1;
+}
+
+int odb_object_info(const object_id_t *oid, object_type_t *type, size_t *size)
+{
+    int packed = pack_object_info(oid, type, size);
+    if (packed != 1)
+        return packed;
+
+    loose_reader_t *reader = malloc(sizeof(loose_reader_t));
+    if (!reader)
+        return -1;
+    int result = loose_reader_open(reader, oid);
+    if (result == 0)
+    {
+        *type = reader->type;
+        *size = reader->size;
+        close(reader->fd);
+    }
+    free(reader);
+    return result;
+}
+
+// Copies count bytes of in_fd from offset to out_fd, in the kernel where it can
+static int copy_fd_range(int out_fd, int in_fd, off_t offset, size_t count)
+{
+#ifdef __linux__
+    while (count > 0)
+    {
+        ssize_t n = sendfile(out_fd, in_fd, &offset, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // e.g. an output sendfile cannot write to
+        count -= n;
+    }
+    if (count == 0)
+        return 0;
+#endif
+
+    unsigned char *buf = malloc(OBJECT_CHUNK_SIZE);
+    if (!buf)
+        return -1;
+    int result = 0;
+    while (count > 0 && result == 0)
+    {
+        ssize_t n = pread(in_fd, buf, count < OBJECT_CHUNK_SIZE ? count : OBJECT_CHUNK_SIZE, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || write_all(out_fd, buf, n) != 0)
+            result = -1;
+        else
+        {
+            offset += n;
+            count -= n;
+        }
+    }
+    free(buf);
+    return result;
+}
+
+static int stream_loose_object(loose_reader_t *reader, int out_fd)
+{
+    if (!reader->compressed)
+    {
+        struct stat st;
+        if (fstat(reader->fd, &st) != 0 || (size_t)st.st_size != reader->header_len + reader->size)
+            return -1;
+        return copy_fd_range(out_fd, reader->fd, reader->header_len, reader->size);
+    }
+
+    // Content inflated along with the header goes first, then the rest of
+    // the stream passes through the head buffer
+    if (write_all(out_fd, reader->content, reader->content_len) != 0)
+        return -1;
+    size_t written = reader->content_len;
+
+    z_stream *zs = reader->zs;
+    int ret = Z_OK;
+    while (!reader->ended)
+    {
+        zs->next_out = reader->head;
+        zs->avail_out = sizeof(reader->head);
+        ret = inflate(zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            return -1;
+
+        size_t have = sizeof(reader->head) - zs->avail_out;
+        if (written + have > reader->size || write_all(out_fd, reader->head, have) != 0)
+            return -1;
+        written += have;
+        reader->ended = ret == Z_STREAM_END;
+
+        if (!reader->ended && zs->avail_in == 0)
+        {
+            ssize_t n = read(reader->fd, reader->in, sizeof(reader->in));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            zs->next_in = reader->in;
+            zs->avail_in = n;
+        }
+    }
+    return written == reader->size ? 0 : -1;
+}
+
+int odb_stream(const object_id_t *oid, int fd)
+{
+    int packed = pack_stream_object(oid, fd);
+    if (packed != 1)
+        return packed;
+
+    loose_reader_t *reader = malloc(sizeof(loose_reader_t));
+    if (!reader)
+        return -1;
+    int result = loose_reader_open(reader, oid);
+    if (result == 0)
+    {
+        result = stream_loose_object(reader, fd);
+        if (result != 0)
+            fprintf(stderr, "Error: Failed to stream object %s\n", oid_hex(oid));
+        close(reader->fd);
+    }
+    free(reader);
+    return result;
+}
+
+int odb_read(const object_id_t *oid, object_type_t *type, void **out_data, size_t *out_size)
+{
+    odb_object_t object;
+    if (odb_map(oid, &object) != 0)
+    {
+        return -1;
+    }
+
+    unsigned char *data = malloc(object.size + 1);
+    if (!data)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        odb_unmap(&object);
+        return -1;
+    }
+    memcpy(data, object.data, object.size);
+    data[object.size] = '\0';
+
+    *type = object.type;
+    *out_data = data;
+    *out_size = object.size;
+    odb_unmap(&object);
+    return 0;
+}
+
+int odb_for_each_loose_object(int (*fn)(const object_id_t *oid, void *ctx), void *ctx)
+{
+    for (int prefix = 0; prefix < 256; prefix++)
+    {
+        char dir_path[PATH_MAX];
+        snprintf(dir_path, sizeof(dir_path), "%s/%02x", ODB_OBJECTS_DIR, prefix);
+
+        DIR *dir = opendir(dir_path);
+        if (!dir)
+            continue;
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            object_id_t oid;
+            if (oid_from_loose_name(prefix, entry->d_name, &oid) != 0)
+                continue;
+            if (fn(&oid, ctx) != 0)
+            {
+                closedir(dir);
+                return -1;
+            }
+        }
+        closedir(dir);
+    }
+    return 0;
+}
+
+// Sorted ids of the loose objects in each fanout directory, read the first
+// time an abbreviation needs them
+typedef struct
+{
+    object_id_t *ids;
+    size_t count;
+    int loaded;
+} loose_dir_t;
+
+static loose_dir_t loose_dirs[256];
+
+static int compare_ids(const void *a, const void *b)
+{
+    return oid_cmp(a, b);
+}
+
+static const loose_dir_t *loose_dir_load(int prefix)
+{
+    loose_dir_t *dir_ids = &loose_dirs[prefix];
+    if (dir_ids->loaded)
+        return dir_ids;
+    dir_ids->loaded = 1;
+
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s/%02x", ODB_OBJECTS_DIR, prefix);
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+        return dir_ids;
+
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        object_id_t oid;
+        if (oid_from_loose_name(prefix, entry->d_name, &oid) != 0)
+            continue;
+
+        if (dir_ids->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            object_id_t *grown = realloc(dir_ids->ids, capacity * sizeof(object_id_t));
+            if (!grown)
+                break;
+            dir_ids->ids = grown;
+        }
+        dir_ids->ids[dir_ids->count++] = oid;
+    }
+    closedir(dir);
+
+    qsort(dir_ids->ids, dir_ids->count, sizeof(object_id_t), compare_ids);
+    return dir_ids;
+}
+
+// Position of the first id in the directory that is not below key
+static size_t loose_lower_bound(const loose_dir_t *dir_ids, const object_id_t *key)
+{
+    size_t lo = 0, hi = dir_ids->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (oid_cmp(&dir_ids->ids[mid], key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+typedef struct
+{
+    object_id_t prefix;
+    size_t len;
+    object_id_t matches[ODB_ABBREV_LIST];
+    size_t count; // distinct matches, counted beyond the ones kept
+} abbrev_search_t;
+
+static int add_abbrev_match(const object_id_t *oid, void *ctx)
+{
+    abbrev_search_t *search = ctx;
+    // An object both loose and packed is one match
+    for (size_t i = 0; i < search->count && i < ODB_ABBREV_LIST; i++)
+    {
+        if (oid_equal(&search->matches[i], oid))
+            return 0;
+    }
+    if (search->count < ODB_ABBREV_LIST)
+        search->matches[search->count] = *oid;
+    search->count++;
+    return 0;
+}
+
+int odb_resolve_abbrev(const char *hex, object_id_t *out_oid)
+{
+    abbrev_search_t search;
+    search.count = 0;
+    if (oid_from_hex_prefix(hex, &search.prefix, &search.len) != 0 || search.len < ODB_ABBREV_MIN)
+    {
+        fprintf(stderr, "Error: Not a valid object name '%s'\n", hex);
+        return -1;
+    }
+
+    // The first two digits name the one fanout directory to look in
+    const loose_dir_t *dir_ids = loose_dir_load(search.prefix.hash[0]);
+    for (size_t i = loose_lower_bound(dir_ids, &search.prefix); i < dir_ids->count; i++)
+    {
+        if (oid_common_hex(&dir_ids->ids[i], &search.prefix) < search.len)
+            break;
+        add_abbrev_match(&dir_ids->ids[i], &search);
+    }
+    pack_for_each_abbrev(&search.prefix, search.len, add_abbrev_match, &search);
+
+    if (search.count == 0)
+        return 1;
+    if (search.count == 1)
+    {
+        *out_oid = search.matches[0];
+        return 0;
+    }
+
+    fprintf(stderr, "Error: Short object id '%s' is ambiguous; %zu candidates:\n", hex, search.count);
+    for (size_t i = 0; i < search.count && i < ODB_ABBREV_LIST; i++)
+    {
+        object_type_t type;
+        size_t size;
+        int known_type = odb_object_info(&search.matches[i], &type, &size) == 0;
+        fprintf(stderr, "  %s %s\n", oid_hex(&search.matches[i]),
+                known_type ? object_type_to_string(type) : "unknown");
+    }
+    if (search.count > ODB_ABBREV_LIST)
+        fprintf(stderr, "  ...\n");
+    return -1;
+}
+
+size_t odb_abbrev_len(const object_id_t *oid, size_t min_len)
+{
+    size_t longest = pack_common_hex(oid);
+
+    const loose_dir_t *dir_ids = loose_dir_load(oid->hash[0]);
+    size_t pos = loose_lower_bound(dir_ids, oid);
+    size_t after = pos < dir_ids->count && oid_equal(&dir_ids->ids[pos], oid) ? pos + 1 : pos;
+    if (pos > 0)
+    {
+        size_t common = oid_common_hex(&dir_ids->ids[pos - 1], oid);
+        longest = common > longest ? common : longest;
+    }
+    if (after < dir_ids->count)
+    {
+        size_t common = oid_common_hex(&dir_ids->ids[after], oid);
+        longest = common > longest ? common : longest;
+    }
+
+    size_t len = longest + 1 > min_len ? longest + 1 : min_len;
+    return len < HEX_SIZE - 1 ? len : HEX_SIZE - 1;
+}
@@ -0,0 +1,73 @@
+#include "oid.h"
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Maps an ASCII byte to its nibble value, or -1
+static const signed char hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16};
+
+void oid_to_hex(const object_id_t *oid, char *hex)
+{
+    for (int i = 0; i < SHA256_SIZE; i++)
+    {
+        hex[i * 2] = hex_digits[oid->hash[i] >> 4];
+        hex[i * 2 + 1] = hex_digits[oid->hash[i] & 0x0f];
+    }
+    hex[SHA256_SIZE * 2] = '\0';
+}
+
+int oid_from_hex(const char *hex, object_id_t *oid)
+{
+    // Table entries are offset by one so that zero means "not a digit"
+    for (int i = 0; i < SHA256_SIZE; i++)
+    {
+        int hi = hex_values[(unsigned char)hex[i * 2]] - 1;
+        if (hi < 0)
+            return -1;
+        int lo = hex_values[(unsigned char)hex[i * 2 + 1]] - 1;
+        if (lo < 0)
+            return -1;
+        oid->hash[i] = (unsigned char)(hi << 4 | lo);
+    }
+    return 0;
+}
+
+int oid_from_hex_prefix(const char *hex, object_id_t *oid, size_t *out_len)
+{
+    oid_clear(oid);
+    size_t len = 0;
+    for (; hex[len] != '\0'; len++)
+    {
+        int value = hex_values[(unsigned char)hex[len]] - 1;
+        if (value < 0 || len == SHA256_SIZE * 2)
+            return -1;
+        oid->hash[len / 2] |= len % 2 ? value : value << 4;
+    }
+    *out_len = len;
+    return 0;
+}
+
+size_t oid_common_hex(const object_id_t *a, const object_id_t *b)
+{
+    for (size_t i = 0; i < SHA256_SIZE; i++)
+    {
+        unsigned char diff = a->hash[i] ^ b->hash[i];
+        if (diff)
+            return i * 2 + (diff & 0xf0 ? 0 : 1);
+    }
+    return SHA256_SIZE * 2;
+}
+
+const char *oid_hex(const object_id_t *oid)
+{
+    static char buffers[4][HEX_SIZE];
+    static int next = 0;
+
+    char *hex = buffers[next];
+    next = (next + 1) % 4;
+    oid_to_hex(oid, hex);
+    return hex;
+}
@@ -0,0 +1,1319 @@
+#include "pack.h"
+#include "odb.h"
+#include "delta.h"
+#include "object_types.h"
+#include "tree_iter.h"
+#include "parallel.h"
+#include "util.h"
+#include "config.h"
+#include "commit_graph.h"
+#include "chunk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <uthash.h>
+
+#define PACK_HEADER_SIZE 12
+#define PACK_ENTRY_HEADER_MAX 16
+#define PACK_IDX_HEADER_SIZE 8
+#define PACK_FANOUT_SIZE (256 * 4)
+#define PACK_REF_DELTA 7
+#define PACK_STREAM_RELEASE (4 * 1024 * 1024) // streamed input dropped from memory at a time
+
+typedef struct
+{
+    char path[PATH_MAX]; // .pack file
+    unsigned char *map;
+    size_t map_size;
+    unsigned char *idx;
+    size_t idx_size;
+    uint32_t count;
+    const unsigned char *fanout;
+    const unsigned char *ids;
+    const unsigned char *offsets;
+} pack_t;
+
+static pack_t *packs = NULL;
+static size_t pack_count = 0;
+static int packs_loaded = 0;
+static pthread_mutex_t packs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int map_file(const char *path, unsigned char **out, size_t *out_size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    *out = map;
+    *out_size = st.st_size;
+    return 0;
+}
+
+static int pack_open(pack_t *pack, const char *idx_path)
+{
+    if (map_file(idx_path, &pack->idx, &pack->idx_size) != 0)
+    {
+        fprintf(stderr, "Error: Failed to read pack index '%s'\n", idx_path);
+        return -1;
+    }
+
+    const unsigned char *p = pack->idx;
+    size_t min_size = PACK_IDX_HEADER_SIZE + PACK_FANOUT_SIZE + 2 * SHA256_SIZE;
+    if (pack->idx_size < min_size ||
+        get_be32(p) != PACK_IDX_SIGNATURE || get_be32(p + 4) != PACK_IDX_VERSION)
+    {
+        fprintf(stderr, "Error: Invalid pack index '%s'\n", idx_path);
+        munmap(pack->idx, pack->idx_size);
+        return -1;
+    }
+
+    pack->fanout = p + PACK_IDX_HEADER_SIZE;
+    pack->count = get_be32(pack->fanout + 255 * 4);
+    pack->ids = pack->fanout + PACK_FANOUT_SIZE;
+    pack->offsets = pack->ids + (size_t)pack->count * SHA256_SIZE;
+
+    if (min_size + (size_t)pack->count * (SHA256_SIZE + 8) != pack->idx_size)
+    {
+        fprintf(stderr, "Error: Truncated pack index '%s'\n", idx_path);
+        munmap(pack->idx, pack->idx_size);
+        return -1;
+    }
+
+    // foo.idx -> foo.pack
+    size_t len = strlen(idx_path);
+    snprintf(pack->path, sizeof(pack->path), "%.*s.pack", (int)(len - 4), idx_path);
+    if (map_file(pack->path, &pack->map, &pack->map_size) != 0)
+    {
+        fprintf(stderr, "Error: Failed to open pack '%s'\n", pack->path);
+        munmap(pack->idx, pack->idx_size);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void packs_unload(void)
+{
+    for (size_t i = 0; i < pack_count; i++)
+    {
+        munmap(packs[i].map, packs[i].map_size);
+        munmap(packs[i].idx, packs[i].idx_size);
+    }
+    free(packs);
+    packs = NULL;
+    pack_count = 0;
+    packs_loaded = 0;
+}
+
+static int ends_with(const char *s, const char *suffix)
+{
+    size_t len = strlen(s);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+// Loaded on first use by whichever thread gets there first
+static void packs_load(void)
+{
+    pthread_mutex_lock(&packs_lock);
+    if (packs_loaded)
+    {
+        pthread_mutex_unlock(&packs_lock);
+        return;
+    }
+    packs_loaded = 1;
+
+    DIR *dir = opendir(PACK_DIR);
+    if (!dir)
+    {
+        pthread_mutex_unlock(&packs_lock);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "pack-", 5) != 0 || !ends_with(entry->d_name, ".idx"))
+            continue;
+
+        pack_t *grown = realloc(packs, (pack_count + 1) * sizeof(pack_t));
+        if (!grown)
+            break;
+        packs = grown;
+
+        char idx_path[PATH_MAX];
+        snprintf(idx_path, sizeof(idx_path), "%s/%s", PACK_DIR, entry->d_name);
+        if (pack_open(&packs[pack_count], idx_path) == 0)
+        {
+            pack_count++;
+        }
+    }
+    closedir(dir);
+    pthread_mutex_unlock(&packs_lock);
+}
+
+// Binary search within the fanout bucket of the id's first byte
+static int pack_find(const pack_t *pack, const unsigned char *id, uint64_t *out_offset)
+{
+    uint32_t lo = id[0] == 0 ? 0 : get_be32(pack->fanout + (id[0] - 1) * 4);
+    uint32_t hi = get_be32(pack->fanout + id[0] * 4);
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(pack->ids + (size_t)mid * SHA256_SIZE, id, SHA256_SIZE);
+        if (cmp == 0)
+        {
+            *out_offset = get_be64(pack->offsets + (size_t)mid * 8);
+            return 0;
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+static const pack_t *pack_locate(const object_id_t *oid, uint64_t *out_offset)
+{
+    packs_load();
+    for (size_t i = 0; i < pack_count; i++)
+    {
+        if (pack_find(&packs[i], oid->hash, out_offset) == 0)
+            return &packs[i];
+    }
+    return NULL;
+}
+
+// Inflates an entry's data into a scratch buffer of exactly size bytes
+static unsigned char *pack_inflate(const pack_t *pack, uint64_t pos, size_t size, int *out_slot)
+{
+    if (pos >= pack->map_size)
+        return NULL;
+
+    unsigned char *data = odb_scratch_acquire(size + 1, out_slot);
+    if (!data)
+        return NULL;
+
+    z_stream *zs = odb_inflater();
+    if (!zs)
+    {
+        odb_scratch_release(data, *out_slot);
+        return NULL;
+    }
+
+    // The whole remainder of the pack is available
+    size_t in_left = pack->map_size - pos, out_left = size;
+    zs->next_in = pack->map + pos;
+    zs->next_out = data;
+    int ret = odb_inflate(zs, &in_left, &out_left, Z_FINISH);
+    if (ret != Z_STREAM_END || out_left != 0)
+    {
+        odb_scratch_release(data, *out_slot);
+        return NULL;
+    }
+
+    data[size] = '\0';
+    return data;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Returns the length of the entry header at offset, or -1 if it is cut off
+static int parse_entry_header(const pack_t *pack, uint64_t offset, int *entry_type, size_t *size)
+{
+    if (offset >= pack->map_size)
+        return -1;
+    const unsigned char *header = pack->map + offset;
+    size_t avail = pack->map_size - offset;
+
+    // <more:1><type:3><size:4> followed by <more:1><size:7> groups
+    size_t pos = 0;
+    *entry_type = (header[0] >> 4) & 0x07;
+    *size = header[pos] & 0x0f;
+    int shift = 4;
+    while (header[pos++] & 0x80)
+    {
+        if (pos >= PACK_ENTRY_HEADER_MAX || pos >= avail)
+            return -1;
+        *size |= (size_t)(header[pos] & 0x7f) << shift;
+        shift += 7;
+    }
+    return (int)pos;
+}
+
+// The base of the delta entry whose header ends at offset + pos. It always
+// lives in the same pack. depth is how many deltas lead to this one, so a
+// corrupt pack whose bases loop fails here instead of recursing forever.
+static int find_delta_base(const pack_t *pack, uint64_t offset, size_t pos, int depth, uint64_t *base_offset)
+{
+    if (depth >= PACK_MAX_DEPTH)
+    {
+        fprintf(stderr, "Error: Delta chain too deep at %llu in '%s'\n",
+                (unsigned long long)offset, pack->path);
+        return -1;
+    }
+    if (pack->map_size - offset < pos + SHA256_SIZE ||
+        pack_find(pack, pack->map + offset + pos, base_offset) != 0)
+    {
+        fprintf(stderr, "Error: Missing delta base in '%s'\n", pack->path);
+        return -1;
+    }
+    if (*base_offset == offset)
+    {
+        fprintf(stderr, "Error: Delta at %llu in '%s' is its own base\n",
+                (unsigned long long)offset, pack->path);
+        return -1;
+    }
+    return 0;
+}
+
+// Entry types are object types plus one; tags are never stored
+static int is_object_entry(int entry_type)
+{
+    return entry_type >= OBJ_BLOB + 1 && entry_type <= OBJ_CHUNKS + 1 && entry_type != OBJ_TAG + 1;
+}
+
+static int pack_map_entry(const pack_t *pack, uint64_t offset, int depth, odb_object_t *object)
+{
+    int entry_type;
+    size_t size;
+    int header_len = parse_entry_header(pack, offset, &entry_type, &size);
+    if (header_len < 0)
+        return -1;
+    size_t pos = header_len;
+
+    if (entry_type == PACK_REF_DELTA)
+    {
+        uint64_t base_offset;
+        if (find_delta_base(pack, offset, pos, depth, &base_offset) != 0)
+            return -1;
+
+        odb_object_t base = {.scratch = -1};
+        if (pack_map_entry(pack, base_offset, depth + 1, &base) != 0)
+            return -1;
+
+        int delta_slot, result = -1;
+        unsigned char *delta = pack_inflate(pack, offset + pos + SHA256_SIZE, size, &delta_slot);
+        size_t base_size, result_size;
+        if (delta && delta_sizes(delta, size, &base_size, &result_size) >= 0)
+        {
+            unsigned char *data = odb_scratch_acquire(result_size + 1, &object->scratch);
+            if (data && delta_apply(base.data, base.size, delta, size, data, result_size) == 0)
+            {
+                data[result_size] = '\0';
+                object->type = base.type;
+                object->data = object->buffer = data;
+                object->size = result_size;
+                result = 0;
+            }
+            else if (data)
+            {
+                odb_scratch_release(data, object->scratch);
+            }
+        }
+        if (delta)
+            odb_scratch_release(delta, delta_slot);
+        odb_unmap(&base);
+
+        if (result != 0)
+        {
+            fprintf(stderr, "Error: Corrupt delta at %llu in '%s'\n",
+                    (unsigned long long)offset, pack->path);
+        }
+        return result;
+    }
+
+    if (!is_object_entry(entry_type))
+    {
+        fprintf(stderr, "Error: Unknown pack entry type %d in '%s'\n", entry_type, pack->path);
+        return -1;
+    }
+
+    unsigned char *data = pack_inflate(pack, offset + pos, size, &object->scratch);
+    if (!data)
+    {
+        fprintf(stderr, "Error: Corrupt pack entry at %llu in '%s'\n",
+                (unsigned long long)offset, pack->path);
+        return -1;
+    }
+
+    object->type = (object_type_t)(entry_type - 1);
+    object->data = object->buffer = data;
+    object->size = size;
+    return 0;
+}
+
+int pack_map_object(const object_id_t *oid, odb_object_t *object)
+{
+    memset(object, 0, sizeof(*object));
+    object->scratch = -1;
+
+    uint64_t offset;
+    const pack_t *pack = pack_locate(oid, &offset);
+    if (!pack)
+        return 1;
+
+    return pack_map_entry(pack, offset, 0, object);
+}
+
+static int pack_entry_info(const pack_t *pack, uint64_t offset, int depth, object_type_t *type, size_t *size)
+{
+    int entry_type;
+    int header_len = parse_entry_header(pack, offset, &entry_type, size);
+    if (header_len < 0)
+        return -1;
+
+    if (entry_type != PACK_REF_DELTA)
+    {
+        if (!is_object_entry(entry_type))
+            return -1;
+        *type = (object_type_t)(entry_type - 1);
+        return 0;
+    }
+
+    // The result size leads the delta, so a few inflated bytes tell it;
+    // the type is the base's
+    uint64_t base_offset;
+    if (find_delta_base(pack, offset, header_len, depth, &base_offset) != 0)
+        return -1;
+
+    uint64_t pos = offset + header_len + SHA256_SIZE;
+    z_stream *zs = odb_inflater();
+    if (!zs || pos >= pack->map_size)
+        return -1;
+    unsigned char delta_header[2 * PACK_ENTRY_HEADER_MAX];
+    size_t in_left = pack->map_size - pos;
+    size_t want = *size < sizeof(delta_header) ? *size : sizeof(delta_header);
+    size_t out_left = want;
+    zs->next_in = pack->map + pos;
+    zs->next_out = delta_header;
+    int ret = odb_inflate(zs, &in_left, &out_left, Z_SYNC_FLUSH);
+    size_t base_size;
+    if ((ret != Z_OK && ret != Z_STREAM_END) ||
+        delta_sizes(delta_header, want - out_left, &base_size, size) < 0)
+        return -1;
+
+    size_t delta_size;
+    return pack_entry_info(pack, base_offset, depth + 1, type, &delta_size);
+}
+
+int pack_object_info(const object_id_t *oid, object_type_t *type, size_t *size)
+{
+    uint64_t offset;
+    const pack_t *pack = pack_locate(oid, &offset);
+    if (!pack)
+        return 1;
+
+    if (pack_entry_info(pack, offset, 0, type, size) != 0)
+    {
+        fprintf(stderr, "Error: Corrupt pack entry at %llu in '%s'\n",
+                (unsigned long long)offset, pack->path);
+        return -1;
+    }
+    return 0;
+}
+
+int pack_stream_object(const object_id_t *oid, int fd)
+{
+    uint64_t offset;
+    const pack_t *pack = pack_locate(oid, &offset);
+    if (!pack)
+        return 1;
+
+    int entry_type;
+    size_t size;
+    int header_len = parse_entry_header(pack, offset, &entry_type, &size);
+    if (header_len < 0)
+        return -1;
+
+    if (entry_type == PACK_REF_DELTA)
+    {
+        // A delta's copy ops reach anywhere into its base, so it is
+        // rebuilt whole
+        odb_object_t object = {.scratch = -1};
+        if (pack_map_entry(pack, offset, 0, &object) != 0)
+            return -1;
+        int result = write_all(fd, object.data, object.size);
+        odb_unmap(&object);
+        return result;
+    }
+
+    uint64_t pos = offset + header_len;
+    unsigned char *out = malloc(OBJECT_CHUNK_SIZE);
+    z_stream *zs = odb_inflater();
+    if (!out || !zs || pos >= pack->map_size)
+    {
+        free(out);
+        return -1;
+    }
+
+    zs->next_in = pack->map + pos;
+    size_t in_left = pack->map_size - pos, total = 0;
+
+    // Pages of the mapping stay resident once read, so a large entry, or a
+    // run of entries streamed one after another, would pull itself into
+    // memory after all. They are clean and fault back in if needed, so the
+    // ones inflated already are dropped as we go and at the end.
+    uintptr_t page_mask = ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+    uintptr_t released = (uintptr_t)zs->next_in & page_mask;
+    int ret;
+    do
+    {
+        size_t out_left = OBJECT_CHUNK_SIZE;
+        zs->next_out = out;
+        ret = odb_inflate(zs, &in_left, &out_left, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            break;
+        total += OBJECT_CHUNK_SIZE - out_left;
+        if (write_all(fd, out, OBJECT_CHUNK_SIZE - out_left) != 0)
+        {
+            free(out);
+            return -1;
+        }
+#ifdef MADV_DONTNEED
+        uintptr_t consumed = (uintptr_t)zs->next_in & page_mask;
+        if (consumed - released >= PACK_STREAM_RELEASE || (ret == Z_STREAM_END && consumed > released))
+        {
+            madvise((void *)released, consumed - released, MADV_DONTNEED);
+            released = consumed;
+        }
+#endif
+    } while (ret != Z_STREAM_END);
+    free(out);
+
+    if (ret != Z_STREAM_END || total != size)
+    {
+        fprintf(stderr, "Error: Corrupt pack entry at %llu in '%s'\n",
+                (unsigned long long)offset, pack->path);
+        return -1;
+    }
+    return 0;
+}
+
+int pack_has_object(const object_id_t *oid)
+{
+    uint64_t offset;
+    return pack_locate(oid, &offset) != NULL;
+}
+
+int pack_for_each_object(int (*fn)(const object_id_t *oid, void *ctx), void *ctx)
+{
+    packs_load();
+    for (size_t i = 0; i < pack_count; i++)
+    {
+        for (uint32_t j = 0; j < packs[i].count; j++)
+        {
+            object_id_t oid;
+            memcpy(oid.hash, packs[i].ids + (size_t)j * SHA256_SIZE, SHA256_SIZE);
+            if (fn(&oid, ctx) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Position of the first id in the pack that is not below key
+static uint32_t pack_lower_bound(const pack_t *pack, const unsigned char *key)
+{
+    uint32_t lo = key[0] == 0 ? 0 : get_be32(pack->fanout + (key[0] - 1) * 4);
+    uint32_t hi = get_be32(pack->fanout + key[0] * 4);
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (memcmp(pack->ids + (size_t)mid * SHA256_SIZE, key, SHA256_SIZE) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int pack_for_each_abbrev(const object_id_t *prefix, size_t len,
+                         int (*fn)(const object_id_t *oid, void *ctx), void *ctx)
+{
+    packs_load();
+    for (size_t i = 0; i < pack_count; i++)
+    {
+        // The zero-padded prefix sorts before everything it matches
+        for (uint32_t j = pack_lower_bound(&packs[i], prefix->hash); j < packs[i].count; j++)
+        {
+            object_id_t oid;
+            memcpy(oid.hash, packs[i].ids + (size_t)j * SHA256_SIZE, SHA256_SIZE);
+            if (oid_common_hex(&oid, prefix) < len)
+                break;
+            if (fn(&oid, ctx) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+size_t pack_common_hex(const object_id_t *oid)
+{
+    size_t longest = 0;
+    packs_load();
+    for (size_t i = 0; i < pack_count; i++)
+    {
+        // Only the ids on either side of oid can share more with it than
+        // the ones further away
+        uint32_t pos = pack_lower_bound(&packs[i], oid->hash);
+        uint32_t after = pos;
+        if (after < packs[i].count && memcmp(packs[i].ids + (size_t)after * SHA256_SIZE, oid->hash, SHA256_SIZE) == 0)
+            after++;
+
+        object_id_t neighbor;
+        if (pos > 0)
+        {
+            memcpy(neighbor.hash, packs[i].ids + (size_t)(pos - 1) * SHA256_SIZE, SHA256_SIZE);
+            size_t common = oid_common_hex(&neighbor, oid);
+            longest = common > longest ? common : longest;
+        }
+        if (after < packs[i].count)
+        {
+            memcpy(neighbor.hash, packs[i].ids + (size_t)after * SHA256_SIZE, SHA256_SIZE);
+            size_t common = oid_common_hex(&neighbor, oid);
+            longest = common > longest ? common : longest;
+        }
+    }
+    return longest;
+}
+
+// A pack ends with the SHA-256 of everything before it; its index repeats
+// that checksum and ends with a SHA-256 of its own
+static int pack_checksums_match(const pack_t *pack)
+{
+    unsigned char digest[SHA256_SIZE];
+    unsigned int len;
+    if (pack->map_size < PACK_HEADER_SIZE + SHA256_SIZE ||
+        !EVP_Digest(pack->map, pack->map_size - SHA256_SIZE, digest, &len, EVP_sha256(), NULL) ||
+        memcmp(digest, pack->map + pack->map_size - SHA256_SIZE, SHA256_SIZE) != 0 ||
+        memcmp(digest, pack->idx + pack->idx_size - 2 * SHA256_SIZE, SHA256_SIZE) != 0)
+        return 0;
+
+    return EVP_Digest(pack->idx, pack->idx_size - SHA256_SIZE, digest, &len, EVP_sha256(), NULL) &&
+           memcmp(digest, pack->idx + pack->idx_size - SHA256_SIZE, SHA256_SIZE) == 0;
+}
+
+static void verify_pack(size_t index, void *ctx)
+{
+    size_t *damaged = ctx;
+    if (!pack_checksums_match(&packs[index]))
+    {
+        fprintf(stderr, "Error: Pack '%s' does not match its checksum\n", packs[index].path);
+        __sync_fetch_and_add(damaged, 1);
+    }
+}
+
+size_t pack_verify(size_t *out_bytes)
+{
+    packs_load();
+    size_t damaged = 0;
+    *out_bytes = 0;
+    for (size_t i = 0; i < pack_count; i++)
+        *out_bytes += packs[i].map_size + packs[i].idx_size;
+    parallel_for(pack_count, verify_pack, &damaged);
+    return damaged;
+}
+
+typedef struct
+{
+    object_id_t *ids;
+    size_t count;
+    size_t capacity;
+} id_list_t;
+
+static int collect_object_id(const object_id_t *oid, void *ctx)
+{
+    id_list_t *list = ctx;
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        void *grown = realloc(list->ids, capacity * sizeof(object_id_t));
+        if (!grown)
+            return -1;
+        list->ids = grown;
+        list->capacity = capacity;
+    }
+    list->ids[list->count++] = *oid;
+    return 0;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    return oid_cmp(a, b);
+}
+
+typedef struct
+{
+    int fd;
+    EVP_MD_CTX *ctx;
+    uint64_t offset;
+} pack_writer_t;
+
+static int pack_emit(pack_writer_t *w, const void *buf, size_t len)
+{
+    if (!EVP_DigestUpdate(w->ctx, buf, len))
+        return -1;
+
+    w->offset += len;
+    return write_all(w->fd, buf, len);
+}
+
+static int pack_emit_deflated(pack_writer_t *w, const void *data, size_t size, int level)
+{
+    unsigned char *out = malloc(OBJECT_CHUNK_SIZE);
+    if (!out)
+        return -1;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, level) != Z_OK)
+    {
+        free(out);
+        return -1;
+    }
+
+    // zlib counts input in uInt, so the content goes in slices
+    const unsigned char *in = data;
+    size_t left = size;
+    do
+    {
+        size_t slice = left < OBJECT_CHUNK_SIZE ? left : OBJECT_CHUNK_SIZE;
+        zs.next_in = (Bytef *)in;
+        zs.avail_in = slice;
+        in += slice;
+        left -= slice;
+
+        int flush = left ? Z_NO_FLUSH : Z_FINISH;
+        int ret;
+        do
+        {
+            zs.next_out = out;
+            zs.avail_out = OBJECT_CHUNK_SIZE;
+            ret = deflate(&zs, flush);
+            if (ret == Z_STREAM_ERROR ||
+                pack_emit(w, out, OBJECT_CHUNK_SIZE - zs.avail_out) != 0)
+            {
+                deflateEnd(&zs);
+                free(out);
+                return -1;
+            }
+        } while (flush == Z_FINISH ? ret != Z_STREAM_END : zs.avail_out == 0);
+    } while (left);
+
+    deflateEnd(&zs);
+    free(out);
+    return 0;
+}
+
+static int pack_emit_entry(pack_writer_t *w, int entry_type, const unsigned char *base_id,
+                           const void *data, size_t size, int level)
+{
+    unsigned char header[PACK_ENTRY_HEADER_MAX];
+    size_t len = 0;
+    size_t rest = size >> 4;
+
+    header[len++] = (entry_type << 4) | (size & 0x0f) | (rest ? 0x80 : 0);
+    while (rest)
+    {
+        header[len++] = (rest & 0x7f) | (rest >> 7 ? 0x80 : 0);
+        rest >>= 7;
+    }
+
+    if (pack_emit(w, header, len) != 0)
+        return -1;
+    if (base_id && pack_emit(w, base_id, SHA256_SIZE) != 0)
+        return -1;
+    return pack_emit_deflated(w, data, size, level);
+}
+
+static int write_idx(const char *path, const object_id_t *ids, const uint64_t *offsets,
+                     size_t count, const unsigned char *pack_checksum)
+{
+    size_t size = PACK_IDX_HEADER_SIZE + PACK_FANOUT_SIZE + count * (SHA256_SIZE + 8) + 2 * SHA256_SIZE;
+    unsigned char *buf = calloc(1, size);
+    if (!buf)
+        return -1;
+
+    unsigned char *p = buf;
+    put_be32(p, PACK_IDX_SIGNATURE);
+    put_be32(p + 4, PACK_IDX_VERSION);
+    p += PACK_IDX_HEADER_SIZE;
+
+    size_t j = 0;
+    for (int bucket = 0; bucket < 256; bucket++)
+    {
+        while (j < count && ids[j].hash[0] == bucket)
+            j++;
+        put_be32(p + bucket * 4, j);
+    }
+    p += PACK_FANOUT_SIZE;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy(p, ids[i].hash, SHA256_SIZE);
+        p += SHA256_SIZE;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        put_be64(p, offsets[i]);
+        p += 8;
+    }
+
+    memcpy(p, pack_checksum, SHA256_SIZE);
+    p += SHA256_SIZE;
+
+    unsigned int hash_len;
+    if (!EVP_Digest(buf, p - buf, p, &hash_len, EVP_sha256(), NULL))
+    {
+        free(buf);
+        return -1;
+    }
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s/tmp_idx_XXXXXX", PACK_DIR);
+    int fd = mkstemp(temp_path);
+    if (fd < 0)
+    {
+        free(buf);
+        return -1;
+    }
+
+    int result = write_all(fd, buf, size);
+    if (result == 0)
+    {
+        fchmod(fd, 0444);
+        result = odb_sync_written(fd);
+    }
+    if (close(fd) != 0)
+        result = -1;
+    free(buf);
+
+    if (result == 0 && rename(temp_path, path) != 0)
+        result = -1;
+    if (result != 0)
+        unlink(temp_path);
+    return result;
+}
+
+static int prune_loose_object(const object_id_t *oid, void *ctx)
+{
+    (void)ctx;
+    if (!pack_has_object(oid))
+        return 0;
+
+    char obj_path[OBJECT_PATH_MAX];
+    if (filepath_from_hash(oid, obj_path) != 0)
+        return -1;
+
+    char dir_path[OBJECT_PATH_MAX];
+    memcpy(dir_path, obj_path, sizeof(dir_path));
+    *strrchr(dir_path, '/') = '\0';
+    unlink(obj_path);
+    rmdir(dir_path); // only succeeds once the fanout directory is empty
+    return 0;
+}
+
+typedef struct
+{
+    object_id_t id;
+    object_type_t type;
+    size_t size;
+    const char *path;
+    int depth;
+    int base;
+    int whole; // never a delta; a chunk of a chunked file
+    unsigned char *delta;
+    size_t delta_size;
+} pack_object_t;
+
+typedef struct
+{
+    object_id_t oid; // key
+    char *path;
+    UT_hash_handle hh;
+} path_hint_t;
+
+static path_hint_t *find_path_hint(path_hint_t *hints, const object_id_t *oid)
+{
+    path_hint_t *hint;
+    HASH_FIND(hh, hints, oid, sizeof(object_id_t), hint);
+    return hint;
+}
+
+static void record_path_hint(path_hint_t **hints, const object_id_t *oid, const char *path)
+{
+    if (find_path_hint(*hints, oid))
+        return;
+
+    path_hint_t *hint = malloc(sizeof(path_hint_t));
+    if (!hint)
+        return;
+    hint->oid = *oid;
+    hint->path = strdup(path);
+    HASH_ADD(hh, *hints, oid, sizeof(object_id_t), hint);
+}
+
+static void collect_tree_paths(path_hint_t **hints, const object_id_t *tree_oid)
+{
+    // Trees are recorded too, which doubles as the visited set
+    if (find_path_hint(*hints, tree_oid))
+        return;
+    record_path_hint(hints, tree_oid, "");
+
+    object_t *tree = object_lookup(tree_oid, OBJ_TREE);
+    if (!tree)
+        return;
+
+    const tree_data_t *data = (const tree_data_t *)tree->data;
+    tree_iter_t iter;
+    tree_entry_view_t entry;
+    tree_iter_init(&iter, data->raw, data->raw_size);
+    while (tree_iter_next(&iter, &entry) > 0)
+    {
+        if (S_ISDIR(entry.mode))
+            collect_tree_paths(hints, &entry.oid);
+        else
+            record_path_hint(hints, &entry.oid, entry.name);
+    }
+    object_free(tree);
+}
+
+// Names each reachable blob after the first path it appears under, walking
+// every branch back through its history
+static void collect_path_hints(path_hint_t **hints)
+{
+    DIR *dir = opendir(".vcs/refs/heads");
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char ref_path[PATH_MAX];
+        snprintf(ref_path, sizeof(ref_path), ".vcs/refs/heads/%s", entry->d_name);
+        FILE *fp = fopen(ref_path, "r");
+        if (!fp)
+            continue;
+
+        char hex[HEX_SIZE] = {0};
+        object_id_t oid;
+        if (!fgets(hex, sizeof(hex), fp) || oid_from_hex(hex, &oid) != 0)
+            oid_clear(&oid);
+        fclose(fp);
+
+        object_id_t tree;
+        while (!oid_is_null(&oid) && !find_path_hint(*hints, &oid))
+        {
+            record_path_hint(hints, &oid, "");
+            if (commit_graph_read_commit(&oid, &tree, &oid) != 0)
+                break;
+
+            collect_tree_paths(hints, &tree);
+        }
+    }
+    closedir(dir);
+}
+
+static void free_pack_objects(pack_object_t *objects, size_t count, path_hint_t *hints)
+{
+    for (size_t i = 0; i < count; i++)
+        free(objects[i].delta);
+    free(objects);
+
+    path_hint_t *hint, *tmp;
+    HASH_ITER(hh, hints, hint, tmp)
+    {
+        HASH_DEL(hints, hint);
+        free(hint->path);
+        free(hint);
+    }
+}
+
+static int compare_delta_order(const void *a, const void *b)
+{
+    const pack_object_t *x = *(const pack_object_t *const *)a;
+    const pack_object_t *y = *(const pack_object_t *const *)b;
+
+    int cmp = strcmp(x->path, y->path);
+    if (cmp != 0)
+        return cmp;
+    // Larger first, so deltas tend to remove data rather than add it
+    if (x->size != y->size)
+        return x->size > y->size ? -1 : 1;
+    return oid_cmp(&x->id, &y->id);
+}
+
+typedef struct
+{
+    pack_object_t *object;
+    void *data;
+} delta_window_t;
+
+static int compare_object_id(const void *key, const void *object)
+{
+    return oid_cmp(key, &((const pack_object_t *)object)->id);
+}
+
+// Marks the chunks every chunk list names, in objects sorted by id, to be
+// stored whole
+static int mark_chunks(pack_object_t *objects, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (objects[i].type != OBJ_CHUNKS)
+            continue;
+
+        odb_object_t list;
+        if (odb_map(&objects[i].id, &list) != 0)
+        {
+            fprintf(stderr, "Error: Failed to read object %s\n", oid_hex(&objects[i].id));
+            return -1;
+        }
+        for (size_t pos = 0; pos + CHUNK_RECORD_SIZE <= list.size; pos += CHUNK_RECORD_SIZE)
+        {
+            object_id_t chunk;
+            size_t size;
+            chunk_record(list.data + pos, &chunk, &size);
+            pack_object_t *found = bsearch(&chunk, objects, count, sizeof(pack_object_t), compare_object_id);
+            if (found)
+                found->whole = 1;
+        }
+        odb_unmap(&list);
+    }
+    return 0;
+}
+
+// Slides a window over blobs ordered by path and size and keeps, for each
+// blob, the smallest delta against an earlier window member whose chain is
+// still shorter than max_depth.
+static int select_deltas(pack_object_t *objects, size_t count, const pack_options_t *options)
+{
+    pack_object_t **order = malloc(count * sizeof(pack_object_t *));
+    delta_window_t *window = calloc(options->window > 0 ? options->window : 1, sizeof(delta_window_t));
+    if (!order || !window)
+    {
+        free(order);
+        free(window);
+        return -1;
+    }
+
+    // Each window member is held whole in memory, so big blobs stay out
+    size_t blobs = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (objects[i].type == OBJ_BLOB && !objects[i].whole && objects[i].size <= options->big_file_threshold)
+            order[blobs++] = &objects[i];
+    }
+    qsort(order, blobs, sizeof(pack_object_t *), compare_delta_order);
+
+    int result = 0;
+    size_t slot = 0;
+    for (size_t i = 0; options->window > 0 && i < blobs; i++)
+    {
+        pack_object_t *target = order[i];
+
+        object_type_t type;
+        void *data;
+        size_t size;
+        if (odb_read(&target->id, &type, &data, &size) != 0)
+        {
+            fprintf(stderr, "Error: Failed to read object %s\n", oid_hex(&target->id));
+            result = -1;
+            break;
+        }
+
+        size_t max_size = size / 2 > 20 ? size / 2 - 20 : 0;
+        for (int w = 0; w < options->window; w++)
+        {
+            pack_object_t *base = window[w].object;
+            if (!base || base->depth >= options->depth)
+                continue;
+
+            unsigned char *delta;
+            size_t delta_size;
+            if (delta_create(window[w].data, base->size, data, size, max_size, &delta, &delta_size) != 0)
+                continue;
+
+            free(target->delta);
+            target->delta = delta;
+            target->delta_size = delta_size;
+            target->base = (int)(base - objects);
+            target->depth = base->depth + 1;
+            max_size = delta_size;
+        }
+
+        free(window[slot].data);
+        window[slot].object = target;
+        window[slot].data = data;
+        slot = (slot + 1) % options->window;
+    }
+
+    for (int w = 0; w < options->window; w++)
+        free(window[w].data);
+    free(window);
+    free(order);
+    return result;
+}
+
+int pack_repack(const pack_options_t *options)
+{
+    id_list_t list = {0};
+    if (pack_for_each_object(collect_object_id, &list) != 0 ||
+        odb_for_each_loose_object(collect_object_id, &list) != 0)
+    {
+        fprintf(stderr, "Error: Failed to enumerate objects\n");
+        free(list.ids);
+        return -1;
+    }
+
+    if (list.count == 0)
+    {
+        printf("Nothing to pack\n");
+        free(list.ids);
+        return 0;
+    }
+
+    // Sort and drop ids present both loose and packed
+    qsort(list.ids, list.count, sizeof(object_id_t), compare_ids);
+    size_t unique = 1;
+    for (size_t i = 1; i < list.count; i++)
+    {
+        if (!oid_equal(&list.ids[i], &list.ids[unique - 1]))
+            list.ids[unique++] = list.ids[i];
+    }
+    list.count = unique;
+
+    int new_pack_dir = access(PACK_DIR, F_OK) != 0;
+    if (create_directory(PACK_DIR) != 0)
+    {
+        free(list.ids);
+        return -1;
+    }
+
+    pack_object_t *objects = calloc(list.count, sizeof(pack_object_t));
+    path_hint_t *hints = NULL;
+    if (!objects)
+    {
+        free(list.ids);
+        return -1;
+    }
+
+    collect_path_hints(&hints);
+    for (size_t i = 0; i < list.count; i++)
+    {
+        odb_object_t object;
+        if (odb_map(&list.ids[i], &object) != 0)
+        {
+            fprintf(stderr, "Error: Failed to read object %s\n", oid_hex(&list.ids[i]));
+            free_pack_objects(objects, list.count, hints);
+            free(list.ids);
+            return -1;
+        }
+        objects[i].type = object.type;
+        objects[i].size = object.size;
+        odb_unmap(&object);
+
+        path_hint_t *hint = find_path_hint(hints, &list.ids[i]);
+        objects[i].id = list.ids[i];
+        objects[i].path = hint ? hint->path : "";
+        objects[i].base = -1;
+    }
+
+    if (mark_chunks(objects, list.count) != 0 || select_deltas(objects, list.count, options) != 0)
+    {
+        free_pack_objects(objects, list.count, hints);
+        free(list.ids);
+        return -1;
+    }
+
+    uint64_t *offsets = malloc(list.count * sizeof(uint64_t));
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s/tmp_pack_XXXXXX", PACK_DIR);
+    pack_writer_t w = {.fd = mkstemp(temp_path), .ctx = EVP_MD_CTX_new(), .offset = 0};
+    if (!offsets || w.fd < 0 || !w.ctx || !EVP_DigestInit_ex(w.ctx, EVP_sha256(), NULL))
+    {
+        fprintf(stderr, "Error: Failed to create pack file: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    unsigned char header[PACK_HEADER_SIZE];
+    put_be32(header, PACK_SIGNATURE);
+    put_be32(header + 4, PACK_VERSION);
+    put_be32(header + 8, list.count);
+    if (pack_emit(&w, header, sizeof(header)) != 0)
+        goto write_failed;
+
+    int level = odb_compression_level();
+    uint64_t raw_bytes = 0;
+    size_t deltas = 0;
+    size_t deepest = 0;
+    for (size_t i = 0; i < list.count; i++)
+    {
+        pack_object_t *object = &objects[i];
+        offsets[i] = w.offset;
+        raw_bytes += object->size;
+
+        if (object->delta)
+        {
+            deltas++;
+            if (object->depth > objects[deepest].depth)
+                deepest = i;
+            if (pack_emit_entry(&w, PACK_REF_DELTA, objects[object->base].id.hash,
+                                object->delta, object->delta_size, level) != 0)
+                goto write_failed;
+            continue;
+        }
+
+        odb_object_t mapped;
+        if (odb_map(&object->id, &mapped) != 0)
+        {
+            fprintf(stderr, "Error: Failed to read object %s\n", oid_hex(&object->id));
+            goto fail;
+        }
+
+        int result = pack_emit_entry(&w, mapped.type + 1, NULL, mapped.data, mapped.size, level);
+        odb_unmap(&mapped);
+        if (result != 0)
+            goto write_failed;
+    }
+
+    object_id_t checksum;
+    unsigned int hash_len;
+    if (!EVP_DigestFinal_ex(w.ctx, checksum.hash, &hash_len) ||
+        pack_emit(&w, checksum.hash, SHA256_SIZE) != 0)
+        goto write_failed;
+
+    fchmod(w.fd, 0444);
+    if (odb_sync_written(w.fd) != 0 || close(w.fd) != 0)
+    {
+        w.fd = -1;
+        goto write_failed;
+    }
+    w.fd = -1;
+
+    char checksum_hex[HEX_SIZE];
+    oid_to_hex(&checksum, checksum_hex);
+
+    char pack_path[PATH_MAX];
+    char idx_path[PATH_MAX];
+    snprintf(pack_path, sizeof(pack_path), "%s/pack-%s.pack", PACK_DIR, checksum_hex);
+    snprintf(idx_path, sizeof(idx_path), "%s/pack-%s.idx", PACK_DIR, checksum_hex);
+
+    // The .idx makes a pack visible, so it goes in last
+    if (rename(temp_path, pack_path) != 0 ||
+        write_idx(idx_path, list.ids, offsets, list.count, checksum.hash) != 0)
+    {
+        fprintf(stderr, "Error: Failed to install pack '%s'\n", pack_path);
+        unlink(temp_path);
+        goto fail;
+    }
+
+    // The new pack must be durable before the copies it replaces go away:
+    // its content through the barrier, the renames of the .pack and .idx
+    // (and a new pack directory) through their directories
+    if (odb_sync_barrier() != 0)
+        goto fail;
+    if (odb_fsync_mode() != ODB_FSYNC_NONE &&
+        (sync_directory(PACK_DIR) != 0 || (new_pack_dir && sync_directory(ODB_OBJECTS_DIR) != 0)))
+        goto fail;
+
+    // Drop the packs this one supersedes, then reload so only it is visible
+    for (size_t i = 0; i < pack_count; i++)
+    {
+        if (strcmp(packs[i].path, pack_path) == 0)
+            continue;
+
+        char old_idx[PATH_MAX];
+        snprintf(old_idx, sizeof(old_idx), "%.*s.idx", (int)(strlen(packs[i].path) - 5), packs[i].path);
+        unlink(old_idx);
+        unlink(packs[i].path);
+    }
+    packs_unload();
+
+    odb_for_each_loose_object(prune_loose_object, NULL);
+
+    printf("Packed %zu objects (%zu deltas) into %s\n", list.count, deltas, pack_path);
+    printf("Size: %llu bytes, %llu uncompressed (ratio %.2f)\n",
+           (unsigned long long)w.offset, (unsigned long long)raw_bytes,
+           w.offset ? (double)raw_bytes / w.offset : 0.0);
+
+    if (deltas > 0)
+    {
+        const char *hash = oid_hex(&objects[deepest].id);
+
+        struct timespec start, end;
+        odb_object_t object;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (odb_map(&objects[deepest].id, &object) == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            odb_unmap(&object);
+            printf("Deepest delta chain: %d (%s, reconstructed in %.3f ms)\n",
+                   objects[deepest].depth, hash,
+                   (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        }
+    }
+
+    EVP_MD_CTX_free(w.ctx);
+    free(offsets);
+    free_pack_objects(objects, list.count, hints);
+    free(list.ids);
+    return 0;
+
+write_failed:
+    fprintf(stderr, "Error: Failed to write pack file: %s\n", strerror(errno));
+fail:
+    if (w.fd >= 0)
+    {
+        close(w.fd);
+        unlink(temp_path);
+    }
+    EVP_MD_CTX_free(w.ctx);
+    free(offsets);
+    free_pack_objects(objects, list.count, hints);
+    free(list.ids);
+    return -1;
+}
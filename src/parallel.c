@@ -0,0 +1,64 @@
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Threads started per call beyond the caller; more than this is never useful
+#define PARALLEL_MAX_THREADS 64
+
+static size_t thread_count = 0; // 0 until picked
+
+typedef struct
+{
+    size_t count;
+    size_t next; // taken with an atomic add
+    void (*fn)(size_t index, void *ctx);
+    void *ctx;
+} parallel_job_t;
+
+size_t parallel_threads(void)
+{
+    if (thread_count == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (size_t)cpus : 1;
+        if (thread_count > PARALLEL_MAX_THREADS)
+            thread_count = PARALLEL_MAX_THREADS;
+    }
+    return thread_count;
+}
+
+void parallel_set_threads(size_t threads)
+{
+    if (threads > PARALLEL_MAX_THREADS)
+        threads = PARALLEL_MAX_THREADS;
+    thread_count = threads;
+}
+
+static void *run_worker(void *arg)
+{
+    parallel_job_t *job = arg;
+    size_t index;
+    while ((index = __sync_fetch_and_add(&job->next, 1)) < job->count)
+        job->fn(index, job->ctx);
+    return NULL;
+}
+
+void parallel_for(size_t count, void (*fn)(size_t index, void *ctx), void *ctx)
+{
+    parallel_job_t job = {count, 0, fn, ctx};
+    size_t threads = parallel_threads();
+    if (threads > count)
+        threads = count;
+
+    pthread_t workers[PARALLEL_MAX_THREADS];
+    size_t started = 0;
+    while (started + 1 < threads && pthread_create(&workers[started], NULL, run_worker, &job) == 0)
+        started++;
+
+    // The caller works too, so a failed thread start only costs speed
+    run_worker(&job);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+}
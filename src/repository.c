@@ -1,8 +1,19 @@
 #include "repository.h"
 #include "object.h"
+#include "object_types.h"
 #include "staging.h"
 #include "config.h"
 #include "tree_diff.h"
+#include "odb.h"
+#include "object_cache.h"
+#include "pack.h"
+#include "fsck.h"
+#include "commit_graph.h"
+#include "chunk.h"
+#include "hash.h"
+#include "parallel.h"
+#include "tree_iter.h"
+#include "util.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -11,6 +22,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <dirent.h>
+#include <time.h>
 #include <utarray.h>
 #include <uthash.h>
 
@@ -27,11 +39,13 @@ struct repository
     char index_path[VCS_PATH_MAX];
     char head_ref[VCS_NAME_MAX];
     char branch_name[VCS_NAME_MAX];
-    char recent_commit[HEX_SIZE];
+    object_id_t recent_commit; // null before the first commit
     int initialized;
 };
 
 
+static int read_config_value(const char *key, char *out_value, size_t max_len);
+
 static const char *REPO_DIRS[] = {
     "objects",
     "refs",
@@ -39,20 +53,6 @@ static const char *REPO_DIRS[] = {
     "refs/tags",
     NULL};
 
-static int create_directory(const char *dir)
-{
-    struct stat st = {0};
-    if (stat(dir, &st) == -1)
-    {
-        if (mkdir(dir, 0755) != 0)
-        {
-            fprintf(stderr, "Error creating directory %s: %s\n", dir, strerror(errno));
-            return -1;
-        }
-    }
-    return 0;
-}
-
 static int init_repository_dirs(const char *vcsdir)
 {
     // Create main .vcs dir
@@ -97,6 +97,31 @@ static int init_head_file(const char *vcsdir)
     return 0;
 }
 
+// The object format is fixed for the life of the repository, so it is
+// recorded before anything is hashed
+static int init_config_file(const char *vcsdir, hash_algo_t algo)
+{
+    char config_path[VCS_PATH_MAX];
+    snprintf(config_path, sizeof(config_path), "%s/config", vcsdir);
+
+    FILE *fp = fopen(config_path, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "Error creating config file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (fprintf(fp, "core.objectFormat=%s\n", hash_algo_name(algo)) < 0)
+    {
+        fprintf(stderr, "Error writing to config file: %s\n", strerror(errno));
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
 static repository_t *repository_alloc(const char *path)
 {
     repository_t *repo = malloc(sizeof(repository_t));
@@ -131,8 +156,15 @@ static int init_master_branch(const char *vcsdir)
     return 0;
 }
 
-repository_t *repository_init()
+repository_t *repository_init(const char *object_format)
 {
+    hash_algo_t algo = HASH_SHA256;
+    if (object_format && hash_algo_from_name(object_format, &algo) != 0)
+    {
+        fprintf(stderr, "Error: Unknown object format '%s'\n", object_format);
+        return NULL;
+    }
+
     repository_t *repo = repository_alloc(".");
     if (!repo)
         return NULL;
@@ -153,6 +185,13 @@ repository_t *repository_init()
         return NULL;
     }
 
+    if (init_config_file(repo->vcsdir, algo) != 0)
+    {
+        repository_free(repo);
+        return NULL;
+    }
+    hash_set_algo(algo);
+
     // Initialize HEAD file
     if (init_head_file(repo->vcsdir) != 0)
     {
@@ -170,7 +209,7 @@ repository_t *repository_init()
     // Set HEAD and branch name
     strncpy(repo->head_ref, HEAD_REF, VCS_NAME_MAX - 1);
     strncpy(repo->branch_name, "master", VCS_NAME_MAX - 1);
-    memset(repo->recent_commit, 0, HEX_SIZE);
+    oid_clear(&repo->recent_commit);
 
     printf("Initialized empty repository in %s\n", repo->vcsdir);
     return repo;
@@ -184,21 +223,15 @@ static int load_latest_commit(repository_t *repo) {
     FILE *fp = fopen(branch_path, "r");
     if (!fp) {
         // No commits yet - no file
-        memset(repo->recent_commit, 0, HEX_SIZE);
+        oid_clear(&repo->recent_commit);
         return 0;
     }
 
-    // Check if file is empty
-    if (fgets(repo->recent_commit, HEX_SIZE, fp) == NULL || 
-        repo->recent_commit[0] == '\0') {
-        // No commits yet - empty file
-        memset(repo->recent_commit, 0, HEX_SIZE);
-        fclose(fp);
-        return 0;
+    // An empty or unreadable ref also means no commits yet
+    char hex[HEX_SIZE] = {0};
+    if (fgets(hex, sizeof(hex), fp) == NULL || oid_from_hex(hex, &repo->recent_commit) != 0) {
+        oid_clear(&repo->recent_commit);
     }
-
-    // Remove newline
-    repo->recent_commit[strcspn(repo->recent_commit, "\n")] = 0;
     fclose(fp);
     return 0;
 }
@@ -258,6 +291,59 @@ repository_t *repository_open()
         repository_free(repo);
         return NULL;
     }
+
+    char value[128];
+    if (read_config_value("core.objectFormat", value, sizeof(value)) == 0)
+    {
+        // Ids from another hash cannot be read back, so there is no fallback
+        hash_algo_t algo;
+        if (hash_algo_from_name(value, &algo) != 0)
+        {
+            fprintf(stderr, "Error: Unsupported core.objectFormat '%s'\n", value);
+            repository_free(repo);
+            return NULL;
+        }
+        hash_set_algo(algo);
+    }
+    if (read_config_value("core.threads", value, sizeof(value)) == 0)
+    {
+        // 0 uses every online CPU
+        parallel_set_threads((size_t)strtoul(value, NULL, 10));
+    }
+    if (read_config_value("core.compression", value, sizeof(value)) == 0)
+    {
+        odb_set_compression_level(atoi(value));
+    }
+    if (read_config_value("core.fsync", value, sizeof(value)) == 0)
+    {
+        if (strcmp(value, "none") == 0)
+            odb_set_fsync_mode(ODB_FSYNC_NONE);
+        else if (strcmp(value, "batch") == 0)
+            odb_set_fsync_mode(ODB_FSYNC_BATCH);
+        else if (strcmp(value, "object") == 0)
+            odb_set_fsync_mode(ODB_FSYNC_OBJECT);
+        else
+            fprintf(stderr, "Warning: Unknown core.fsync '%s', using batch\n", value);
+    }
+    if (read_config_value("core.objectCacheLimit", value, sizeof(value)) == 0)
+    {
+        // In MiB; 0 turns the parsed-object cache off
+        object_cache_set_limit((size_t)strtoul(value, NULL, 10) * 1024 * 1024);
+    }
+    if (read_config_value("core.chunkThreshold", value, sizeof(value)) == 0)
+    {
+        // In MiB; files this large are split into content-defined chunks
+        chunk_set_threshold((size_t)strtoul(value, NULL, 10) * 1024 * 1024);
+    }
+    if (read_config_value("core.splitIndex", value, sizeof(value)) == 0 && strcmp(value, "true") == 0)
+    {
+        // Percent of the shared index's entries that may change before it
+        // is written again
+        unsigned int max_change = 20;
+        if (read_config_value("splitIndex.maxPercentChange", value, sizeof(value)) == 0)
+            max_change = (unsigned int)strtoul(value, NULL, 10);
+        index_set_split(1, max_change);
+    }
     repo->initialized = 1;
     return repo;
 }
@@ -338,6 +424,11 @@ static int parse_file_args(int argc, char **argv, UT_array *arr)
         {
             add_file(arr, argv[i]);
         }
+        else if (access(argv[i], F_OK) != 0 && errno == ENOENT)
+        {
+            // Staging removes it from the index if it was tracked
+            add_file(arr, argv[i]);
+        }
         else
         {
             fprintf(stderr, "Error: '%s' is not a valid file or directory\n", argv[i]);
@@ -348,9 +439,35 @@ static int parse_file_args(int argc, char **argv, UT_array *arr)
     return 0;
 }
 
-int repository_add(repository_t *repo, int size, char **files)
+// The index mirrors HEAD between commits. A repository with commits but
+// no index file, as older versions left it after every commit, gets one
+// read from HEAD's tree, so what is committed next still has every file.
+static index_t *open_index(repository_t *repo)
 {
     index_t *index = index_init(repo->index_path);
+    if (!index || index->map || oid_is_null(&repo->recent_commit))
+    {
+        return index;
+    }
+
+    object_id_t tree_oid;
+    if (commit_graph_read_commit(&repo->recent_commit, &tree_oid, NULL) != 0 ||
+        index_read_tree(index, &tree_oid) != 0)
+    {
+        fprintf(stderr, "Error: Failed to read the index from HEAD\n");
+        index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+int repository_add(repository_t *repo, int size, char **files)
+{
+    index_t *index = open_index(repo);
+    if (!index)
+    {
+        return -1;
+    }
     UT_array *arr;
     utarray_new(arr, &ut_str_icd);
 
@@ -368,29 +485,29 @@ int repository_add(repository_t *repo, int size, char **files)
 
     utarray_free(arr);
     index_free(index);
+    chunk_report();
     return 0;
 }
 
-static int update_branch_ref(repository_t *repo, const char *commit_hash)
+// Refs are replaced atomically and, unless core.fsync is none, only after
+// the objects they point at are durable
+static int update_branch_ref(repository_t *repo, const object_id_t *commit_oid)
 {
     char branch_path[VCS_PATH_MAX];
     snprintf(branch_path, sizeof(branch_path), "%s/refs/heads/%s", repo->vcsdir, repo->branch_name);
 
-    FILE *fp = fopen(branch_path, "w");
-    if (!fp)
+    if (odb_sync_barrier() != 0)
     {
-        fprintf(stderr, "Error opening branch file: %s\n", strerror(errno));
         return -1;
     }
 
-    if (fprintf(fp, "%s\n", commit_hash) < 0)
+    char line[HEX_SIZE + 1];
+    int len = snprintf(line, sizeof(line), "%s\n", oid_hex(commit_oid));
+    if (write_file_atomic(branch_path, line, len, odb_fsync_mode() != ODB_FSYNC_NONE) != 0)
     {
-        fprintf(stderr, "Error writing to branch file: %s\n", strerror(errno));
-        fclose(fp);
+        fprintf(stderr, "Error writing to branch file '%s'\n", branch_path);
         return -1;
     }
-
-    fclose(fp);
     return 0;
 }
 
@@ -399,35 +516,17 @@ static int update_head(repository_t *repo, const char *branch)
     char head_path[VCS_PATH_MAX];
     snprintf(head_path, sizeof(head_path), "%s/%s", repo->vcsdir, HEAD_FILE);
 
-    FILE *fp = fopen(head_path, "w");
-    if (!fp)
-    {
-        fprintf(stderr, "Error opening HEAD file: %s\n", strerror(errno));
-        return -1;
-    }
-
     // Store symbolic ref
-    if (fprintf(fp, "ref: refs/heads/%s\n", branch) < 0)
-    {
-        fprintf(stderr, "Error writing to HEAD file: %s\n", strerror(errno));
-        fclose(fp);
-        return -1;
-    }
-
-    fclose(fp);
-    return 0;
-}
-static int reset_index(repository_t *repo)
-{
-    if (unlink(repo->index_path) != 0)
+    char line[VCS_NAME_MAX + 32];
+    int len = snprintf(line, sizeof(line), "ref: refs/heads/%s\n", branch);
+    if (write_file_atomic(head_path, line, len, odb_fsync_mode() != ODB_FSYNC_NONE) != 0)
     {
-        fprintf(stderr, "Error: Failed to delete index file '%s': %s\n", repo->index_path, strerror(errno));
+        fprintf(stderr, "Error writing to HEAD file '%s'\n", head_path);
         return -1;
     }
     return 0;
 }
-
-static int write_tree(repository_t *repo, index_t *index, char *out_tree_hash)
+static int write_tree(repository_t *repo, index_t *index, object_id_t *out_tree_oid)
 {
     object_t *tree = object_init(OBJ_TREE);
     if (!tree)
@@ -446,7 +545,7 @@ static int write_tree(repository_t *repo, index_t *index, char *out_tree_hash)
         return -1;
     }
 
-    if (object_write(tree, out_tree_hash) != 0)
+    if (object_write(tree, out_tree_oid) != 0)
     {
         fprintf(stderr, "Error: Failed to write object\n");
         object_free(tree);
@@ -519,11 +618,11 @@ static int get_user_info(const char *name_var, const char *email_var,
 
     return 0;
 }
-static int write_commit(repository_t *repo, const char *tree_hash, const char *message, char *out_commit_hash)
+static int write_commit(repository_t *repo, const object_id_t *tree_oid, const char *message,
+                        time_t now, object_id_t *out_commit_oid)
 {
     char author_name[100], author_email[100];
     char committer_name[100], committer_email[100];
-    time_t now = time(NULL);
 
     if (get_user_info("VCS_AUTHOR_NAME", "VCS_AUTHOR_EMAIL",
                       author_name, author_email) != 0)
@@ -542,8 +641,8 @@ static int write_commit(repository_t *repo, const char *tree_hash, const char *m
 
     object_update_t data = {
         .commit = {
-            .tree_hash = tree_hash,
-            .parent_hash = repo->recent_commit,
+            .tree = tree_oid,
+            .parent = oid_is_null(&repo->recent_commit) ? NULL : &repo->recent_commit,
             .message = message,
             .author_name = author_name,
             .author_email = author_email,
@@ -566,7 +665,7 @@ static int write_commit(repository_t *repo, const char *tree_hash, const char *m
         return -1;
     }
 
-    if (object_write(commit, out_commit_hash) != 0)
+    if (object_write(commit, out_commit_oid) != 0)
     {
         fprintf(stderr, "Error: Failed to write object\n");
         object_free(commit);
@@ -578,38 +677,48 @@ static int write_commit(repository_t *repo, const char *tree_hash, const char *m
 
 int repository_commit(repository_t *repo, const char *message)
 {
-    index_t *index = index_init(repo->index_path);
+    index_t *index = open_index(repo);
     if (!index)
     {
         printf("Error: Failed to load index\n");
         return -1;
     }
 
-    char tree_hash[HEX_SIZE];
-    if (write_tree(repo, index, tree_hash) != 0)
+    object_id_t tree_oid;
+    if (write_tree(repo, index, &tree_oid) != 0)
     {
         printf("Error: Failed to write tree object\n");
         return -1;
     }
 
-    char commit_hash[HEX_SIZE];
-    if (write_commit(repo, tree_hash, message, commit_hash) != 0)
+    object_id_t commit_oid;
+    time_t now = time(NULL);
+    if (write_commit(repo, &tree_oid, message, now, &commit_oid) != 0)
     {
         printf("Error: Failed to write commit object\n");
         return -1;
     }
 
-    if (update_branch_ref(repo, commit_hash) != 0)
+    if (update_branch_ref(repo, &commit_oid) != 0)
     {
         printf("Error: Failed to update branch ref\n");
         return -1;
     }
 
+    // The commit stands without it; walks fall back to parsing commits
+    if (commit_graph_add(&commit_oid, &tree_oid, &repo->recent_commit, now) != 0)
+    {
+        fprintf(stderr, "Warning: Commit graph not updated, run 'vcs commit-graph'\n");
+    }
+
     printf("Committed %d files\n", index->header.entry_count);
 
-    if (reset_index(repo) != 0)
+    // The index is kept, stat data and all, as the new HEAD's mirror, and
+    // written out with the directories' tree ids the commit just settled
+    if (index_write(index) != 0)
     {
-        printf("Error: Failed to reset index\n");
+        printf("Error: Failed to write index\n");
+        index_free(index);
         return -1;
     }
 
@@ -624,19 +733,211 @@ int repository_status(repository_t *repo)
         fprintf(stderr, "Error: Repository not initialized\n");
         return -1;
     }
-    index_t *index = index_init(repo->index_path);
+    index_t *index = open_index(repo);
+    if (!index) {
+        return -1;
+    }
     diff_t *diff = diff_init();
-    walk_working_dir(".", diff);
+    walk_working_dir(".", diff, index);
 
-    if (repo->recent_commit[0] != '\0') {
-        walk_commit_tree(repo->recent_commit, diff);
-    }
     if (index->header.entry_count > 0) {
         walk_staging(index, diff);
     }
+    // What is staged is the index against HEAD; only the directories the
+    // cache tree no longer vouches for are read from HEAD
+    if (!oid_is_null(&repo->recent_commit)) {
+        walk_commit_tree(&repo->recent_commit, diff, index_cache_tree(index));
+    }
   
     diff_print(diff);
 
     diff_free(diff);
+    index_free(index);
+    return 0;
+}
+
+// Walks first parents from HEAD. Each commit is parsed into the same stack
+// struct straight from the object store's mapping, so the walk does not
+// allocate per commit. With oneline, each commit is its shortest unique id
+// and the first line of its message.
+int repository_log(repository_t *repo, int oneline)
+{
+    if (!repo->initialized)
+    {
+        fprintf(stderr, "Error: Repository not initialized\n");
+        return -1;
+    }
+
+    object_id_t oid = repo->recent_commit;
+
+    commit_data_t commit;
+    while (!oid_is_null(&oid))
+    {
+        if (object_read_commit(&oid, &commit) != 0)
+        {
+            return -1;
+        }
+
+        if (oneline)
+        {
+            char hex[HEX_SIZE];
+            oid_to_hex(&oid, hex);
+            int len = (int)odb_abbrev_len(&oid, ODB_ABBREV_DEFAULT);
+            printf("%.*s %.*s\n", len, hex, (int)strcspn(commit.message, "\n"), commit.message);
+            oid = commit.parent;
+            continue;
+        }
+
+        char date[64];
+        struct tm tm;
+        strftime(date, sizeof(date), "%a %b %d %H:%M:%S %Y", localtime_r(&commit.author.time, &tm));
+
+        printf("commit %s\n", oid_hex(&oid));
+        printf("Author: %s <%s>\n", commit.author.name, commit.author.email);
+        printf("Date:   %s\n\n", date);
+        printf("    %s\n\n", commit.message);
+
+        oid = commit.parent;
+    }
+
     return 0;
-}
\ No newline at end of file
+}
+
+int repository_commit_graph(repository_t *repo)
+{
+    if (!repo->initialized)
+    {
+        fprintf(stderr, "Error: Repository not initialized\n");
+        return -1;
+    }
+
+    return commit_graph_write();
+}
+
+int repository_repack(repository_t *repo)
+{
+    if (!repo->initialized)
+    {
+        fprintf(stderr, "Error: Repository not initialized\n");
+        return -1;
+    }
+
+    pack_options_t options = {
+        .window = PACK_DEFAULT_WINDOW,
+        .depth = PACK_DEFAULT_DEPTH,
+        .big_file_threshold = PACK_DEFAULT_BIG_FILE_THRESHOLD};
+
+    char value[128];
+    if (read_config_value("pack.window", value, sizeof(value)) == 0)
+    {
+        options.window = atoi(value);
+    }
+    if (read_config_value("pack.depth", value, sizeof(value)) == 0)
+    {
+        options.depth = atoi(value);
+        if (options.depth > PACK_MAX_DEPTH)
+        {
+            fprintf(stderr, "Warning: pack.depth %d is above the limit, using %d\n", options.depth, PACK_MAX_DEPTH);
+            options.depth = PACK_MAX_DEPTH;
+        }
+    }
+    if (read_config_value("pack.bigFileThreshold", value, sizeof(value)) == 0)
+    {
+        // In MiB, like core.chunkThreshold
+        options.big_file_threshold = (size_t)strtoul(value, NULL, 10) * 1024 * 1024;
+    }
+
+    return pack_repack(&options);
+}
+
+int repository_fsck(repository_t *repo)
+{
+    if (!repo->initialized)
+    {
+        fprintf(stderr, "Error: Repository not initialized\n");
+        return -1;
+    }
+
+    return fsck_run(&repo->recent_commit);
+}
+
+static int print_tree(const object_id_t *oid)
+{
+    object_t *tree = object_lookup(oid, OBJ_TREE);
+    if (!tree)
+    {
+        return -1;
+    }
+
+    const tree_data_t *data = (const tree_data_t *)tree->data;
+    tree_iter_t iter;
+    tree_entry_view_t entry;
+    int result;
+    tree_iter_init(&iter, data->raw, data->raw_size);
+    while ((result = tree_iter_next(&iter, &entry)) > 0)
+    {
+        printf("%06o %s %s\t%.*s\n", (unsigned int)entry.mode, S_ISDIR(entry.mode) ? "tree" : "blob",
+               oid_hex(&entry.oid), (int)entry.name_len, entry.name);
+    }
+    object_free(tree);
+    return result;
+}
+
+int repository_cat_file(repository_t *repo, const char *option, const char *object)
+{
+    if (!repo->initialized)
+    {
+        fprintf(stderr, "Error: Repository not initialized\n");
+        return -1;
+    }
+
+    // Ambiguous prefixes are reported with their candidates
+    object_id_t oid;
+    int resolved = odb_resolve_abbrev(object, &oid);
+    if (resolved != 0)
+    {
+        if (resolved == 1)
+            fprintf(stderr, "Error: Not a valid object name '%s'\n", object);
+        return -1;
+    }
+
+    object_type_t type;
+    size_t size;
+    if (odb_object_info(&oid, &type, &size) != 0)
+    {
+        return -1;
+    }
+
+    if (strcmp(option, "-t") == 0)
+    {
+        printf("%s\n", object_type_to_string(type));
+        return 0;
+    }
+    if (strcmp(option, "-s") == 0)
+    {
+        // A chunked file is as big as the content it lists
+        if (type == OBJ_CHUNKS && chunk_content_size(&oid, &size) != 0)
+            return -1;
+        printf("%zu\n", size);
+        return 0;
+    }
+    if (strcmp(option, "-p") == 0 && type == OBJ_TREE)
+    {
+        return print_tree(&oid);
+    }
+    if ((strcmp(option, "-p") == 0 || strcmp(option, "blob") == 0) && type == OBJ_CHUNKS)
+    {
+        // A chunked file reads back as the blob it stands for
+        fflush(stdout);
+        return chunk_stream(&oid, STDOUT_FILENO);
+    }
+    if (strcmp(option, "-p") != 0 && strcmp(option, object_type_to_string(type)) != 0)
+    {
+        fprintf(stderr, "Error: Object %s is a %s, not a %s\n", object, object_type_to_string(type), option);
+        return -1;
+    }
+
+    // Content goes straight to the descriptor, past stdio's buffer
+    fflush(stdout);
+    return odb_stream(&oid, STDOUT_FILENO);
+}
@@ -0,0 +1,335 @@
+#include "sha256_mb.h"
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SHA256_MB_AVX2 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define SHA256_BLOCK 64
+#define SHA256_LANES 8
+
+// With SHA-NI, OpenSSL hashes one message faster than eight lanes share a
+// block once messages pass about this size
+#define SHA256_MB_NI_CUTOFF 1024
+
+typedef enum
+{
+    ENGINE_UNKNOWN,
+    ENGINE_OPENSSL,
+    ENGINE_AVX2
+} engine_t;
+
+static engine_t engine = ENGINE_UNKNOWN;
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+static size_t lane_limit = (size_t)-1; // longest message worth a SIMD lane
+
+static size_t message_size(const sha256_job_t *job)
+{
+    return job->prefix_len + job->size;
+}
+
+// Hashes the jobs longer than min_size, one at a time
+static int hash_openssl(sha256_job_t *jobs, size_t count, size_t min_size)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    const EVP_MD *md = EVP_sha256();
+    if (!ctx)
+        return -1;
+
+    int result = 0;
+    for (size_t i = 0; i < count && result == 0; i++)
+    {
+        unsigned int len;
+        if (min_size > 0 && message_size(&jobs[i]) <= min_size)
+            continue;
+        if (!EVP_DigestInit_ex(ctx, md, NULL) ||
+            !EVP_DigestUpdate(ctx, jobs[i].prefix, jobs[i].prefix_len) ||
+            !EVP_DigestUpdate(ctx, jobs[i].data, jobs[i].size) ||
+            !EVP_DigestFinal_ex(ctx, jobs[i].digest, &len))
+            result = -1;
+    }
+    EVP_MD_CTX_free(ctx);
+    return result;
+}
+
+#ifdef SHA256_MB_AVX2
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+typedef struct
+{
+    sha256_job_t *job;
+    size_t block;
+    size_t blocks;
+    unsigned char scratch[SHA256_BLOCK];
+} lane_t;
+
+static size_t message_blocks(const sha256_job_t *job)
+{
+    // Content, the 0x80 marker and the 64-bit length
+    return (message_size(job) + 9 + SHA256_BLOCK - 1) / SHA256_BLOCK;
+}
+
+// The lane's next 64 bytes of padded message; whole blocks of content are
+// read in place and only the edges are assembled in scratch
+static const unsigned char *lane_block(lane_t *lane)
+{
+    const sha256_job_t *job = lane->job;
+    size_t start = lane->block * SHA256_BLOCK;
+    size_t total = message_size(job);
+    if (start >= job->prefix_len && start + SHA256_BLOCK <= total)
+        return job->data + (start - job->prefix_len);
+
+    unsigned char *out = lane->scratch;
+    memset(out, 0, SHA256_BLOCK);
+    for (size_t i = 0; i < SHA256_BLOCK; i++)
+    {
+        size_t pos = start + i;
+        if (pos < job->prefix_len)
+            out[i] = job->prefix[pos];
+        else if (pos < total)
+            out[i] = job->data[pos - job->prefix_len];
+        else
+        {
+            if (pos == total)
+                out[i] = 0x80;
+            break;
+        }
+    }
+
+    if (lane->block == lane->blocks - 1)
+    {
+        uint64_t bits = (uint64_t)total * 8;
+        for (int i = 0; i < 8; i++)
+            out[SHA256_BLOCK - 1 - i] = (unsigned char)(bits >> (i * 8));
+    }
+    return out;
+}
+
+#define ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256((a), (b)), (c))
+#define ADD(a, b) _mm256_add_epi32((a), (b))
+
+// Words off..off+7 of every lane's block, transposed so that each vector
+// holds one word position for all eight lanes
+__attribute__((target("avx2"))) static void load_words(__m256i out[8], const unsigned char *const blocks[SHA256_LANES],
+                                                       int off, __m256i bswap)
+{
+    __m256i r[8], t[8], u[8];
+    for (int i = 0; i < 8; i++)
+        r[i] = _mm256_loadu_si256((const __m256i *)(blocks[i] + off));
+    for (int i = 0; i < 8; i += 2)
+    {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4)
+    {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x20), bswap);
+        out[i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x31), bswap);
+    }
+}
+
+// One block for each of eight lanes; state is [word][lane]
+__attribute__((target("avx2"))) static void compress_x8(uint32_t state[8][SHA256_LANES],
+                                                        const unsigned char *const blocks[SHA256_LANES])
+{
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i w[16];
+    load_words(w, blocks, 0, bswap);
+    load_words(w + 8, blocks, 32, bswap);
+
+    __m256i s[8];
+    for (int i = 0; i < 8; i++)
+        s[i] = _mm256_loadu_si256((const __m256i *)state[i]);
+
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int t = 0; t < 64; t++)
+    {
+        if (t >= 16)
+        {
+            __m256i w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+            __m256i s0 = XOR3(ROTR(w15, 7), ROTR(w15, 18), _mm256_srli_epi32(w15, 3));
+            __m256i s1 = XOR3(ROTR(w2, 17), ROTR(w2, 19), _mm256_srli_epi32(w2, 10));
+            w[t & 15] = ADD(ADD(w[t & 15], s0), ADD(w[(t - 7) & 15], s1));
+        }
+
+        __m256i s1 = XOR3(ROTR(e, 6), ROTR(e, 11), ROTR(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1 = ADD(ADD(ADD(h, s1), ADD(ch, _mm256_set1_epi32((int)K[t]))), w[t & 15]);
+        __m256i s0 = XOR3(ROTR(a, 2), ROTR(a, 13), ROTR(a, 22));
+        __m256i maj = XOR3(_mm256_and_si256(a, b), _mm256_and_si256(a, c), _mm256_and_si256(b, c));
+        __m256i t2 = ADD(s0, maj);
+
+        h = g;
+        g = f;
+        f = e;
+        e = ADD(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = ADD(t1, t2);
+    }
+
+    __m256i out[8] = {a, b, c, d, e, f, g, h};
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i *)state[i], ADD(s[i], out[i]));
+}
+
+static void lane_start(lane_t *lane, uint32_t state[8][SHA256_LANES], int index, sha256_job_t *job)
+{
+    lane->job = job;
+    lane->block = 0;
+    lane->blocks = message_blocks(job);
+    for (int i = 0; i < 8; i++)
+        state[i][index] = IV[i];
+}
+
+// Next job at or after *next that fits a lane, or NULL
+static sha256_job_t *next_lane_job(sha256_job_t *jobs, size_t count, size_t *next)
+{
+    while (*next < count)
+    {
+        sha256_job_t *job = &jobs[(*next)++];
+        if (message_size(job) <= lane_limit)
+            return job;
+    }
+    return NULL;
+}
+
+// Hashes the jobs no longer than lane_limit
+static void hash_avx2(sha256_job_t *jobs, size_t count)
+{
+    static const unsigned char idle[SHA256_BLOCK];
+    uint32_t state[8][SHA256_LANES];
+    lane_t lanes[SHA256_LANES];
+    const unsigned char *blocks[SHA256_LANES];
+    size_t next = 0;
+    int active = 0;
+
+    for (int i = 0; i < SHA256_LANES; i++)
+    {
+        sha256_job_t *job = next_lane_job(jobs, count, &next);
+        lanes[i].job = NULL;
+        if (job)
+        {
+            lane_start(&lanes[i], state, i, job);
+            active++;
+        }
+    }
+
+    while (active > 0)
+    {
+        for (int i = 0; i < SHA256_LANES; i++)
+            blocks[i] = lanes[i].job ? lane_block(&lanes[i]) : idle;
+
+        compress_x8(state, blocks);
+
+        for (int i = 0; i < SHA256_LANES; i++)
+        {
+            lane_t *lane = &lanes[i];
+            if (!lane->job || ++lane->block < lane->blocks)
+                continue;
+
+            for (int word = 0; word < 8; word++)
+            {
+                uint32_t v = state[word][i];
+                lane->job->digest[word * 4] = (unsigned char)(v >> 24);
+                lane->job->digest[word * 4 + 1] = (unsigned char)(v >> 16);
+                lane->job->digest[word * 4 + 2] = (unsigned char)(v >> 8);
+                lane->job->digest[word * 4 + 3] = (unsigned char)v;
+            }
+
+            sha256_job_t *job = next_lane_job(jobs, count, &next);
+            if (job)
+            {
+                lane_start(lane, state, i, job);
+            }
+            else
+            {
+                lane->job = NULL;
+                active--;
+            }
+        }
+    }
+}
+
+static int cpu_has_sha_ni(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ebx >> 29) & 1;
+}
+
+#endif // SHA256_MB_AVX2
+
+static void pick_engine(void)
+{
+    // VCS_SHA256_ENGINE=openssl forces the fallback, for comparisons
+    const char *forced = getenv("VCS_SHA256_ENGINE");
+    engine = ENGINE_OPENSSL;
+    if (forced && strcmp(forced, "openssl") == 0)
+        return;
+#ifdef SHA256_MB_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        engine = ENGINE_AVX2;
+        if (cpu_has_sha_ni())
+            lane_limit = SHA256_MB_NI_CUTOFF;
+    }
+#endif
+}
+
+int sha256_mb(sha256_job_t *jobs, size_t count)
+{
+    pthread_once(&engine_once, pick_engine);
+
+#ifdef SHA256_MB_AVX2
+    // A lone message would leave seven lanes idle
+    if (engine == ENGINE_AVX2 && count > 1)
+    {
+        hash_avx2(jobs, count);
+        if (lane_limit == (size_t)-1)
+            return 0;
+        return hash_openssl(jobs, count, lane_limit);
+    }
+#endif
+    return hash_openssl(jobs, count, 0);
+}
+
+const char *sha256_mb_engine(void)
+{
+    pthread_once(&engine_once, pick_engine);
+    if (engine != ENGINE_AVX2)
+        return "openssl";
+    return lane_limit == (size_t)-1 ? "avx2" : "avx2+sha-ni";
+}
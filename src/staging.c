@@ -1,41 +1,520 @@
 #include "staging.h"
 #include "object.h"
+#include "object_types.h"
+#include "tree_iter.h"
+#include "odb.h"
+#include "arena.h"
+#include "chunk.h"
+#include "parallel.h"
+#include "util.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <openssl/evp.h>
+
+// Files are staged in batches spread over the worker threads. Within a
+// batch small files are read and hashed together, so the multi-buffer
+// engine sees many messages at once; larger files stream through
+// object_write one by one.
+#define STAGE_BATCH_FILES 64
+
+// On disk, after a 12-byte header of signature, version and entry count,
+// entries follow in path order. Each is ten 32-bit stat fields, the raw
+// object id and 16-bit flags, then its path: a varint count of bytes to
+// drop from the end of the previous entry's path, and the NUL-terminated
+// bytes to append. Extensions come next, each a 32-bit signature and
+// length followed by that many bytes; readers skip the ones they do not
+// know. All integers are big-endian and a SHA-256 of everything before
+// it ends the file.
+//
+// A split index file (INDEX_SPLIT_VERSION) is laid out the same way but
+// holds only the entries that differ from its shared base, a plain index
+// file named sharedindex.<checksum> next to it; an entry with mode 0
+// marks one the base has that is gone. Its LINK extension carries the
+// base's checksum and the total entry count.
+#define INDEX_HEADER_SIZE 12
+#define INDEX_ENTRY_FIXED_SIZE (10 * 4 + SHA256_SIZE + 2)
+#define INDEX_VARINT_MAX 5
+#define INDEX_LINK_SIGNATURE 0x4c494e4b // "LINK"
+#define INDEX_LINK_SIZE (SHA256_SIZE + 4)
+#define INDEX_SHARED_PREFIX "sharedindex."
+
+// Set from core.splitIndex and splitIndex.maxPercentChange
+static int split_enabled = 0;
+static unsigned int split_max_change = 20;
+
+typedef enum
+{
+    STAGE_PENDING,
+    STAGE_UNCHANGED, // stat data matches the index entry
+    STAGE_STORED,
+    STAGE_CHUNKED, // left for the calling thread
+    STAGE_MISSING, // deleted, so its entries leave the index
+    STAGE_FAILED
+} stage_state_t;
+
+typedef struct
+{
+    const char *path;
+    struct stat st;
+    object_id_t oid;
+    stage_state_t state;
+} staged_file_t;
+
+typedef struct
+{
+    const index_t *index; // looked up, never changed, by the workers
+    staged_file_t *files; // in argument order
+    size_t count;
+} stage_ctx_t;
+
+static void index_reset(index_t *index)
+{
+    index->header.signature = INDEX_SIGNATURE;
+    index->header.version = INDEX_VERSION;
+    index->header.entry_count = 0;
+}
+
+// Fills entry from its serialized form at *pos, whose path is built on
+// the previous entry's. Returns -1 if the entry is cut off or malformed.
+static int parse_entry(const unsigned char *data, size_t end, size_t *pos,
+                       const char *prev_path, size_t prev_len, index_entry_t *entry)
+{
+    const unsigned char *p = data + *pos;
+    if (end - *pos < INDEX_ENTRY_FIXED_SIZE + 2)
+        return -1;
+
+    uint32_t fields[10];
+    for (int i = 0; i < 10; i++)
+        fields[i] = get_be32(p + i * 4);
+    entry->ctime_sec = fields[0];
+    entry->ctime_nsec = fields[1];
+    entry->mtime_sec = fields[2];
+    entry->mtime_nsec = fields[3];
+    entry->dev = fields[4];
+    entry->ino = fields[5];
+    entry->mode = fields[6];
+    entry->uid = fields[7];
+    entry->gid = fields[8];
+    entry->size = fields[9];
+    memcpy(entry->oid.hash, p + 40, SHA256_SIZE);
+    entry->flags = (uint16_t)(p[40 + SHA256_SIZE] << 8 | p[41 + SHA256_SIZE]);
+
+    size_t at = *pos + INDEX_ENTRY_FIXED_SIZE;
+    size_t strip = 0;
+    int shift = 0;
+    do
+    {
+        if (at >= end || shift >= 7 * INDEX_VARINT_MAX)
+            return -1;
+        strip |= (size_t)(data[at] & 0x7f) << shift;
+        shift += 7;
+    } while (data[at++] & 0x80);
+
+    const unsigned char *suffix = data + at;
+    const unsigned char *nul = memchr(suffix, '\0', end - at);
+    if (strip > prev_len || !nul)
+        return -1;
+    size_t keep = prev_len - strip;
+    size_t suffix_len = nul - suffix;
+    if (keep + suffix_len >= PATH_MAX || keep + suffix_len == 0)
+        return -1;
+
+    memmove(entry->path, prev_path, keep);
+    memcpy(entry->path + keep, suffix, suffix_len + 1);
+    *pos = at + suffix_len + 1;
+    return 0;
+}
+
+void index_set_split(int enabled, unsigned int max_percent_change)
+{
+    split_enabled = enabled;
+    split_max_change = max_percent_change;
+}
+
+// Finds where the mapping's entries end without decoding their paths
+static int find_entries_end(index_t *index)
+{
+    size_t end = index->map_size - SHA256_SIZE;
+    size_t pos = INDEX_HEADER_SIZE;
+    for (uint32_t i = 0; i < index->file_entries; i++)
+    {
+        const unsigned char *nul = NULL;
+        if (end - pos > INDEX_ENTRY_FIXED_SIZE)
+        {
+            pos += INDEX_ENTRY_FIXED_SIZE;
+            while (pos < end && (index->map[pos] & 0x80))
+                pos++;
+            nul = pos < end ? memchr(index->map + pos + 1, '\0', end - pos - 1) : NULL;
+        }
+        if (!nul)
+        {
+            fprintf(stderr, "Error: Index '%s' has a malformed entry\n", index->filepath);
+            return -1;
+        }
+        pos = nul + 1 - index->map;
+    }
+    index->entries_end = pos;
+    return 0;
+}
+
+// The payload of the mapping's extension with that signature, or NULL
+static const unsigned char *find_extension(const index_t *index, uint32_t signature, uint32_t *out_size)
+{
+    size_t end = index->map_size - SHA256_SIZE;
+    size_t pos = index->entries_end;
+    while (end - pos >= 8)
+    {
+        uint32_t found = get_be32(index->map + pos);
+        uint32_t size = get_be32(index->map + pos + 4);
+        pos += 8;
+        if (size > end - pos)
+            break;
+        if (found == signature)
+        {
+            *out_size = size;
+            return index->map + pos;
+        }
+        pos += size;
+    }
+    return NULL;
+}
+
+// The shared base with that checksum, next to the index file
+static char *shared_index_path(const char *index_path, const unsigned char *checksum)
+{
+    object_id_t id;
+    memcpy(id.hash, checksum, SHA256_SIZE);
+    const char *slash = strrchr(index_path, '/');
+    int dir_len = slash ? (int)(slash - index_path + 1) : 0;
+    size_t size = dir_len + strlen(INDEX_SHARED_PREFIX) + HEX_SIZE;
+    char *path = malloc(size);
+    if (path)
+        snprintf(path, size, "%.*s" INDEX_SHARED_PREFIX "%s", dir_len, index_path, oid_hex(&id));
+    return path;
+}
+
+// Maps the shared base a split index file's LINK extension names
+static int open_base(index_t *index)
+{
+    uint32_t size;
+    const unsigned char *link = find_entries_end(index) == 0
+                                    ? find_extension(index, INDEX_LINK_SIGNATURE, &size)
+                                    : NULL;
+    if (!link || size != INDEX_LINK_SIZE)
+    {
+        fprintf(stderr, "Error: Index '%s' is damaged\n", index->filepath);
+        return -1;
+    }
+
+    char *path = shared_index_path(index->filepath, link);
+    if (!path || !(index->base = index_init(path)))
+    {
+        free(path);
+        return -1;
+    }
+    const index_t *base = index->base;
+    if (!base->map || base->base ||
+        memcmp(base->map + base->map_size - SHA256_SIZE, link, SHA256_SIZE) != 0)
+    {
+        fprintf(stderr, "Error: Shared index '%s' is missing or does not match\n", path);
+        free(path);
+        return -1;
+    }
+    free(path);
+    index->header.entry_count = get_be32(link + SHA256_SIZE);
+    return 0;
+}
 
 index_t *index_init(const char *filepath)
 {
     index_t *index = calloc(1, sizeof(index_t));
     index->filepath = strdup(filepath);
     index->entries = NULL;
+    index_reset(index);
 
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp)
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
     {
-        index->header.signature = INDEX_SIGNATURE;
-        index->header.version = INDEX_VERSION;
-        index->header.entry_count = 0;
+        index->entries_loaded = 1;
         return index;
     }
 
-    // Read header
-    fread(&index->header, sizeof(index_header_t), 1, fp);
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Failed to read index '%s'\n", filepath);
+        index_free(index);
+        return NULL;
+    }
 
-    // Read and hash entries
-    for (uint32_t i = 0; i < index->header.entry_count; i++)
+    const unsigned char *data = map;
+    uint32_t version = (size_t)st.st_size >= INDEX_HEADER_SIZE + SHA256_SIZE ? get_be32(data + 4) : 0;
+    if (version == 0 || get_be32(data) != INDEX_SIGNATURE ||
+        (version != INDEX_VERSION && version != INDEX_SPLIT_VERSION))
     {
-        index_hash_entry_t *entry = malloc(sizeof(index_hash_entry_t));
-        fread(&entry->entry, sizeof(index_entry_t), 1, fp);
-        strcpy(entry->path, entry->entry.path);
-        HASH_ADD_STR(index->entries, path, entry);
+        // Entries from another layout can't be read back; start empty and
+        // let the next add restage the files
+        fprintf(stderr, "Warning: Ignoring index '%s' with unsupported format\n", filepath);
+        munmap(map, st.st_size);
+        index->entries_loaded = 1;
+        return index;
     }
 
-    fclose(fp);
+    index->map = data;
+    index->map_size = st.st_size;
+    index->mtime_sec = st.st_mtimespec.tv_sec;
+    index->mtime_nsec = st.st_mtimespec.tv_nsec;
+    index->header.entry_count = index->file_entries = get_be32(data + 8);
+    if (version == INDEX_SPLIT_VERSION && open_base(index) != 0)
+    {
+        index_free(index);
+        return NULL;
+    }
     return index;
 }
 
+static void stream_init(index_stream_t *stream, const index_t *index, uint32_t count)
+{
+    stream->index = index;
+    stream->pos = INDEX_HEADER_SIZE;
+    stream->remaining = count;
+    stream->pending = 0;
+    stream->entry.path[0] = '\0';
+}
+
+void index_iter_init(index_iter_t *iter, const index_t *index)
+{
+    iter->index = index;
+    iter->next = index->entries;
+    int mapped = !index->entries_loaded;
+    stream_init(&iter->file, index, mapped ? index->file_entries : 0);
+    stream_init(&iter->base, index->base, mapped && index->base ? index->base->file_entries : 0);
+}
+
+// Decodes the stream's next entry unless one is pending. Returns 1 and
+// points *out at it, 0 after the last one and -1 on a malformed entry.
+static int stream_peek(index_stream_t *stream, const index_entry_t **out)
+{
+    *out = NULL;
+    if (!stream->pending)
+    {
+        if (stream->remaining == 0)
+            return 0;
+        // Each path is rebuilt on top of the previous one, in place
+        if (parse_entry(stream->index->map, stream->index->map_size - SHA256_SIZE, &stream->pos,
+                        stream->entry.path, strlen(stream->entry.path), &stream->entry) != 0)
+        {
+            fprintf(stderr, "Error: Index '%s' has a malformed entry\n", stream->index->filepath);
+            return -1;
+        }
+        stream->remaining--;
+        stream->pending = 1;
+    }
+    *out = &stream->entry;
+    return 1;
+}
+
+int index_iter_next(index_iter_t *iter, const index_entry_t **out)
+{
+    if (iter->index->entries_loaded)
+    {
+        if (!iter->next)
+            return 0;
+        *out = &iter->next->entry;
+        iter->next = iter->next->hh.next;
+        return 1;
+    }
+
+    for (;;)
+    {
+        const index_entry_t *own, *base;
+        if (stream_peek(&iter->file, &own) < 0 || stream_peek(&iter->base, &base) < 0)
+            return -1;
+        if (!own && !base)
+            return 0;
+
+        // The index file's entry stands in for the base's of the same path
+        int cmp = !own ? 1 : !base ? -1 : strcmp(own->path, base->path);
+        if (cmp >= 0)
+            iter->base.pending = 0;
+        if (cmp > 0)
+        {
+            *out = base;
+            return 1;
+        }
+        iter->file.pending = 0;
+        if (own->mode != 0)
+        {
+            *out = own;
+            return 1;
+        }
+        // Removed from the base; on to the next path
+    }
+}
+
+// Adds an entry for path with room for just its path and every other
+// field zeroed
+static index_hash_entry_t *index_entry_add(index_t *index, const char *path, size_t len)
+{
+    index_hash_entry_t *entry = calloc(1, offsetof(index_hash_entry_t, entry.path) + len + 1);
+    if (!entry)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    memcpy(entry->entry.path, path, len);
+    entry->entry.flags = len;
+    entry->changed = 1;
+    HASH_ADD_KEYPTR(hh, index->entries, entry->entry.path, len, entry);
+
+    // A path the shared base has, removed earlier and now back
+    index_hash_entry_t *tombstone;
+    HASH_FIND(hh, index->removed, path, len, tombstone);
+    if (tombstone)
+    {
+        HASH_DEL(index->removed, tombstone);
+        free(tombstone);
+        entry->in_base = 1;
+    }
+    return entry;
+}
+
+// Takes an entry out of the table. One the shared base has is kept as a
+// tombstone, so the split index file can record that it is gone.
+static void index_entry_remove(index_t *index, index_hash_entry_t *entry)
+{
+    HASH_DEL(index->entries, entry);
+    if (!entry->in_base)
+    {
+        free(entry);
+        return;
+    }
+    memset(&entry->entry, 0, offsetof(index_entry_t, path));
+    HASH_ADD_KEYPTR(hh, index->removed, entry->entry.path, strlen(entry->entry.path), entry);
+}
+
+static int verify_checksum(const index_t *index)
+{
+    unsigned char digest[SHA256_SIZE];
+    unsigned int digest_len;
+    size_t end = index->map_size - SHA256_SIZE;
+    if (!EVP_Digest(index->map, end, digest, &digest_len, EVP_sha256(), NULL) ||
+        memcmp(digest, index->map + end, SHA256_SIZE) != 0)
+    {
+        fprintf(stderr, "Error: Index '%s' is damaged\n", index->filepath);
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the extensions between the entries and the checksum. A cache
+// tree that cannot be read is dropped; it only saves work.
+static int read_extensions(index_t *index)
+{
+    uint32_t size;
+    const unsigned char *tree = find_extension(index, CACHE_TREE_SIGNATURE, &size);
+    if (tree && !(index->cache_tree = cache_tree_read(tree, size)))
+    {
+        fprintf(stderr, "Warning: Ignoring damaged cache tree in index '%s'\n", index->filepath);
+    }
+
+    if (!index->cache_tree && !(index->cache_tree = cache_tree_new("", 0)))
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+cache_tree_t *index_cache_tree(index_t *index)
+{
+    if (index->cache_tree)
+        return index->cache_tree;
+    if (!index->map)
+    {
+        if (!(index->cache_tree = cache_tree_new("", 0)))
+            fprintf(stderr, "Error: Memory allocation failed\n");
+        return index->cache_tree;
+    }
+
+    // Extensions start after the last entry
+    if (verify_checksum(index) != 0 || (!index->entries_end && find_entries_end(index) != 0))
+        return NULL;
+    return read_extensions(index) == 0 ? index->cache_tree : NULL;
+}
+
+// Adds a mapped file's entries to the table: a shared base's as they are,
+// then a split index file's over them
+static int load_file_entries(index_t *index, index_t *file)
+{
+    if (verify_checksum(file) != 0)
+        return -1;
+    size_t end = file->map_size - SHA256_SIZE;
+    int is_base = file != index;
+
+    // Each path is decoded on top of the previous one, then copied into an
+    // entry just big enough for it
+    index_entry_t parsed;
+    size_t pos = INDEX_HEADER_SIZE;
+    size_t prev_len = 0;
+    parsed.path[0] = '\0';
+    for (uint32_t i = 0; i < file->file_entries; i++)
+    {
+        if (parse_entry(file->map, end, &pos, parsed.path, prev_len, &parsed) != 0)
+        {
+            fprintf(stderr, "Error: Index '%s' has a malformed entry\n", file->filepath);
+            return -1;
+        }
+        prev_len = strlen(parsed.path);
+
+        index_hash_entry_t *entry = NULL;
+        if (!is_base && index->base)
+        {
+            HASH_FIND(hh, index->entries, parsed.path, prev_len, entry);
+            if (parsed.mode == 0)
+            {
+                if (entry)
+                    index_entry_remove(index, entry);
+                continue;
+            }
+        }
+        if (!entry && !(entry = index_entry_add(index, parsed.path, prev_len)))
+        {
+            return -1;
+        }
+        memcpy(&entry->entry, &parsed, offsetof(index_entry_t, path));
+        entry->in_base |= is_base;
+        entry->changed = !is_base;
+    }
+    file->entries_end = pos;
+    return 0;
+}
+
+int index_load_entries(index_t *index)
+{
+    if (index->entries_loaded)
+        return 0;
+    if ((index->base && load_file_entries(index, index->base) != 0) || load_file_entries(index, index) != 0)
+        return -1;
+    index->header.entry_count = HASH_COUNT(index->entries);
+    index->entries_loaded = 1;
+
+    // The cache tree is read before the table can change, so changes
+    // invalidate what the file said
+    return index->cache_tree ? 0 : read_extensions(index);
+}
 void index_free(index_t *index)
 {
     index_hash_entry_t *entry, *tmp;
@@ -44,49 +523,322 @@ void index_free(index_t *index)
         HASH_DEL(index->entries, entry);
         free(entry);
     }
+    HASH_ITER(hh, index->removed, entry, tmp)
+    {
+        HASH_DEL(index->removed, entry);
+        free(entry);
+    }
+    if (index->base)
+        index_free(index->base);
+    if (index->map)
+        munmap((void *)index->map, index->map_size);
+    cache_tree_free(index->cache_tree);
     free(index->filepath);
     free(index);
 }
 
-int index_write(index_t *index)
+int index_entry_matches(const index_t *index, const index_entry_t *entry, const struct stat *st)
 {
-    char temp_path[strlen(index->filepath) + 5];
-    snprintf(temp_path, PATH_MAX, "%s.tmp", index->filepath);
+    if (entry->mtime_sec != (uint32_t)st->st_mtimespec.tv_sec ||
+        entry->mtime_nsec != (uint32_t)st->st_mtimespec.tv_nsec ||
+        entry->ctime_sec != (uint32_t)st->st_ctimespec.tv_sec ||
+        entry->ctime_nsec != (uint32_t)st->st_ctimespec.tv_nsec ||
+        entry->size != (uint32_t)st->st_size || entry->ino != (uint32_t)st->st_ino ||
+        entry->dev != (uint32_t)st->st_dev || entry->mode != (uint32_t)st->st_mode ||
+        entry->uid != (uint32_t)st->st_uid || entry->gid != (uint32_t)st->st_gid)
+        return 0;
 
-    FILE *fp = fopen(temp_path, "wb");
-    if (!fp)
-        return -1;
+    return entry->mtime_sec < index->mtime_sec ||
+           (entry->mtime_sec == index->mtime_sec && entry->mtime_nsec < index->mtime_nsec);
+}
 
-    // Count entries
-    index->header.entry_count = HASH_COUNT(index->entries);
+static int entry_path_cmp(const void *a, const void *b)
+{
+    return strcmp((*(index_hash_entry_t *const *)a)->entry.path, (*(index_hash_entry_t *const *)b)->entry.path);
+}
 
-    // Write header
-    fwrite(&index->header, sizeof(index_header_t), 1, fp);
+// Appends the serialized entry at out and returns its length
+static size_t serialize_entry(unsigned char *out, const index_entry_t *entry,
+                              const char *prev_path, size_t prev_len)
+{
+    const uint32_t fields[10] = {
+        entry->ctime_sec, entry->ctime_nsec, entry->mtime_sec, entry->mtime_nsec,
+        entry->dev, entry->ino, entry->mode, entry->uid, entry->gid, entry->size};
+    for (int i = 0; i < 10; i++)
+        put_be32(out + i * 4, fields[i]);
+    memcpy(out + 40, entry->oid.hash, SHA256_SIZE);
+    out[40 + SHA256_SIZE] = entry->flags >> 8;
+    out[41 + SHA256_SIZE] = entry->flags & 0xff;
+    size_t len = INDEX_ENTRY_FIXED_SIZE;
 
-    // Write entries
-    index_hash_entry_t *entry, *tmp;
-    HASH_ITER(hh, index->entries, entry, tmp)
+    size_t common = 0;
+    while (common < prev_len && prev_path[common] == entry->path[common])
+        common++;
+    size_t strip = prev_len - common;
+    do
     {
-        fwrite(&entry->entry, sizeof(index_entry_t), 1, fp);
+        out[len++] = (strip & 0x7f) | (strip >> 7 ? 0x80 : 0);
+        strip >>= 7;
+    } while (strip);
+
+    size_t suffix_len = strlen(entry->path + common) + 1;
+    memcpy(out + len, entry->path + common, suffix_len);
+    return len + suffix_len;
+}
+
+// Entries for an index file, in path order: every one in the table, or
+// for a split index file only those that differ from the base, and the
+// tombstones of the base's removed ones
+static index_hash_entry_t **collect_entries(const index_t *index, int split, size_t *out_count)
+{
+    size_t capacity = HASH_COUNT(index->entries) + HASH_COUNT(index->removed);
+    index_hash_entry_t **list = malloc((capacity ? capacity : 1) * sizeof(index_hash_entry_t *));
+    if (!list)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
     }
 
-    fclose(fp);
-    rename(temp_path, index->filepath);
+    size_t count = 0;
+    index_hash_entry_t *entry;
+    for (entry = index->entries; entry != NULL; entry = entry->hh.next)
+    {
+        if (!split || entry->changed)
+            list[count++] = entry;
+    }
+    for (entry = split ? index->removed : NULL; entry != NULL; entry = entry->hh.next)
+    {
+        list[count++] = entry;
+    }
+
+    // Sorted paths share long prefixes with their predecessors. Sorting an
+    // array of pointers with qsort is far faster than HASH_SORT's merge
+    // sort over the hash's linked list.
+    qsort(list, count, sizeof(index_hash_entry_t *), entry_path_cmp);
+    *out_count = count;
+    return list;
+}
+
+// Serializes the entries after a header, leaving extra bytes free at the
+// end of the buffer
+static unsigned char *serialize_entries(index_hash_entry_t **list, size_t count, uint32_t version,
+                                        size_t extra, size_t *out_len)
+{
+    // Once this file is written, an entry modified in the same second could
+    // pass as older than the index. Its mtime is smudged instead, so it
+    // never matches a file and is rehashed until it is added again.
+    uint32_t now = time(NULL);
+    size_t capacity = INDEX_HEADER_SIZE + extra;
+    for (size_t i = 0; i < count; i++)
+    {
+        index_entry_t *entry = &list[i]->entry;
+        if (entry->mtime_sec >= now)
+        {
+            entry->mtime_sec = 0;
+            entry->mtime_nsec = 0;
+        }
+        capacity += INDEX_ENTRY_FIXED_SIZE + INDEX_VARINT_MAX + strlen(entry->path) + 1;
+    }
 
+    unsigned char *buf = malloc(capacity);
+    if (!buf)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+
+    put_be32(buf, INDEX_SIGNATURE);
+    put_be32(buf + 4, version);
+    put_be32(buf + 8, count);
+    size_t len = INDEX_HEADER_SIZE;
+
+    const char *prev_path = "";
+    size_t prev_len = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        len += serialize_entry(buf + len, &list[i]->entry, prev_path, prev_len);
+        prev_path = list[i]->entry.path;
+        prev_len = strlen(prev_path);
+    }
+
+    *out_len = len;
+    return buf;
+}
+
+// Whether the split index file would record more than the share of the
+// base that may change before the two are folded into a new base
+static int split_outgrown(const index_t *index)
+{
+    size_t changed = HASH_COUNT(index->removed);
+    for (const index_hash_entry_t *entry = index->entries; entry != NULL; entry = entry->hh.next)
+        changed += entry->changed;
+    return changed * 100 > (size_t)index->base->header.entry_count * split_max_change;
+}
+
+// Writes the whole table as a new shared base, which every entry is then
+// part of
+static int write_shared_base(index_t *index)
+{
+    size_t count, len;
+    index_hash_entry_t **list = collect_entries(index, 0, &count);
+    unsigned char *buf = list ? serialize_entries(list, count, INDEX_VERSION, SHA256_SIZE, &len) : NULL;
+    free(list);
+    if (!buf)
+        return -1;
+
+    unsigned int digest_len;
+    char *path = NULL;
+    int failed = !EVP_Digest(buf, len, buf + len, &digest_len, EVP_sha256(), NULL) ||
+                 !(path = shared_index_path(index->filepath, buf + len)) ||
+                 write_file_atomic(path, buf, len + SHA256_SIZE, odb_fsync_mode() != ODB_FSYNC_NONE) != 0 ||
+                 !(index->base = index_init(path)) || !index->base->map;
+    free(buf);
+    if (failed)
+    {
+        fprintf(stderr, "Error: Failed to write shared index '%s'\n", path ? path : index->filepath);
+        free(path);
+        if (index->base)
+            index_free(index->base);
+        index->base = NULL;
+        return -1;
+    }
+    free(path);
+
+    index_hash_entry_t *entry, *tmp;
+    for (entry = index->entries; entry != NULL; entry = entry->hh.next)
+    {
+        entry->in_base = 1;
+        entry->changed = 0;
+    }
+    HASH_ITER(hh, index->removed, entry, tmp)
+    {
+        HASH_DEL(index->removed, entry);
+        free(entry);
+    }
     return 0;
 }
 
+int index_write(index_t *index)
+{
+    cache_tree_t *tree = index_cache_tree(index);
+    if (!tree)
+        return -1;
 
-static void update_index_entry(index_t *index, const char *path, const char *hash, struct stat *st)
+    // A loaded table is written split or whole as configured; once its
+    // changes outgrow the base, it becomes the new base
+    int split = index->entries_loaded ? split_enabled : index->base != NULL;
+    index_t *old_base = NULL;
+    if (index->entries_loaded && index->base && (!split || split_outgrown(index)))
+    {
+        old_base = index->base;
+        index->base = NULL;
+    }
+    if (split && !index->base && write_shared_base(index) != 0)
+    {
+        index->base = old_base;
+        return -1;
+    }
+
+    size_t tree_size = cache_tree_size(tree);
+    size_t extra = (split ? 8 + INDEX_LINK_SIZE : 0) + 8 + tree_size + SHA256_SIZE;
+
+    // Without a table the entries are as read, so their bytes are copied
+    // and only the extensions are written anew
+    unsigned char *buf;
+    size_t len;
+    if (index->entries_loaded)
+    {
+        size_t count;
+        index_hash_entry_t **list = collect_entries(index, split, &count);
+        buf = list ? serialize_entries(list, count, split ? INDEX_SPLIT_VERSION : INDEX_VERSION, extra, &len) : NULL;
+        free(list);
+        index->header.entry_count = HASH_COUNT(index->entries);
+    }
+    else
+    {
+        len = index->entries_end;
+        if ((buf = malloc(len + extra)) != NULL)
+            memcpy(buf, index->map, len);
+        else
+            fprintf(stderr, "Error: Memory allocation failed\n");
+    }
+    if (!buf)
+    {
+        if (old_base)
+            index_free(old_base);
+        return -1;
+    }
+
+    if (split)
+    {
+        const index_t *base = index->base;
+        put_be32(buf + len, INDEX_LINK_SIGNATURE);
+        put_be32(buf + len + 4, INDEX_LINK_SIZE);
+        memcpy(buf + len + 8, base->map + base->map_size - SHA256_SIZE, SHA256_SIZE);
+        put_be32(buf + len + 8 + SHA256_SIZE, index->header.entry_count);
+        len += 8 + INDEX_LINK_SIZE;
+    }
+    put_be32(buf + len, CACHE_TREE_SIGNATURE);
+    put_be32(buf + len + 4, tree_size);
+    cache_tree_write(tree, buf + len + 8);
+    len += 8 + tree_size;
+
+    unsigned int digest_len;
+    // Same durability policy as the objects the index points at
+    int failed = !EVP_Digest(buf, len, buf + len, &digest_len, EVP_sha256(), NULL) ||
+                 write_file_atomic(index->filepath, buf, len + SHA256_SIZE, odb_fsync_mode() != ODB_FSYNC_NONE) != 0;
+    free(buf);
+    if (failed)
+    {
+        fprintf(stderr, "Error: Failed to write index '%s'\n", index->filepath);
+    }
+
+    // Nothing refers to the replaced base any more, unless it came out
+    // the same
+    if (old_base)
+    {
+        if (!failed && (!index->base || strcmp(old_base->filepath, index->base->filepath) != 0))
+            unlink(old_base->filepath);
+        index_free(old_base);
+    }
+    return failed ? -1 : 0;
+}
+
+static int update_index_entry(index_t *index, const char *path, const object_id_t *oid, struct stat *st)
 {
     index_hash_entry_t *entry;
     HASH_FIND_STR(index->entries, path, entry);
 
+    int changed = !entry;
     if (!entry)
     {
-        entry = malloc(sizeof(index_hash_entry_t));
-        strcpy(entry->path, path);
-        HASH_ADD_STR(index->entries, path, entry);
+        // A file where a directory on its path used to be a file
+        for (const char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/'))
+        {
+            index_hash_entry_t *file;
+            HASH_FIND(hh, index->entries, path, slash - path, file);
+            if (file)
+            {
+                index_entry_remove(index, file);
+            }
+        }
+        if (!(entry = index_entry_add(index, path, strlen(path))))
+        {
+            return -1;
+        }
+    }
+    changed = changed || entry->entry.mode != (uint32_t)st->st_mode || !oid_equal(&entry->entry.oid, oid);
+
+    // Only the directories above a file whose tree entry changes need
+    // their trees written again
+    cache_tree_t *tree = index_cache_tree(index);
+    if (!tree)
+    {
+        return -1;
+    }
+    if (changed)
+    {
+        cache_tree_invalidate(tree, path);
     }
 
     entry->entry.ctime_sec = st->st_ctimespec.tv_sec;
@@ -99,21 +851,86 @@ static void update_index_entry(index_t *index, const char *path, const char *has
     entry->entry.uid = st->st_uid;
     entry->entry.gid = st->st_gid;
     entry->entry.size = st->st_size;
-    strcpy(entry->entry.hash, hash);
-    strcpy(entry->entry.path, path);
-    entry->entry.flags = strlen(path);
+    entry->entry.oid = *oid;
+    entry->changed = 1;
+    return 0;
 }
 
-static int write_staged_file(index_t *index, const char *filepath)
+// Also records each tree's id and file count in the cache tree node for
+// its directory, so the trees read need not be written again
+static int read_tree_recursive(index_t *index, const object_id_t *tree_oid, cache_tree_t *node)
 {
-    struct stat st;
-    if (stat(filepath, &st) != 0)
+    object_t *tree = object_lookup(tree_oid, OBJ_TREE);
+    if (!tree)
     {
-        fprintf(stderr, "Error: Cannot stat file '%s'\n", filepath);
+        fprintf(stderr, "Error: Failed to read tree %s\n", oid_hex(tree_oid));
         return -1;
     }
 
-    // Create and write blob object
+    const tree_data_t *data = (const tree_data_t *)tree->data;
+    tree_iter_t iter;
+    tree_entry_view_t view;
+    int result;
+    uint32_t count = 0;
+    tree_iter_init(&iter, data->raw, data->raw_size);
+    while ((result = tree_iter_next(&iter, &view)) > 0)
+    {
+        if (S_ISDIR(view.mode))
+        {
+            cache_tree_t *sub = cache_tree_sub(node, view.name, view.name_len, 1);
+            if (!sub || read_tree_recursive(index, &view.oid, sub) != 0)
+            {
+                object_free(tree);
+                return -1;
+            }
+            count += sub->entry_count;
+            continue;
+        }
+
+        // Files carry their full path as the name
+        if (view.name_len >= PATH_MAX)
+        {
+            result = -1;
+            break;
+        }
+        index_hash_entry_t *entry = index_entry_add(index, view.name, view.name_len);
+        if (!entry)
+        {
+            object_free(tree);
+            return -1;
+        }
+        entry->entry.mode = view.mode;
+        entry->entry.oid = view.oid;
+        count++;
+    }
+    if (result < 0)
+    {
+        fprintf(stderr, "Error: Tree %s is malformed\n", oid_hex(tree_oid));
+    }
+    else
+    {
+        node->entry_count = count;
+        node->oid = *tree_oid;
+    }
+    object_free(tree);
+    return result < 0 ? -1 : 0;
+}
+
+int index_read_tree(index_t *index, const object_id_t *tree_oid)
+{
+    cache_tree_t *tree;
+    if (index_load_entries(index) != 0 || !(tree = index_cache_tree(index)) ||
+        read_tree_recursive(index, tree_oid, tree) != 0)
+    {
+        return -1;
+    }
+    index->header.entry_count = HASH_COUNT(index->entries);
+    return 0;
+}
+
+// Streams one file into the object store through object_write
+static int write_blob(staged_file_t *file)
+{
     object_t *obj = object_init(OBJ_BLOB);
     if (!obj)
     {
@@ -122,7 +939,7 @@ static int write_staged_file(index_t *index, const char *filepath)
     }
 
     const object_update_t data = {
-        .blob = {.filepath = filepath}};
+        .blob = {.filepath = file->path}};
 
     if (object_update(obj, data) != 0)
     {
@@ -131,21 +948,150 @@ static int write_staged_file(index_t *index, const char *filepath)
         return -1;
     }
 
-    char hash[HEX_SIZE];
-    if (object_write(obj, hash) != 0)
+    if (object_write(obj, &file->oid) != 0)
     {
         fprintf(stderr, "Error: Failed to write object\n");
         object_free(obj);
         return -1;
     }
 
-    update_index_entry(index, filepath, hash, &st);
-
-    printf("Added '%s'\n", filepath);
     object_free(obj);
     return 0;
 }
 
+// Drops the entry for a deleted file, or every entry under a deleted
+// directory, and returns how many went
+static size_t remove_index_entries(index_t *index, const char *path)
+{
+    size_t len = strlen(path);
+    size_t removed = 0;
+    if (index->cache_tree)
+        cache_tree_invalidate(index->cache_tree, path);
+    index_hash_entry_t *entry, *tmp;
+    HASH_ITER(hh, index->entries, entry, tmp)
+    {
+        const char *entry_path = entry->entry.path;
+        if (strncmp(entry_path, path, len) == 0 && (entry_path[len] == '\0' || entry_path[len] == '/'))
+        {
+            index_entry_remove(index, entry);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+// Drops the entries under a path that is now a file itself, left from
+// when it was a directory; a tree cannot hold both
+static size_t remove_shadowed_entries(index_t *index)
+{
+    size_t removed = 0;
+    index_hash_entry_t *entry, *tmp;
+    HASH_ITER(hh, index->entries, entry, tmp)
+    {
+        const char *path = entry->entry.path;
+        for (const char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/'))
+        {
+            index_hash_entry_t *file;
+            HASH_FIND(hh, index->entries, path, slash - path, file);
+            if (file)
+            {
+                if (index->cache_tree)
+                    cache_tree_invalidate(index->cache_tree, path);
+                index_entry_remove(index, entry);
+                removed++;
+                break;
+            }
+        }
+    }
+    return removed;
+}
+
+static void report_stage_failure(const char *filepath)
+{
+    printf("Error: Failed to stage file '%s'\n", filepath);
+    fprintf(stderr, "Error: Failed to stage file '%s'\n", filepath);
+}
+
+// Stores one batch of files; runs on a worker thread. Files whose stat
+// data matches their index entry are not read at all. Small files are
+// read into the batch's arena and hashed together, larger ones stream
+// through object_write, and chunked ones are left for the caller.
+static void stage_batch(size_t batch, void *ctx)
+{
+    stage_ctx_t *stage = ctx;
+    staged_file_t *files = stage->files + batch * STAGE_BATCH_FILES;
+    size_t count = stage->count - batch * STAGE_BATCH_FILES;
+    if (count > STAGE_BATCH_FILES)
+        count = STAGE_BATCH_FILES;
+
+    odb_hash_job_t jobs[STAGE_BATCH_FILES];
+    staged_file_t *job_files[STAGE_BATCH_FILES];
+    size_t job_count = 0;
+    arena_t *arena = NULL;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        staged_file_t *file = &files[i];
+        if (stat(file->path, &file->st) != 0)
+        {
+            if (errno == ENOENT)
+            {
+                file->state = STAGE_MISSING;
+                continue;
+            }
+            fprintf(stderr, "Error: Cannot stat file '%s'\n", file->path);
+            file->state = STAGE_FAILED;
+            continue;
+        }
+
+        index_hash_entry_t *entry;
+        HASH_FIND_STR(stage->index->entries, file->path, entry);
+        if (entry && index_entry_matches(stage->index, &entry->entry, &file->st))
+        {
+            file->oid = entry->entry.oid;
+            file->state = STAGE_UNCHANGED;
+            continue;
+        }
+
+        if (S_ISREG(file->st.st_mode) && file->st.st_size < OBJECT_CHUNK_SIZE)
+        {
+            size_t size = file->st.st_size;
+            void *data = NULL;
+            if ((arena || (arena = arena_create(0))) && (data = arena_alloc(arena, size)) &&
+                read_file_exact(file->path, data, size) == 0)
+            {
+                jobs[job_count].type = OBJ_BLOB;
+                jobs[job_count].data = data;
+                jobs[job_count].size = size;
+                job_files[job_count++] = file;
+            }
+            else
+            {
+                file->state = STAGE_FAILED;
+            }
+        }
+        else if (S_ISREG(file->st.st_mode) && chunk_applies(file->st.st_size))
+        {
+            file->state = STAGE_CHUNKED;
+        }
+        else
+        {
+            file->state = write_blob(file) == 0 ? STAGE_STORED : STAGE_FAILED;
+        }
+    }
+
+    int hashed = odb_hash_batch(jobs, job_count) == 0;
+    for (size_t i = 0; i < job_count; i++)
+    {
+        staged_file_t *file = job_files[i];
+        file->oid = jobs[i].oid;
+        file->state = hashed && odb_write_hashed(OBJ_BLOB, jobs[i].data, jobs[i].size, &jobs[i].oid) == 0
+                          ? STAGE_STORED
+                          : STAGE_FAILED;
+    }
+    arena_destroy(arena);
+}
+
 int index_stage_files(index_t *index, UT_array *files)
 {
     if (utarray_len(files) == 0)
@@ -154,19 +1100,97 @@ int index_stage_files(index_t *index, UT_array *files)
         return 0;
     }
 
-    char **p = NULL;
-    while ((p = (char **)utarray_next(files, p)))
+    // Staging looks entries up by path
+    if (index_load_entries(index) != 0)
+    {
+        return -1;
+    }
+
+    stage_ctx_t stage;
+    stage.index = index;
+    stage.count = utarray_len(files);
+    stage.files = calloc(stage.count, sizeof(staged_file_t));
+    if (!stage.files)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    for (size_t i = 0; i < stage.count; i++)
+    {
+        stage.files[i].path = *(char **)utarray_eltptr(files, i);
+    }
+
+    parallel_for((stage.count + STAGE_BATCH_FILES - 1) / STAGE_BATCH_FILES, stage_batch, &stage);
+
+    // Chunked files share the chunker's running totals, so they are stored
+    // here, one at a time; each is split and hashed in batches anyway
+    for (size_t i = 0; i < stage.count; i++)
     {
+        staged_file_t *file = &stage.files[i];
+        if (file->state == STAGE_CHUNKED)
+            file->state = write_blob(file) == 0 ? STAGE_STORED : STAGE_FAILED;
+    }
 
-        if (write_staged_file(index, *p) != 0)
+    // The index changes in argument order, whatever order the workers
+    // finished in
+    int result = 0;
+    size_t changed = 0, added = 0;
+    for (size_t i = 0; i < stage.count && result == 0; i++)
+    {
+        staged_file_t *file = &stage.files[i];
+        if (file->state == STAGE_MISSING)
         {
-            printf("Error: Failed to stage file '%s'\n", *p);
-            fprintf(stderr, "Error: Failed to stage file '%s'\n", *p);
-            return -1;
+            size_t removed = remove_index_entries(index, file->path);
+            if (removed == 0)
+            {
+                fprintf(stderr, "Error: '%s' is not a valid file or directory\n", file->path);
+                result = -1;
+                break;
+            }
+            printf("Removed '%s'\n", file->path);
+            changed += removed;
+            continue;
         }
+        if (file->state != STAGE_STORED && file->state != STAGE_UNCHANGED)
+        {
+            report_stage_failure(file->path);
+            result = -1;
+            break;
+        }
+        if (file->state == STAGE_STORED)
+        {
+            index_hash_entry_t *entry;
+            HASH_FIND_STR(index->entries, file->path, entry);
+            added += !entry;
+            if (update_index_entry(index, file->path, &file->oid, &file->st) != 0)
+            {
+                result = -1;
+                break;
+            }
+            changed++;
+        }
+        printf("Added '%s'\n", file->path);
+    }
+    free(stage.files);
+    if (result != 0)
+    {
+        return -1;
+    }
+    // Only a new path can turn a directory into a file
+    if (added > 0)
+    {
+        changed += remove_shadowed_entries(index);
+    }
+    if (changed == 0)
+    {
+        return 0;
     }
 
-    index_write(index);
+    // Objects first, so the index never names a blob that could be lost
+    if (odb_sync_barrier() != 0 || index_write(index) != 0)
+    {
+        return -1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
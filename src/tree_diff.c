@@ -3,6 +3,10 @@
 #include "staging.h"
 #include "object.h"
 #include "object_types.h"
+#include "tree_iter.h"
+#include "arena.h"
+#include "odb.h"
+#include "commit_graph.h"
 #include "util.h"
 
 #include <stdio.h>
@@ -27,20 +31,22 @@ typedef enum
     STATUS_UNMODIFIED,
     STATUS_UNTRACKED,
     STATUS_STAGED,
-    STATUS_STAGED_MODIFIED
+    STATUS_STAGED_DELETED
 } diff_status_t;
 
 typedef struct
 {
-    char filepath[PATH_MAX];
-    char hash_in_commit[HEX_SIZE];      // null when not in commit tree
-    char hash_in_index[HEX_SIZE];       // null when not in index
-    char hash_in_working_dir[HEX_SIZE]; // null when not in working dir
+    object_id_t oid_in_commit;      // null when not in commit tree
+    object_id_t oid_in_index;       // null when not in index
+    object_id_t oid_in_working_dir; // null when not in working dir
     int in_working_dir;
     int in_index;
     int in_commit;
+    int stat_clean; // working dir oid taken from the index, not hashed
+    struct stat st; // of the working dir file
     diff_status_t status;
     UT_hash_handle hh;
+    char filepath[]; // sized to the path, one entry per file in the tree
 } file_entry_t;
 
 typedef struct
@@ -56,6 +62,25 @@ struct diff
     size_t size;
 };
 
+// Working tree files found by the walk, hashed together once it is done
+#define HASH_BATCH_FILES 256
+#define HASH_BATCH_BYTES (4 * 1024 * 1024)
+
+typedef struct
+{
+    file_entry_t *entry;
+    const char *full_path;
+    size_t size;
+} pending_file_t;
+
+typedef struct
+{
+    pending_file_t *files;
+    size_t count;
+    size_t capacity;
+    arena_t *paths;
+} pending_list_t;
+
 diff_t *diff_init()
 {
     diff_t *diff = malloc(sizeof(diff_t));
@@ -82,86 +107,173 @@ void diff_free(diff_t *diff)
 
 file_entry_t *file_entry_init(const char *filepath)
 {
-    file_entry_t *file_entry = malloc(sizeof(file_entry_t));
+    size_t len = strlen(filepath) + 1;
+    file_entry_t *file_entry = malloc(sizeof(file_entry_t) + len);
     if (!file_entry)
         return NULL;
 
-    strcpy(file_entry->filepath, filepath);
-    memset(file_entry->hash_in_commit, 0, HEX_SIZE);
-    memset(file_entry->hash_in_index, 0, HEX_SIZE);
+    memcpy(file_entry->filepath, filepath, len);
+    oid_clear(&file_entry->oid_in_commit);
+    oid_clear(&file_entry->oid_in_index);
+    oid_clear(&file_entry->oid_in_working_dir);
     file_entry->in_working_dir = 0;
     file_entry->in_index = 0;
     file_entry->in_commit = 0;
+    file_entry->stat_clean = 0;
     file_entry->status = STATUS_UNTRACKED;
 
     return file_entry;
 }
 
-static int walk_commit_tree_recursive(object_t *tree, diff_t *diff)
+// Directories whose tree in HEAD is the one the cache tree holds for them,
+// so every index entry below them is in HEAD as it is
+typedef struct
 {
-    tree_data_t *data = (tree_data_t *)tree->data;
-    tree_entry_t *entry, *tmp;
-    HASH_ITER(hh, data->entries, entry, tmp)
+    UT_hash_handle hh;
+    char path[];
+} same_dir_t;
+
+static int same_dir_add(same_dir_t **dirs, const char *path)
+{
+    size_t len = strlen(path) + 1;
+    same_dir_t *dir = malloc(sizeof(same_dir_t) + len);
+    if (!dir)
     {
-        if (S_ISDIR(entry->mode))
+        printf("Error: Failed to allocate memory\n");
+        return -1;
+    }
+    memcpy(dir->path, path, len);
+    HASH_ADD_STR(*dirs, path, dir);
+    return 0;
+}
+
+static int walk_commit_tree_recursive(const object_id_t *tree_oid, const char *dir, cache_tree_t *cache,
+                                      diff_t *diff, same_dir_t **same)
+{
+    if (cache && cache->entry_count != CACHE_TREE_INVALID && oid_equal(&cache->oid, tree_oid))
+    {
+        return same_dir_add(same, dir);
+    }
+
+    object_t *tree = object_lookup(tree_oid, OBJ_TREE);
+    if (!tree)
+    {
+        printf("Error: Failed to read tree object\n");
+        return -1;
+    }
+
+    const tree_data_t *data = (const tree_data_t *)tree->data;
+    tree_iter_t iter;
+    tree_entry_view_t entry;
+    int result;
+    tree_iter_init(&iter, data->raw, data->raw_size);
+    while ((result = tree_iter_next(&iter, &entry)) > 0)
+    {
+        if (S_ISDIR(entry.mode))
         {
-            object_t *subtree = object_init(OBJ_TREE);
-            if (object_read(subtree, entry->hash) != 0)
+            // Directories carry just their own name
+            char path[PATH_MAX];
+            int len = dir[0] ? snprintf(path, sizeof(path), "%s/%s", dir, entry.name)
+                             : snprintf(path, sizeof(path), "%s", entry.name);
+            if (len < 0 || (size_t)len >= sizeof(path))
+            {
+                result = -1;
+                break;
+            }
+            cache_tree_t *sub = cache ? cache_tree_sub(cache, entry.name, entry.name_len, 0) : NULL;
+            if (walk_commit_tree_recursive(&entry.oid, path, sub, diff, same) != 0)
             {
-                printf("Error: Failed to read tree object\n");
+                object_free(tree);
                 return -1;
             }
-            walk_commit_tree_recursive(subtree, diff);
+            continue;
         }
-        else if (S_ISREG(entry->mode))
+
+        // Files carry their full path
+        file_entry_t *file_entry;
+        HASH_FIND_STR(diff->entries, entry.name, file_entry);
+        if (!file_entry)
         {
-            file_entry_t *file_entry;
-            HASH_FIND_STR(diff->entries, entry->name, file_entry);
+            file_entry = file_entry_init(entry.name);
             if (!file_entry)
             {
-                file_entry = file_entry_init(entry->name);
-                if (!file_entry)
-                {
-                    printf("Error: Failed to allocate memory\n");
-                    return -1;
-                }
-                HASH_ADD_STR(diff->entries, filepath, file_entry);
-                diff->size++;
+                printf("Error: Failed to allocate memory\n");
+                object_free(tree);
+                return -1;
             }
-            strcpy(file_entry->hash_in_commit, entry->hash);
-            file_entry->in_commit = 1;
+            HASH_ADD_STR(diff->entries, filepath, file_entry);
+            diff->size++;
         }
+        file_entry->oid_in_commit = entry.oid;
+        file_entry->in_commit = 1;
+    }
+    if (result < 0)
+    {
+        printf("Error: Tree %s is malformed\n", oid_hex(tree_oid));
+    }
+    object_free(tree);
+    return result < 0 ? -1 : 0;
+}
+
+// Whether path lies below one of the directories in dirs
+static int under_same_dir(same_dir_t *dirs, const char *path)
+{
+    for (const char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        same_dir_t *dir;
+        HASH_FIND(hh, dirs, path, (unsigned)(slash - path), dir);
+        if (dir)
+            return 1;
     }
     return 0;
 }
 
-int walk_commit_tree(const char *commit_hash, diff_t *diff)
+int walk_commit_tree(const object_id_t *commit_oid, diff_t *diff, cache_tree_t *cache)
 {
-    char tree_hash[HEX_SIZE];
-    if (object_get_commit_tree_hash(commit_hash, tree_hash) != 0)
+    object_id_t tree_oid;
+    if (commit_graph_read_commit(commit_oid, &tree_oid, NULL) != 0)
     {
         printf("Error: Failed to get commit tree hash\n");
         return -1;
     }
 
-    object_t *tree = object_init(OBJ_TREE);
-    if (object_read(tree, tree_hash) != 0)
+    // A directory the index has not touched since HEAD is not read; its
+    // entries are in HEAD with the ids the index has for them
+    same_dir_t *same = NULL;
+    int root_same = cache && cache->entry_count != CACHE_TREE_INVALID && oid_equal(&cache->oid, &tree_oid);
+    int result = root_same ? 0 : walk_commit_tree_recursive(&tree_oid, "", cache, diff, &same);
+    if (result != 0)
     {
-        printf("Error: Failed to read tree object\n");
-        return -1;
+        printf("Error: Failed to walk commit tree\n");
+    }
+    else if (root_same || same)
+    {
+        file_entry_t *entry;
+        for (entry = diff->entries; entry != NULL; entry = entry->hh.next)
+        {
+            if (entry->in_index && !entry->in_commit && (root_same || under_same_dir(same, entry->filepath)))
+            {
+                entry->oid_in_commit = entry->oid_in_index;
+                entry->in_commit = 1;
+            }
+        }
     }
 
-    if (walk_commit_tree_recursive(tree, diff) != 0)
+    same_dir_t *dir, *tmp;
+    HASH_ITER(hh, same, dir, tmp)
     {
-        printf("Error: Failed to walk commit tree\n");
-        return -1;
+        HASH_DEL(same, dir);
+        free(dir);
     }
-    return 0;
+    return result;
 }
+
 void walk_staging(const index_t *index, diff_t *diff)
 {
-    index_hash_entry_t *entry;
-    for (entry = index->entries; entry != NULL; entry = entry->hh.next)
+    index_iter_t iter;
+    const index_entry_t *entry;
+    index_iter_init(&iter, index);
+    while (index_iter_next(&iter, &entry) > 0)
     {
         file_entry_t *file_entry;
         HASH_FIND_STR(diff->entries, entry->path, file_entry);
@@ -176,24 +288,91 @@ void walk_staging(const index_t *index, diff_t *diff)
             diff->size++;
             HASH_ADD_STR(diff->entries, filepath, file_entry);
         }
-        strcpy(file_entry->hash_in_index, entry->entry.hash);
+        file_entry->oid_in_index = entry->oid;
         file_entry->in_index = 1;
     }
 }
 
-int walk_working_dir(const char *path, diff_t *diff)
+static int pending_add(pending_list_t *pending, file_entry_t *entry, const char *full_path, size_t size)
 {
-    // Initialize ignore list once at the root level
-    static ignore_list_t ignore_list;
-    static int ignore_list_initialized = 0;
+    if (pending->count == pending->capacity)
+    {
+        size_t capacity = pending->capacity ? pending->capacity * 2 : 256;
+        pending_file_t *files = realloc(pending->files, capacity * sizeof(pending_file_t));
+        if (!files)
+            return -1;
+        pending->files = files;
+        pending->capacity = capacity;
+    }
 
-    if (!ignore_list_initialized)
+    const char *path = arena_strndup(pending->paths, full_path, strlen(full_path));
+    if (!path)
+        return -1;
+
+    pending_file_t *file = &pending->files[pending->count++];
+    file->entry = entry;
+    file->full_path = path;
+    file->size = size;
+    return 0;
+}
+
+// Small files are read a batch at a time and hashed together; larger ones
+// are streamed through compute_file_hash
+static int hash_pending(pending_list_t *pending)
+{
+    odb_hash_job_t jobs[HASH_BATCH_FILES];
+    file_entry_t *owners[HASH_BATCH_FILES];
+    size_t i = 0;
+
+    while (i < pending->count)
     {
-        memset(&ignore_list, 0, sizeof(ignore_list));
-        load_myignore(".", &ignore_list);
-        ignore_list_initialized = 1;
+        arena_t *arena = arena_create(0);
+        size_t count = 0, bytes = 0;
+        int result = arena ? 0 : -1;
+
+        for (; result == 0 && i < pending->count && count < HASH_BATCH_FILES && bytes < HASH_BATCH_BYTES; i++)
+        {
+            pending_file_t *file = &pending->files[i];
+            if (file->entry->stat_clean)
+                continue;
+            if (file->size >= OBJECT_CHUNK_SIZE)
+            {
+                result = compute_file_hash((char *)file->full_path, &file->entry->oid_in_working_dir);
+                continue;
+            }
+
+            void *data = arena_alloc(arena, file->size);
+            if (!data || read_file_exact(file->full_path, data, file->size) != 0)
+            {
+                result = -1;
+                break;
+            }
+            jobs[count].type = OBJ_BLOB;
+            jobs[count].data = data;
+            jobs[count].size = file->size;
+            owners[count++] = file->entry;
+            bytes += file->size;
+        }
+
+        if (result == 0 && odb_hash_batch(jobs, count) == 0)
+        {
+            for (size_t j = 0; j < count; j++)
+                owners[j]->oid_in_working_dir = jobs[j].oid;
+        }
+        else
+        {
+            result = -1;
+        }
+
+        arena_destroy(arena);
+        if (result != 0)
+            return -1;
     }
+    return 0;
+}
 
+static int walk_dir(const char *path, diff_t *diff, ignore_list_t *ignore_list, pending_list_t *pending)
+{
     DIR *dir = opendir(path);
     if (!dir)
     {
@@ -230,31 +409,26 @@ int walk_working_dir(const char *path, diff_t *diff)
         }
 
         // Check if path should be ignored
-        if (is_ignored(relative_path, &ignore_list))
+        if (is_ignored(relative_path, ignore_list))
             continue;
 
         if (S_ISDIR(st.st_mode))
         {
-            walk_working_dir(full_path, diff);
+            walk_dir(full_path, diff, ignore_list, pending);
         }
         if (S_ISREG(st.st_mode))
         {
             file_entry_t *file_entry = file_entry_init(relative_path);
-            if (!file_entry)
+            if (!file_entry || pending_add(pending, file_entry, full_path, st.st_size) != 0)
             {
                 printf("Error: Failed to allocate memory\n");
-                closedir(dir);
-                return -1;
-            }
-
-            if (compute_file_hash(full_path, file_entry->hash_in_working_dir) != 0)
-            {
                 free(file_entry);
                 closedir(dir);
                 return -1;
             }
 
             file_entry->in_working_dir = 1;
+            file_entry->st = st;
             HASH_ADD_STR(diff->entries, filepath, file_entry);
             diff->size++;
         }
@@ -264,6 +438,56 @@ int walk_working_dir(const char *path, diff_t *diff)
     return 0;
 }
 
+// Files whose stat data still matches their index entry keep the index's
+// oid, so only new, changed and racily clean files are read and hashed
+static int match_index(const index_t *index, diff_t *diff)
+{
+    index_iter_t iter;
+    const index_entry_t *entry;
+    int result;
+    index_iter_init(&iter, index);
+    while ((result = index_iter_next(&iter, &entry)) > 0)
+    {
+        file_entry_t *file_entry;
+        HASH_FIND_STR(diff->entries, entry->path, file_entry);
+        if (file_entry && file_entry->in_working_dir && index_entry_matches(index, entry, &file_entry->st))
+        {
+            file_entry->oid_in_working_dir = entry->oid;
+            file_entry->stat_clean = 1;
+        }
+    }
+    return result;
+}
+
+int walk_working_dir(const char *path, diff_t *diff, const index_t *index)
+{
+    // Initialize ignore list once at the root level
+    static ignore_list_t ignore_list;
+    static int ignore_list_initialized = 0;
+
+    if (!ignore_list_initialized)
+    {
+        memset(&ignore_list, 0, sizeof(ignore_list));
+        load_myignore(".", &ignore_list);
+        ignore_list_initialized = 1;
+    }
+
+    pending_list_t pending = {0};
+    pending.paths = arena_create(0);
+    if (!pending.paths)
+        return -1;
+
+    int result = walk_dir(path, diff, &ignore_list, &pending);
+    if (result == 0 && index)
+        result = match_index(index, diff);
+    if (result == 0)
+        result = hash_pending(&pending);
+
+    free(pending.files);
+    arena_destroy(pending.paths);
+    return result;
+}
+
 static void status_list_init(status_list_t *list)
 {
     list->files = malloc(sizeof(char *) * 10); // Initial capacity
@@ -301,75 +525,64 @@ void diff_print(const diff_t *diff)
         status_list_init(&lists[i]);
     }
 
-    // Categorize files into appropriate lists
+    // Categorize files into appropriate lists: the index against HEAD for
+    // what is staged, the working tree against the index for what is not
     file_entry_t *entry;
     for (entry = diff->entries; entry != NULL; entry = entry->hh.next)
     {
-        if (entry->in_working_dir && !entry->in_index && !entry->in_commit)
-        {
-            status_list_add(&lists[STATUS_UNTRACKED], entry->filepath);
-        }
-        else if (entry->in_working_dir && entry->in_index && !entry->in_commit)
+        if (entry->in_index && !entry->in_commit)
         {
-            if (strcmp(entry->hash_in_working_dir, entry->hash_in_index) == 0)
-            {
-                status_list_add(&lists[STATUS_UNMODIFIED], entry->filepath);
-            }
-            else
-            {
-                status_list_add(&lists[STATUS_MODIFIED], entry->filepath);
-            }
+            status_list_add(&lists[STATUS_ADDED], entry->filepath);
         }
-        else if (entry->in_working_dir && entry->in_index && entry->in_commit)
+        else if (!entry->in_index && entry->in_commit)
         {
-            if (strcmp(entry->hash_in_index, entry->hash_in_commit) == 0)
-            {
-                if (strcmp(entry->hash_in_working_dir, entry->hash_in_index) == 0)
-                {
-                    status_list_add(&lists[STATUS_UNMODIFIED], entry->filepath);
-                }
-                else
-                {
-                    status_list_add(&lists[STATUS_STAGED], entry->filepath);
-                }
-            }
-            else
-            {
-                status_list_add(&lists[STATUS_STAGED_MODIFIED], entry->filepath);
-            }
+            status_list_add(&lists[STATUS_STAGED_DELETED], entry->filepath);
         }
-        else if (!entry->in_working_dir && entry->in_index && entry->in_commit)
+        else if (entry->in_index && !oid_equal(&entry->oid_in_index, &entry->oid_in_commit))
         {
-            status_list_add(&lists[STATUS_DELETED], entry->filepath);
+            status_list_add(&lists[STATUS_STAGED], entry->filepath);
         }
-        else if (!entry->in_working_dir && !entry->in_index && entry->in_commit)
+
+        if (!entry->in_index)
         {
-            status_list_add(&lists[STATUS_DELETED], entry->filepath);
+            if (entry->in_working_dir)
+            {
+                status_list_add(&lists[STATUS_UNTRACKED], entry->filepath);
+            }
         }
-        else if (!entry->in_working_dir && entry->in_index && !entry->in_commit)
+        else if (!entry->in_working_dir)
         {
             status_list_add(&lists[STATUS_DELETED], entry->filepath);
         }
-        else if (entry->in_working_dir && !entry->in_index && entry->in_commit)
+        else if (!oid_equal(&entry->oid_in_working_dir, &entry->oid_in_index))
         {
-            status_list_add(&lists[STATUS_MODIFIED], entry->filepath); // or create new STATUS_REMOVED_FROM_INDEX
+            status_list_add(&lists[STATUS_MODIFIED], entry->filepath);
         }
         else
         {
-            printf("Error: Unhandled case\n");
+            status_list_add(&lists[STATUS_UNMODIFIED], entry->filepath);
         }
     }
 
     // Print staged changes
-    if (lists[STATUS_STAGED].count > 0)
+    size_t staged = lists[STATUS_ADDED].count + lists[STATUS_STAGED].count + lists[STATUS_STAGED_DELETED].count;
+    if (staged > 0)
     {
         printf(GREEN "Changes to be committed:\n" RESET);
         printf("  (use \"vcs reset HEAD <file>...\" to unstage)\n\n");
 
+        for (size_t i = 0; i < lists[STATUS_ADDED].count; i++)
+        {
+            printf("\t" GREEN "new file: %s\n" RESET, lists[STATUS_ADDED].files[i]);
+        }
         for (size_t i = 0; i < lists[STATUS_STAGED].count; i++)
         {
             printf("\t" GREEN "modified: %s\n" RESET, lists[STATUS_STAGED].files[i]);
         }
+        for (size_t i = 0; i < lists[STATUS_STAGED_DELETED].count; i++)
+        {
+            printf("\t" GREEN "deleted: %s\n" RESET, lists[STATUS_STAGED_DELETED].files[i]);
+        }
         printf("\n");
     }
 
@@ -402,7 +615,8 @@ void diff_print(const diff_t *diff)
         printf("\n");
     }
 
-    if (lists[STATUS_UNTRACKED].count > 0)
+    if (staged == 0 && (lists[STATUS_MODIFIED].count > 0 || lists[STATUS_DELETED].count > 0 ||
+                        lists[STATUS_UNTRACKED].count > 0))
     {
         printf("no changes added to commit (use \"vcs add\" and/or \"vcs commit -a\")\n");
     }
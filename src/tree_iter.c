@@ -0,0 +1,137 @@
+#include "tree_iter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void tree_iter_init(tree_iter_t *iter, const void *data, size_t size)
+{
+    iter->ptr = (const unsigned char *)data;
+    iter->end = iter->ptr + size;
+}
+
+int tree_iter_next(tree_iter_t *iter, tree_entry_view_t *out)
+{
+    if (iter->ptr >= iter->end)
+        return 0;
+
+    const unsigned char *ptr = iter->ptr;
+    const unsigned char *nul = memchr(ptr, '\0', iter->end - ptr);
+    if (!nul || (size_t)(iter->end - nul - 1) < SHA256_SIZE)
+        return -1;
+
+    mode_t mode = 0;
+    while (ptr < nul && *ptr != ' ')
+    {
+        if (*ptr < '0' || *ptr > '7')
+            return -1;
+        mode = mode * 8 + (*ptr - '0');
+        ptr++;
+    }
+    if (ptr == iter->ptr || ptr == nul)
+        return -1;
+
+    out->mode = mode;
+    out->name = (const char *)ptr + 1;
+    out->name_len = nul - ptr - 1;
+    memcpy(out->oid.hash, nul + 1, SHA256_SIZE);
+
+    iter->ptr = nul + 1 + SHA256_SIZE;
+    return 1;
+}
+
+int tree_name_cmp(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp != 0)
+        return cmp;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+int tree_index_init(tree_index_t *index, const void *data, size_t size)
+{
+    index->data = (const unsigned char *)data;
+    index->size = size;
+    index->offsets = NULL;
+    index->count = 0;
+    index->sorted = 1;
+
+    // Every entry takes at least "0 x\0" plus the digest
+    size_t capacity = size / (4 + SHA256_SIZE) + 1;
+    index->offsets = malloc(capacity * sizeof(uint32_t));
+    if (!index->offsets)
+        return -1;
+
+    tree_iter_t iter;
+    tree_entry_view_t entry, prev = {0};
+    tree_iter_init(&iter, data, size);
+    for (;;)
+    {
+        uint32_t offset = (uint32_t)(iter.ptr - index->data);
+        int result = tree_iter_next(&iter, &entry);
+        if (result == 0)
+            break;
+        if (result < 0 || index->count == capacity)
+        {
+            tree_index_free(index);
+            return -1;
+        }
+
+        if (index->count > 0 && tree_name_cmp(prev.name, prev.name_len, entry.name, entry.name_len) >= 0)
+            index->sorted = 0;
+        index->offsets[index->count++] = offset;
+        prev = entry;
+    }
+    return 0;
+}
+
+void tree_index_free(tree_index_t *index)
+{
+    free(index->offsets);
+    index->offsets = NULL;
+    index->count = 0;
+}
+
+static void entry_at(const tree_index_t *index, size_t i, tree_entry_view_t *out)
+{
+    // Already validated by tree_index_init
+    tree_iter_t iter = {index->data + index->offsets[i], index->data + index->size};
+    tree_iter_next(&iter, out);
+}
+
+int tree_index_find(const tree_index_t *index, const char *name, tree_entry_view_t *out)
+{
+    size_t name_len = strlen(name);
+    tree_entry_view_t entry;
+
+    if (!index->sorted)
+    {
+        for (size_t i = 0; i < index->count; i++)
+        {
+            entry_at(index, i, &entry);
+            if (tree_name_cmp(entry.name, entry.name_len, name, name_len) == 0)
+            {
+                *out = entry;
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    size_t lo = 0, hi = index->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        entry_at(index, mid, &entry);
+        int cmp = tree_name_cmp(entry.name, entry.name_len, name, name_len);
+        if (cmp == 0)
+        {
+            *out = entry;
+            return 0;
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
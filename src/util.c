@@ -1,19 +1,25 @@
 #include "util.h"
 #include "config.h"
+#include "odb.h"
+#include "chunk.h"
 
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
-#include <openssl/evp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 int create_directory(const char *path)
 {
     struct stat st = {0};
     if (stat(path, &st) == -1)
     {
-        if (mkdir(path, 0755) == -1)
+        // Another thread may create it first
+        if (mkdir(path, 0755) == -1 && errno != EEXIST)
         {
             fprintf(stderr, "Error creating directory '%s': %s\n",
                     path, strerror(errno));
@@ -43,85 +49,198 @@ size_t get_filesize_by_fp(FILE *fp)
     return 0;
 }
 
-int hash_to_hex(const unsigned char *hash, char *hex)
+int compute_file_hash(char *filepath, object_id_t *oid)
 {
-    for (int i = 0; i < SHA256_SIZE; i++)
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
     {
-        sprintf(hex + i * 2, "%02x", hash[i]);
-    }
-    return 0;
-}
-int compute_file_hash(char *filepath, char *hash)
-{
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
         fprintf(stderr, "Error opening file '%s': %s\n",
                 filepath, strerror(errno));
         return -1;
     }
 
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    struct stat st;
+    int result = -1;
+    if (fstat(fd, &st) == 0)
+        result = chunk_applies(st.st_size) ? chunk_hash_fd(fd, st.st_size, oid)
+                                           : odb_hash_fd(fd, OBJ_BLOB, st.st_size, oid);
+    close(fd);
+    return result;
+}
 
-    // Create header
-    char header[OBJECT_HEADER_MAX];
-    int header_len = snprintf(header, sizeof(header), "blob %ld", size);
-    header[header_len] = '\0';  // Add null byte
+int read_file_exact(const char *filepath, void *buf, size_t size)
+{
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error opening file '%s': %s\n", filepath, strerror(errno));
+        return -1;
+    }
 
-    // Initialize hash context
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-    unsigned char hash_bytes[SHA256_SIZE];
-    unsigned int hash_len;
+    // One byte of room past size tells a grown file apart
+    unsigned char extra;
+    unsigned char *p = buf;
+    size_t have = 0;
+    ssize_t n;
+    while ((n = have < size ? read(fd, p + have, size - have) : read(fd, &extra, 1)) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (have == size)
+        {
+            have++;
+            break;
+        }
+        have += n;
+    }
+    close(fd);
 
-    if (!ctx) {
-        fclose(fp);
+    if (n < 0)
+    {
+        fprintf(stderr, "Error reading file '%s': %s\n", filepath, strerror(errno));
         return -1;
     }
-
-    // Start hashing
-    if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
-        fclose(fp);
-        EVP_MD_CTX_free(ctx);
+    if (have != size)
+    {
+        fprintf(stderr, "Error reading file '%s': size changed while reading\n", filepath);
         return -1;
     }
+    return 0;
+}
+
+int filepath_from_hash(const object_id_t *oid, char *filepath)
+{
+    char hex[HEX_SIZE];
+    oid_to_hex(oid, hex);
+    int len = snprintf(filepath, OBJECT_PATH_MAX, ".vcs/objects/%c%c/%.62s",
+                       hex[0], hex[1], hex + 2);
+    return len > 0 && len < OBJECT_PATH_MAX ? 0 : -1;
+}
 
-    // Hash header
-    if (!EVP_DigestUpdate(ctx, header, header_len + 1)) { // +1 for null byte
-        fclose(fp);
-        EVP_MD_CTX_free(ctx);
+int write_file_atomic(const char *path, const void *data, size_t len, int sync)
+{
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.lock", path);
+
+    // O_EXCL makes a concurrent writer fail instead of interleaving
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Failed to create '%s': %s\n", temp_path, strerror(errno));
         return -1;
     }
 
-
-    unsigned char buffer[4096];
-    size_t bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        if (!EVP_DigestUpdate(ctx, buffer, bytes)) {
-            fclose(fp);
-            EVP_MD_CTX_free(ctx);
-            return -1;
-        }
+    const unsigned char *p = data;
+    size_t left = len;
+    while (left > 0)
+    {
+        ssize_t n = write(fd, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        p += n;
+        left -= n;
     }
 
-    if (!EVP_DigestFinal_ex(ctx, hash_bytes, &hash_len)) {
-        fclose(fp);
-        EVP_MD_CTX_free(ctx);
+    int failed = left > 0 || (sync && fsync(fd) != 0);
+    if (close(fd) != 0)
+        failed = 1;
+    if (failed)
+    {
+        fprintf(stderr, "Error: Failed to write '%s': %s\n", temp_path, strerror(errno));
+        unlink(temp_path);
         return -1;
     }
 
-    EVP_MD_CTX_free(ctx);
-    fclose(fp);
+    if (rename(temp_path, path) != 0)
+    {
+        fprintf(stderr, "Error: Failed to rename '%s': %s\n", temp_path, strerror(errno));
+        unlink(temp_path);
+        return -1;
+    }
 
-    hash_to_hex(hash_bytes, hash);
+    // The rename itself is only durable once the directory is synced
+    if (sync)
+    {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", path);
+        char *slash = strrchr(dir, '/');
+        if (slash)
+            *slash = '\0';
+        else
+            strcpy(dir, ".");
+        return sync_directory(dir);
+    }
     return 0;
 }
 
-int filepath_from_hash(const char *hash, char *filepath)
+int sync_directory(const char *path)
 {
-    const int fp_size = HEX_SIZE + 14; 
-    snprintf(filepath, fp_size, ".vcs/objects/%c%c/%s",
-             hash[0], hash[1], hash + 2);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0)
+    {
+        fprintf(stderr, "Error: Failed to sync directory '%s': %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
     return 0;
 }
+
+uint32_t get_be32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+uint64_t get_be64(const unsigned char *p)
+{
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void put_be64(unsigned char *p, uint64_t v)
+{
+    put_be32(p, v >> 32);
+    put_be32(p + 4, (uint32_t)v);
+}
+
+static int perf_trace = 0;
+static pthread_once_t perf_trace_once = PTHREAD_ONCE_INIT;
+
+static void perf_trace_init(void)
+{
+    const char *trace = getenv("VCS_TRACE_PERF");
+    perf_trace = trace && *trace && strcmp(trace, "0") != 0;
+}
+
+// Asked from worker threads too
+int perf_trace_enabled(void)
+{
+    pthread_once(&perf_trace_once, perf_trace_init);
+    return perf_trace;
+}
+
+size_t peak_rss_kib(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+    return usage.ru_maxrss; // kilobytes elsewhere
+#endif
+}
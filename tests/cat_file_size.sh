@@ -0,0 +1,33 @@
+#!/bin/sh
+# cat-file -s on a chunked file reports the size of its content, not of
+# the chunk list standing in for it
+# Usage: cat_file_size.sh <path to mygit>
+
+MYGIT="$1"
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+"$MYGIT" init >/dev/null
+echo "core.chunkThreshold=1" >> .vcs/config
+seq 1 400000 > big.txt
+"$MYGIT" add big.txt >/dev/null
+"$MYGIT" commit -m "big" >/dev/null
+
+commit=$("$MYGIT" log | awk '/^commit/ { print $2; exit }')
+tree=$("$MYGIT" cat-file -p "$commit" | awk '/^tree/ { print $2 }')
+blob=$("$MYGIT" cat-file -p "$tree" | awk '$4 == "big.txt" { print $3 }')
+
+if [ "$("$MYGIT" cat-file -t "$blob")" != "chunks" ]
+then
+    echo "big.txt was not chunked" >&2
+    exit 1
+fi
+
+printed=$("$MYGIT" cat-file -p "$blob" | wc -c | tr -d ' ')
+reported=$("$MYGIT" cat-file -s "$blob")
+if [ "$printed" != "$reported" ]
+then
+    echo "cat-file -s reported $reported, -p printed $printed bytes" >&2
+    exit 1
+fi
@@ -0,0 +1,78 @@
+#!/bin/sh
+# A chunked file reads back byte-identical through cat-file -p, and an
+# edit in its middle stores only the chunks around the edit. Prints the
+# add and read-back times; SIZE_MIB sets the file size (default 8).
+# Usage: chunk_readback.sh <path to mygit>
+
+MYGIT="$1"
+SIZE_MIB="${SIZE_MIB:-8}"
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+now()
+{
+    date +%s.%N
+}
+
+# Prints "<label> <seconds> s, <MiB/s> MiB/s" for a run that started at $1
+report()
+{
+    awk -v label="$2" -v start="$1" -v end="$(now)" -v mib="$SIZE_MIB" \
+        'BEGIN { t = end - start; printf "%-24s %.2f s, %.0f MiB/s\n", label, t, (t > 0 ? mib / t : 0) }'
+}
+
+# Adds big.bin, checks that it reads back as it is, and prints how many
+# chunks the add stored
+add_and_check()
+{
+    start=$(now)
+    added=$("$MYGIT" add big.bin)
+    report "$start" "add ($1)" >&2
+    "$MYGIT" commit -m "$1" >/dev/null
+
+    commit=$("$MYGIT" log | awk '/^commit/ { print $2; exit }')
+    tree=$("$MYGIT" cat-file -p "$commit" | awk '/^tree/ { print $2 }')
+    list=$("$MYGIT" cat-file -p "$tree" | awk '$4 == "big.bin" { print $3 }')
+    if [ "$("$MYGIT" cat-file -t "$list")" != "chunks" ]
+    then
+        echo "big.bin was not chunked ($1)" >&2
+        exit 1
+    fi
+
+    start=$(now)
+    if ! "$MYGIT" cat-file -p "$list" | cmp -s - big.bin
+    then
+        echo "cat-file -p does not match big.bin ($1)" >&2
+        exit 1
+    fi
+    report "$start" "cat-file -p ($1)" >&2
+
+    printf '%s\n' "$added" | sed -n 's/.* chunks, \([0-9]*\) new .*/\1/p'
+}
+
+"$MYGIT" init >/dev/null
+echo "core.chunkThreshold=1" >> .vcs/config
+head -c $((SIZE_MIB * 1024 * 1024)) /dev/urandom > big.bin
+
+add_and_check "first" >/dev/null || exit 1
+
+# Overwrite 8 bytes in the middle
+printf 'overwrit' | dd of=big.bin bs=1 seek=$((SIZE_MIB * 512 * 1024)) conv=notrunc 2>/dev/null
+new=$(add_and_check "overwrite") || exit 1
+if [ -z "$new" ] || [ "$new" -gt 2 ]
+then
+    echo "overwriting 8 bytes stored '$new' new chunks" >&2
+    exit 1
+fi
+
+# Insert 19 bytes in the middle, shifting everything after them
+half=$((SIZE_MIB * 512 * 1024 + 4096))
+{ head -c "$half" big.bin; printf 'nineteen more bytes'; tail -c +$((half + 1)) big.bin; } > big.new
+mv big.new big.bin
+new=$(add_and_check "insert") || exit 1
+if [ -z "$new" ] || [ "$new" -gt 2 ]
+then
+    echo "inserting 19 bytes stored '$new' new chunks" >&2
+    exit 1
+fi
@@ -0,0 +1,38 @@
+#!/bin/sh
+# fsck exits 0 on a healthy store and 1 once an object is missing, with
+# every finding reported as "error: ..."
+# Usage: fsck_exit.sh <path to mygit>
+
+MYGIT="$1"
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+"$MYGIT" init >/dev/null &&
+    echo one > one.txt &&
+    "$MYGIT" add one.txt >/dev/null &&
+    "$MYGIT" commit -m "one" >/dev/null || exit 1
+
+if ! "$MYGIT" fsck >/dev/null
+then
+    echo "fsck failed on a healthy store" >&2
+    exit 1
+fi
+
+commit=$("$MYGIT" log | awk '/^commit/ { print $2; exit }')
+tree=$("$MYGIT" cat-file -p "$commit" | awk '/^tree/ { print $2 }')
+tree_path=.vcs/objects/$(echo "$tree" | cut -c1-2)/$(echo "$tree" | cut -c3-)
+chmod u+w "$tree_path" && rm "$tree_path" || exit 1
+
+out=$("$MYGIT" fsck)
+if [ $? -ne 1 ]
+then
+    echo "fsck did not exit 1 with a tree missing" >&2
+    exit 1
+fi
+if ! printf '%s\n' "$out" | grep -q "^error: missing tree $tree"
+then
+    echo "missing tree not reported as an error:" >&2
+    printf '%s\n' "$out" >&2
+    exit 1
+fi
@@ -0,0 +1,40 @@
+#!/bin/sh
+# status lists an edit that was added since HEAD under "Changes to be
+# committed", and an edit that was not under "Changes not staged"
+# Usage: status_staged.sh <path to mygit>
+
+MYGIT="$1"
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+"$MYGIT" init >/dev/null
+printf '.vcs\n' > .myignore
+mkdir -p dir/sub
+echo one > top.txt
+echo two > dir/sub/deep.txt
+echo three > dir/other.txt
+"$MYGIT" add .myignore top.txt dir >/dev/null
+"$MYGIT" commit -m "first" >/dev/null
+
+echo edit >> dir/sub/deep.txt
+"$MYGIT" add dir/sub/deep.txt >/dev/null
+echo edit >> top.txt
+
+out=$("$MYGIT" status)
+staged=$(printf '%s\n' "$out" | sed -n '/Changes to be committed/,/Changes not staged/p')
+unstaged=$(printf '%s\n' "$out" | sed -n '/Changes not staged/,$p')
+
+if ! printf '%s\n' "$staged" | grep -q 'modified: dir/sub/deep.txt'
+then
+    echo "staged edit missing from status:" >&2
+    printf '%s\n' "$out" >&2
+    exit 1
+fi
+if printf '%s\n' "$staged" | grep -q 'top.txt\|other.txt' ||
+    ! printf '%s\n' "$unstaged" | grep -q 'modified: top.txt'
+then
+    echo "unstaged edit reported as staged:" >&2
+    printf '%s\n' "$out" >&2
+    exit 1
+fi